@@ -0,0 +1,70 @@
+#include "ByteScan.hpp"
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+const char* scanByte(const char* p, const char* end, char c) {
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    // tail (or the whole range without SIMD)
+    while (p < end && *p != c)
+        ++p;
+    return p;
+}
+
+const char* scanPair(const char* p, const char* end, char a, char b) {
+    // compare the block at p against a and the block at p + 1 against b,
+    // so every vector load needs one byte of lookahead
+#if defined(__AVX2__)
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 33) {
+        __m256i c0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i c1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1));
+        __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi8(c0, va), _mm256_cmpeq_epi8(c1, vb));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i va16 = _mm_set1_epi8(a);
+    const __m128i vb16 = _mm_set1_epi8(b);
+    while (end - p >= 17) {
+        __m128i c0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+        __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(c0, va16), _mm_cmpeq_epi8(c1, vb16));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; end - p >= 2; ++p) {
+        if (p[0] == a && p[1] == b)
+            return p;
+    }
+    return end;
+}
@@ -0,0 +1,14 @@
+#ifndef BYTESCAN_HPP
+#define BYTESCAN_HPP
+
+#include <cstddef>
+
+// Vectorized byte search (AVX2 / SSE2 when the target has them, scalar otherwise).
+// Returns the first position of c in [p, end) or end if there is none.
+const char* scanByte(const char* p, const char* end, char c);
+
+// First position i in [p, end - 1) with p[i] == a && p[i + 1] == b, or end.
+// Used for the " :" trailing-parameter marker.
+const char* scanPair(const char* p, const char* end, char a, char b);
+
+#endif
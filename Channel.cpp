@@ -0,0 +1,92 @@
+#include "Channel.hpp"
+
+#include <algorithm>
+
+namespace {
+    struct ByFd {
+        bool operator()(const ChannelMember& m, int fd) const { return m.fd < fd; }
+    };
+}
+
+std::vector<ChannelMember>::iterator Channel::lookup(int fd) {
+    return std::lower_bound(roster.begin(), roster.end(), fd, ByFd());
+}
+
+std::vector<ChannelMember>::const_iterator Channel::lookup(int fd) const {
+    return std::lower_bound(roster.begin(), roster.end(), fd, ByFd());
+}
+
+bool Channel::hasFlag(int fd, unsigned char flag) const {
+    std::vector<ChannelMember>::const_iterator it = lookup(fd);
+    return it != roster.end() && it->fd == fd && (it->flags & flag);
+}
+
+bool Channel::setFlag(int fd, unsigned char flag, bool on) {
+    std::vector<ChannelMember>::iterator it = lookup(fd);
+    bool found = (it != roster.end() && it->fd == fd);
+    bool had = found && (it->flags & flag);
+    if (had == on)
+        return false;
+
+    if (on) {
+        if (!found)
+            it = roster.insert(it, ChannelMember(fd, 0));
+        it->flags |= flag;
+    } else {
+        it->flags &= ~flag;
+    }
+
+    int delta = on ? 1 : -1;
+    if (flag == ChannelMember::JOINED)
+        memberCount += delta;
+    else if (flag == ChannelMember::OP)
+        opCount += delta;
+
+    if (it->flags == 0)
+        roster.erase(it);
+    return true;
+}
+
+void Channel::removeClient(int fd) {
+    std::vector<ChannelMember>::iterator it = lookup(fd);
+    if (it == roster.end() || it->fd != fd)
+        return;
+    if (it->flags & ChannelMember::JOINED)
+        --memberCount;
+    if (it->flags & ChannelMember::OP)
+        --opCount;
+    roster.erase(it);
+}
+
+int Channel::firstMember() const {
+    for (std::vector<ChannelMember>::const_iterator it = roster.begin(); it != roster.end(); ++it) {
+        if (it->joined())
+            return it->fd;
+    }
+    return -1;
+}
+
+bool Channel::addRemoteMember(int fd, int link) {
+    if (!setFlag(fd, ChannelMember::JOINED, true))
+        return false;
+    setFlag(fd, ChannelMember::REMOTE, true);
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].fd == link) {
+            ++links[i].members;
+            return true;
+        }
+    }
+    links.push_back(ChannelLink(link));
+    links.back().members = 1;
+    return true;
+}
+
+void Channel::removeLinkMember(int link) {
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].fd != link)
+            continue;
+        if (--links[i].members == 0)
+            links.erase(links.begin() + i);
+        return;
+    }
+}
@@ -2,14 +2,45 @@
 #define CHANNEL_HPP
 
 #include <string>
-#include <set>
+#include <vector>
+
+// One roster entry: a client the channel knows about (member and/or invitee)
+struct ChannelMember {
+    enum {
+        JOINED  = 1,
+        OP      = 2,
+        INVITED = 4,
+        REMOTE  = 8  // a user of a linked server: reached through its link
+    };
+
+    int fd;
+    unsigned char flags;
+
+    ChannelMember(int f, unsigned char fl) : fd(f), flags(fl) {}
+    bool joined() const { return (flags & JOINED) != 0; }
+};
+
+// Members behind one server link: a channel line goes to the link once
+struct ChannelLink {
+    int fd;
+    size_t members;
+
+    ChannelLink(int f) : fd(f), members(0) {}
+};
 
 struct Channel {
     std::string name;
-    std::set<int> members; // store client fds
-    std::set<int> operators;
-    std::set<int> invited;
+    // sorted by fd, 8 bytes per entry; fan-out is a linear scan over it
+    std::vector<ChannelMember> roster;
+    size_t memberCount;
+    size_t opCount;
     std::string topic;
+    std::vector<ChannelLink> links;
+
+    // timestamps (s) for merging with a linked server's copy: the older channel
+    // keeps its modes and operators, the older topic wins
+    unsigned long ts;
+    unsigned long topicTs;
 
     // modes
     bool inviteOnly;     // +i
@@ -19,12 +50,40 @@ struct Channel {
     bool hasLimit;       // +l
     size_t userLimit;
 
-    Channel(): inviteOnly(false), 
+    Channel(): memberCount(0),
+                opCount(0),
+                ts(0),
+                topicTs(0),
+                inviteOnly(false), 
                 topicOpsOnly(false),
                 hasKey(false),
                 key(""),
                 hasLimit(false),
                 userLimit(0) {}
+
+    bool empty() const { return memberCount == 0; }
+    bool isMember(int fd) const { return hasFlag(fd, ChannelMember::JOINED); }
+    bool isOperator(int fd) const { return hasFlag(fd, ChannelMember::OP); }
+    bool isInvited(int fd) const { return hasFlag(fd, ChannelMember::INVITED); }
+
+    // every setter returns true if the flag actually changed
+    bool addMember(int fd) { return setFlag(fd, ChannelMember::JOINED, true); }
+    bool setOperator(int fd, bool on) { return setFlag(fd, ChannelMember::OP, on); }
+    bool setInvited(int fd, bool on) { return setFlag(fd, ChannelMember::INVITED, on); }
+    // a member of a linked server, counted on its link
+    bool addRemoteMember(int fd, int link);
+    // forget fd completely: membership, operator status and invite
+    // (a remote member's link count is the caller's: removeLinkMember)
+    void removeClient(int fd);
+    void removeLinkMember(int link);
+    // lowest fd among the members, -1 if none
+    int firstMember() const;
+
+    private:
+        bool hasFlag(int fd, unsigned char flag) const;
+        bool setFlag(int fd, unsigned char flag, bool on);
+        std::vector<ChannelMember>::iterator lookup(int fd);
+        std::vector<ChannelMember>::const_iterator lookup(int fd) const;
 };
 
 #endif
@@ -0,0 +1,170 @@
+#include "ChannelSnapshot.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char kMagic[8] = { 'I', 'R', 'C', 'S', 'N', 'A', 'P', '1' };
+    const size_t kHeader = sizeof(kMagic) + 4;
+
+    // modes, one bit each
+    enum {
+        INVITE_ONLY    = 1,
+        TOPIC_OPS_ONLY = 2,
+        HAS_KEY        = 4,
+        HAS_LIMIT      = 8
+    };
+}
+
+ChannelSnapshot::ChannelSnapshot() : _data(0), _len(0), _count(0) { }
+
+ChannelSnapshot::~ChannelSnapshot() {
+    if (_data)
+        munmap(const_cast<char*>(_data), _len);
+}
+
+bool ChannelSnapshot::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < kHeader) {
+        close(fd);
+        return false;
+    }
+    size_t len = static_cast<size_t>(st.st_size);
+    void* p = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED)
+        return false;
+
+    const char* data = static_cast<const char*>(p);
+    StateReader head(data + sizeof(kMagic), 4);
+    size_t count = head.u32();
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0 || (len - kHeader) / 4 < count) {
+        munmap(p, len);
+        return false;
+    }
+    _data = data;
+    _len = len;
+    _count = count;
+    return true;
+}
+
+StateReader ChannelSnapshot::record(size_t i) const {
+    if (i >= _count)
+        return StateReader(0, 0);
+    StateReader offset(_data + kHeader + 4 * i, 4);
+    size_t at = offset.u32();
+    if (at > _len)
+        return StateReader(0, 0);
+    return StateReader(_data + at, _len - at);
+}
+
+bool ChannelSnapshot::decode(StateReader& r, Channel& out) {
+    out.name = r.str();
+    out.topic = r.str();
+    out.ts = static_cast<unsigned long>(r.u64());
+    out.topicTs = static_cast<unsigned long>(r.u64());
+    unsigned char modes = r.u8();
+    out.inviteOnly = modes & INVITE_ONLY;
+    out.topicOpsOnly = modes & TOPIC_OPS_ONLY;
+    out.hasKey = modes & HAS_KEY;
+    out.key = r.str();
+    out.hasLimit = modes & HAS_LIMIT;
+    out.userLimit = static_cast<size_t>(r.u64());
+    return r.ok();
+}
+
+bool ChannelSnapshot::at(size_t i, Channel& out) const {
+    StateReader r = record(i);
+    return decode(r, out);
+}
+
+bool ChannelSnapshot::nameAt(size_t i, std::string& out) const {
+    StateReader r = record(i);
+    out = r.str();
+    return r.ok();
+}
+
+bool ChannelSnapshot::find(const std::string& name, Channel& out) const {
+    size_t lo = 0, hi = _count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        StateReader r = record(mid);
+        size_t len;
+        const char* key = r.bytes(len);
+        if (!r.ok())
+            return false; // a corrupt file finds nothing
+        int cmp = name.compare(0, std::string::npos, key, len);
+        if (cmp == 0)
+            return at(mid, out);
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return false;
+}
+
+void ChannelSnapshot::Builder::add(const Channel& ch) {
+    _offsets.u32(static_cast<uint32_t>(_records.data().size()));
+    ++_count;
+    unsigned char modes = (ch.inviteOnly ? INVITE_ONLY : 0) | (ch.topicOpsOnly ? TOPIC_OPS_ONLY : 0)
+                        | (ch.hasKey ? HAS_KEY : 0) | (ch.hasLimit ? HAS_LIMIT : 0);
+    _records.str(ch.name);
+    _records.str(ch.topic);
+    _records.u64(ch.ts);
+    _records.u64(ch.topicTs);
+    _records.u8(modes);
+    _records.str(ch.key);
+    _records.u64(ch.userLimit);
+}
+
+// offsets are relative to the records until here, where the header size is known
+void ChannelSnapshot::Builder::finish(std::string& image) const {
+    StateWriter head;
+    head.u32(_count);
+    uint32_t base = static_cast<uint32_t>(kHeader + 4 * _count);
+
+    image.assign(kMagic, sizeof(kMagic));
+    image += head.data();
+    StateReader offsets(_offsets.data().data(), _offsets.data().size());
+    StateWriter table;
+    for (uint32_t i = 0; i < _count; i++)
+        table.u32(base + offsets.u32());
+    image += table.data();
+    image += _records.data();
+}
+
+bool ChannelSnapshot::save(const std::string& path, const std::string& image) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    const char* p = image.data();
+    size_t left = image.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    // on disk before it replaces the last good one
+    if (fsync(fd) < 0 || close(fd) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,64 @@
+#ifndef CHANNELSNAPSHOT_HPP
+#define CHANNELSNAPSHOT_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+#include "Channel.hpp"
+#include "StateBuffer.hpp"
+
+// Channel metadata on disk (IRCSERV_STATE_FILE): name, topic, timestamps
+// and modes, no members.
+//
+//   "IRCSNAP1" u32 count  u32 offset[count]  record[count]
+//
+// Records are sorted by name and the offsets point at them, so a lookup is
+// a binary search in the mapped file: opening it reads the header only and
+// costs the same for ten channels or a million.
+class ChannelSnapshot {
+    public:
+        ChannelSnapshot();
+        ~ChannelSnapshot();
+
+        // maps path read-only; false if it is missing or not a snapshot
+        bool open(const std::string& path);
+        size_t size() const { return _count; }
+
+        // the record named name, if any (out: name, topic, ts and modes)
+        bool find(const std::string& name, Channel& out) const;
+        // the i-th record, in name order
+        bool at(size_t i, Channel& out) const;
+        // ... and only its name
+        bool nameAt(size_t i, std::string& out) const;
+
+        // Builds a file image: add() the channels in name order, then finish()
+        class Builder {
+            public:
+                Builder() : _count(0) {}
+                void add(const Channel& ch);
+                void finish(std::string& image) const;
+
+            private:
+                StateWriter _records;
+                StateWriter _offsets;
+                uint32_t _count;
+        };
+
+        // writes image to path atomically (a temporary file renamed over it)
+        static bool save(const std::string& path, const std::string& image);
+
+    private:
+        ChannelSnapshot(const ChannelSnapshot&);
+        ChannelSnapshot& operator=(const ChannelSnapshot&);
+
+        const char* _data; // the mapping, 0 if none
+        size_t _len;
+        size_t _count;
+
+        // the i-th record, from its name on (empty past the end: reads fail)
+        StateReader record(size_t i) const;
+        static bool decode(StateReader& r, Channel& out);
+};
+
+#endif
@@ -2,21 +2,99 @@
 #define CLIENT_HPP
 
 #include <string>
+#include <set>
 
+#include "LineBuffer.hpp"
+#include "Payload.hpp"
+#include "TimerWheel.hpp"
+
+// Connection record: everything the server keeps per fd lives here,
+// in one slot of the ClientTable.
+//
+// The IRC state is only touched under the server's state lock. The I/O
+// part (socket buffers and flush bookkeeping) belongs to the reactor shard
+// that accepted the connection and is only touched by that shard's thread.
 struct Client {
+    // IRCv3 capabilities, one bit each in caps
+    enum {
+        CAP_MESSAGE_TAGS = 1,
+        CAP_SERVER_TIME  = 2,
+        CAP_BATCH        = 4,
+        CAP_ECHO_MESSAGE = 16 // not renumbered: hot restart state carries the bits
+    };
+
+    // Delivery path first: sendPayload, deliver, markDirty, fanOut and
+    // TaggedLine::forCaps only read this part and the tail of out, which sit
+    // in the record's first 128 bytes, ahead of the strings and sets below.
     int fd;
+    unsigned int gen;   // bumped every time the slot is released
+    int shard;          // reactor shard that owns the socket
+    int link;           // -1: our own user, else the link toward a remote one
+    unsigned int fanoutEpoch; // last Server::fanOut that reached this client
+    bool inUse;         // slot holds an open connection
+    bool isLink;        // the connection to a linked server
+    unsigned char caps; // CAP REQ acknowledged
+
+    // I/O, owned by the shard
+    bool closing;       // disconnect once out is flushed
+    bool wantWrite;     // write interest registered with the poller (only after EAGAIN)
+    bool dirty;         // on the shard's flush list for this loop iteration
+    bool readPaused;    // SendQ over the soft limit: input is left in the socket
+    bool sendqExceeded; // over the hard limit, disconnected at the next flush
+    bool sending;       // completion backend: a send of out's front is in flight
+    OutQueue out;       // refs to shared payloads, drained with writev
 
     bool passOk;
     bool hasNick;
     bool hasUser;
     bool registered;
-    bool closing;
+    bool oper;          // OPER succeeded: STATS m
+    bool capNegotiating; // CAP LS / REQ before registering: held until CAP END
+
+    // server links: the connection to a linked server is a record like any
+    // client's (isLink, server = its name); a user of the network behind it
+    // gets a remote record (link = that connection's fd, server = its server)
+    std::string server;
+    unsigned long nickTs; // when the nick was taken (s), the older one wins a collision
 
     std::string nick;
     std::string user;
     std::string realname;
+    std::string prefix; // "nick!user@localhost", rebuilt by NICK / USER
+
+    // reverse index, so teardown only visits these channels
+    std::set<std::string> channels;  // channels this client is a member of
+    std::set<std::string> invitedTo; // channels holding an invite for this client
+
+    // liveness, owned by the shard (ms, TimerWheel::monotonicMs() based)
+    TimerNode timer;      // next deadline: registration, keepalive PING, idle limit
+    uint64_t connectedAt;
+    uint64_t lastInput;   // anything received
+    uint64_t lastCommand; // last command other than PING / PONG
+    uint64_t pingSentAt;
+    bool pingPending;     // our PING has not been answered (by anything) yet
+
+    // flood control and fair turns, owned by the shard
+    long floodTokens;         // thousandths of a command; negative: in debt
+    uint64_t floodRefilledAt; // ms
+    bool deferred;            // complete lines left in `in` for a later turn
+    bool throttled;           // ... because of the flood limit, not the line budget
+    bool floodHeld;           // throttled: the rest of its input is left in the socket
+    bool backlogged;          // on the shard's backlog for the next turn
+    bool heldFull;            // completion backend: held input is at its cap, reads stopped
+
+    LineBuffer in;      // bytes received but not parsed yet (allocated on first read)
+    std::string held;   // completion backend: received while earlier input waits
+    size_t heldFrom;    // held bytes before this one are handled already
 
-    Client() : fd(-1), passOk(false), hasNick(false), hasUser(false), registered(false), closing(false) {}
+    Client() : fd(-1), gen(1), shard(0), link(-1), fanoutEpoch(0), inUse(false), isLink(false), caps(0),
+               closing(false), wantWrite(false), dirty(false), readPaused(false), sendqExceeded(false),
+               sending(false),
+               passOk(false), hasNick(false), hasUser(false), registered(false), oper(false),
+               capNegotiating(false), nickTs(0),
+               connectedAt(0), lastInput(0), lastCommand(0), pingSentAt(0), pingPending(false),
+               floodTokens(0), floodRefilledAt(0), deferred(false), throttled(false), floodHeld(false), backlogged(false),
+               heldFull(false), heldFrom(0) {}
 };
 
 #endif
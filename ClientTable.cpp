@@ -0,0 +1,91 @@
+#include "ClientTable.hpp"
+
+ClientTable::ClientTable() : _chunks(MAX_CHUNKS, static_cast<Client*>(0)), _used(0), _count(0),
+                             _remoteCount(0), _nextRemote(REMOTE_BASE) { }
+
+ClientTable::~ClientTable() {
+    for (size_t i = 0; i < _chunks.size(); i++)
+        delete[] _chunks[i];
+}
+
+// the record for fd, 0 if its chunk was never allocated
+Client* ClientTable::slot(int fd) const {
+    if (fd < 0 || fd >= MAX_FDS)
+        return 0;
+    Client* chunk = _chunks[fd >> CHUNK_BITS];
+    return chunk ? &chunk[fd & (CHUNK_SIZE - 1)] : 0;
+}
+
+Client* ClientTable::find(int fd) {
+    Client* c = slot(fd);
+    return c && c->inUse ? c : 0;
+}
+
+const Client* ClientTable::find(int fd) const {
+    const Client* c = slot(fd);
+    return c && c->inUse ? c : 0;
+}
+
+Client& ClientTable::open(int fd) {
+    // grows only here (accept); chunks below the new one are allocated too,
+    // so [0, limit()) stays dense for scans
+    while (static_cast<size_t>(fd >> CHUNK_BITS) >= _used)
+        _chunks[_used++] = new Client[CHUNK_SIZE];
+
+    Client& c = at(fd);
+    c.fd = fd;
+    c.inUse = true;
+    ++_count;
+    return c;
+}
+
+Client& ClientTable::openRemote() {
+    int id;
+    if (!_freeRemote.empty()) {
+        id = _freeRemote.back();
+        _freeRemote.pop_back();
+    } else
+        id = _nextRemote++;
+    return openRemote(id);
+}
+
+Client& ClientTable::openRemote(int id) {
+    while (_nextRemote < id)
+        _freeRemote.push_back(_nextRemote++);
+    if (_nextRemote == id)
+        ++_nextRemote;
+    if (!_chunks[id >> CHUNK_BITS])
+        _chunks[id >> CHUNK_BITS] = new Client[CHUNK_SIZE];
+
+    Client& c = at(id);
+    c.fd = id;
+    c.inUse = true;
+    ++_remoteCount;
+    return c;
+}
+
+void ClientTable::release(int fd) {
+    Client* c = find(fd);
+    if (!c)
+        return;
+
+    unsigned int gen = c->gen + 1;
+    *c = Client(); // keeps the slot's line buffer allocation for the next connection
+    c->gen = gen ? gen : 1;
+    if (fd >= REMOTE_BASE) {
+        _freeRemote.push_back(fd);
+        --_remoteCount;
+    } else
+        --_count;
+}
+
+uint64_t ClientTable::tokenOf(const Client& c) {
+    return (static_cast<uint64_t>(c.gen) << 32) | static_cast<uint32_t>(c.fd);
+}
+
+Client* ClientTable::findByToken(uint64_t token) {
+    Client* c = find(static_cast<int>(token & 0xffffffffu));
+    if (!c || c->gen != static_cast<unsigned int>(token >> 32))
+        return 0; // closed, or the fd now belongs to a newer connection
+    return c;
+}
@@ -0,0 +1,73 @@
+#ifndef CLIENTTABLE_HPP
+#define CLIENTTABLE_HPP
+
+#include <vector>
+#include <stdint.h>
+
+#include "Client.hpp"
+
+// Table of connection records indexed by fd.
+// A lookup is one bounds check and two array accesses; find() never inserts.
+// Every record carries a generation, so a token (generation + fd) taken
+// before a close does not match the fd's next connection.
+//
+// Records live in fixed-size chunks that are never moved or freed, so a
+// reactor thread can keep using its own clients' buffers while another
+// thread opens a connection (and maybe a new chunk) under the state lock.
+//
+// Users of linked servers get records too, so rosters, nicks and replies
+// treat them like anyone else: their ids start at REMOTE_BASE, far above
+// any fd, and have no socket behind them.
+class ClientTable {
+    public:
+        enum {
+            CHUNK_BITS = 10,
+            CHUNK_SIZE = 1 << CHUNK_BITS,
+            MAX_CHUNKS = 4096,
+            MAX_FDS = CHUNK_SIZE * MAX_CHUNKS,
+            REMOTE_BASE = MAX_FDS / 2 // fds must stay below
+        };
+
+        ClientTable();
+        ~ClientTable();
+
+        Client* find(int fd);
+        const Client* find(int fd) const;
+        // fd must be open (members of channels, the fd a handler runs for, ...)
+        Client& at(int fd) { return _chunks[fd >> CHUNK_BITS][fd & (CHUNK_SIZE - 1)]; }
+
+        // fd must be below REMOTE_BASE
+        Client& open(int fd);
+        // a record for a remote user, under a free id from REMOTE_BASE on
+        Client& openRemote();
+        // ... under this one (hot restart): ids come back in increasing order,
+        // the ones skipped are free
+        Client& openRemote(int id);
+        void release(int fd);
+
+        static uint64_t tokenOf(const Client& c);
+        Client* findByToken(uint64_t token);
+
+        // open connections, remote users not included
+        size_t count() const { return _count; }
+        size_t remoteCount() const { return _remoteCount; }
+        // one past the highest fd slot, for full scans (shutdown)
+        int limit() const { return static_cast<int>(_used * CHUNK_SIZE); }
+        // one past the highest remote id handed out, for scans of remote users
+        int remoteLimit() const { return _nextRemote; }
+
+    private:
+        ClientTable(const ClientTable&);
+        ClientTable& operator=(const ClientTable&);
+
+        Client* slot(int fd) const;
+
+        std::vector<Client*> _chunks; // MAX_CHUNKS entries, the first _used allocated
+        size_t _used;                 // ... and from REMOTE_BASE on, as remote ids need them
+        size_t _count;
+        size_t _remoteCount;
+        int _nextRemote;              // remote ids below are handed out or free
+        std::vector<int> _freeRemote;
+};
+
+#endif
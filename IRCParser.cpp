@@ -1,4 +1,5 @@
 #include "IRCParser.hpp"
+#include "ByteScan.hpp"
 
 ParsedMessage parseLine(const std::string& line) {
     ParsedMessage msg;
@@ -12,6 +13,19 @@ ParsedMessage parseLine(const std::string& line) {
     if (temp.empty())
         return msg;
 
+    // 0) Optional message tags
+    if (temp[0] == '@') {
+        pos = temp.find(' ');
+        if (pos == std::string::npos)
+            return msg; // malformed
+        msg.tags = temp.substr(1, pos - 1);
+        temp.erase(0, pos + 1);
+        while (!temp.empty() && temp[0] == ' ')
+            temp.erase(0, 1);
+        if (temp.empty())
+            return msg;
+    }
+
     // 1) Optional prefix
     if (temp[0] == ':') {
         pos = temp.find(' ');
@@ -66,4 +80,88 @@ ParsedMessage parseLine(const std::string& line) {
         msg.params.push_back(trailing);
 
     return msg;
-}
\ No newline at end of file
+}
+
+// Same steps as parseLine, but on (ptr, len) slices of the original line
+bool parseLineView(const char* line, size_t len, MessageView& out) {
+    const char* p = line;
+    const char* end = line + len;
+
+    out.tags = StrView();
+    out.prefix = StrView();
+    out.command = StrView();
+    out.paramCount = 0;
+
+    if (p == end)
+        return true;
+
+    // 0) Optional message tags
+    if (*p == '@') {
+        const char* sp = scanByte(p, end, ' ');
+        if (sp == end)
+            return true; // malformed
+        out.tags = StrView(p + 1, static_cast<size_t>(sp - p - 1));
+        p = sp + 1;
+        while (p < end && *p == ' ')
+            ++p;
+        if (p == end)
+            return true;
+    }
+
+    // 1) Optional prefix
+    if (*p == ':') {
+        const char* sp = scanByte(p, end, ' ');
+        if (sp == end)
+            return true; // malformed
+        out.prefix = StrView(p + 1, static_cast<size_t>(sp - p - 1));
+        p = sp + 1;
+    }
+
+    // trim leading spaces
+    while (p < end && *p == ' ')
+        ++p;
+
+    if (p == end)
+        return true;
+
+    // 2) Optional trailing param (everything after " :")
+    const char* midEnd = scanPair(p, end, ' ', ':');
+    bool hasTrailing = (midEnd != end);
+
+    // 3) Split remaining by spaces: command + middle params
+    const char* sp = scanByte(p, midEnd, ' ');
+    out.command = StrView(p, static_cast<size_t>(sp - p));
+    p = sp;
+    while (p < midEnd) {
+        ++p; // the space that ended the previous token
+        while (p < midEnd && *p == ' ')
+            ++p;
+        if (p == midEnd)
+            break;
+
+        sp = scanByte(p, midEnd, ' ');
+        if (out.paramCount == MessageView::MAX_PARAMS)
+            return false;
+        out.params[out.paramCount++] = StrView(p, static_cast<size_t>(sp - p));
+        p = sp;
+    }
+
+    // 4) Add trailing as last param if present
+    if (hasTrailing) {
+        if (out.paramCount == MessageView::MAX_PARAMS)
+            return false;
+        out.params[out.paramCount++] = StrView(midEnd + 2, static_cast<size_t>(end - midEnd - 2));
+    }
+    return true;
+}
+
+void assignMessage(const MessageView& view, ParsedMessage& msg, size_t maxParams) {
+    size_t n = view.paramCount < maxParams ? view.paramCount : maxParams;
+
+    msg.tags.assign(view.tags.ptr, view.tags.len);
+    msg.prefix.assign(view.prefix.ptr, view.prefix.len);
+    msg.command.assign(view.command.ptr, view.command.len);
+    msg.params.resize(n);
+    for (size_t i = 0; i < n; i++)
+        msg.params[i].assign(view.params[i].ptr, view.params[i].len);
+}
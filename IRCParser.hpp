@@ -5,6 +5,7 @@
 #include <vector>
 
 struct ParsedMessage {
+    std::string tags; // IRCv3 "key=value;+key", without the '@', still escaped
     std::string prefix;
     std::string command;
     std::vector<std::string> params;
@@ -12,4 +13,36 @@ struct ParsedMessage {
 
 ParsedMessage parseLine(const std::string& line);
 
-#endif
\ No newline at end of file
+// (pointer, length) slice of the line being parsed
+struct StrView {
+    const char* ptr;
+    size_t len;
+
+    StrView() : ptr(""), len(0) {}
+    StrView(const char* p, size_t n) : ptr(p), len(n) {}
+    bool empty() const { return len == 0; }
+};
+
+// Stack-resident result of parseLineView: every field points into the input line
+struct MessageView {
+    enum { MAX_PARAMS = 15 }; // RFC 1459: up to 15 parameters
+
+    StrView tags;
+    StrView prefix;
+    StrView command;
+    StrView params[MAX_PARAMS];
+    size_t paramCount;
+
+    MessageView() : paramCount(0) {}
+};
+
+// Allocation-free variant of parseLine with identical results.
+// Returns false if the line carries more than MAX_PARAMS params;
+// the caller then falls back to parseLine for that (malformed) line.
+bool parseLineView(const char* line, size_t len, MessageView& out);
+
+// Copies a view into msg, reusing msg's existing string storage.
+// Only the first maxParams params are copied.
+void assignMessage(const MessageView& view, ParsedMessage& msg, size_t maxParams);
+
+#endif
@@ -0,0 +1,84 @@
+#include "LineBuffer.hpp"
+#include "ByteScan.hpp"
+
+#include <cstring>
+
+LineBuffer::LineBuffer() : _data(0), _start(0), _end(0), _scan(0) { }
+
+LineBuffer::LineBuffer(const LineBuffer& other)
+    : _data(0), _start(0), _end(0), _scan(0) {
+    *this = other;
+}
+
+LineBuffer& LineBuffer::operator=(const LineBuffer& other) {
+    if (this == &other)
+        return *this;
+    if (other._data) {
+        if (!_data)
+            _data = new char[CAPACITY];
+        std::memcpy(_data, other._data + other._start, other._end - other._start);
+    }
+    _end = other._end - other._start;
+    _scan = other._scan - other._start;
+    _start = 0;
+    return *this;
+}
+
+LineBuffer::~LineBuffer() {
+    delete[] _data;
+}
+
+void LineBuffer::compact() {
+    if (_start == 0)
+        return;
+    // at most one unfinished line is left here, so this move is bounded
+    std::memmove(_data, _data + _start, _end - _start);
+    _end -= _start;
+    _scan -= _start;
+    _start = 0;
+}
+
+char* LineBuffer::writePtr() {
+    if (!_data)
+        _data = new char[CAPACITY];
+    if (_start == _end)
+        _start = _end = _scan = 0; // everything consumed, restart at the front for free
+    else if (_end == CAPACITY)
+        compact();
+    return _data + _end;
+}
+
+size_t LineBuffer::writable() {
+    writePtr();
+    return CAPACITY - _end;
+}
+
+void LineBuffer::commit(size_t n) {
+    _end += n;
+}
+
+bool LineBuffer::nextLine(const char*& line, size_t& len) {
+    if (!_data)
+        return false;
+
+    const char* end = _data + _end;
+    const char* nl = scanByte(_data + _scan, end, '\n');
+    if (nl == end) {
+        _scan = _end; // don't rescan these bytes after the next recv
+        return false;
+    }
+
+    line = _data + _start;
+    len = static_cast<size_t>(nl - line);
+    if (len > 0 && line[len - 1] == '\r')
+        --len;
+
+    _start = static_cast<size_t>(nl - _data) + 1;
+    _scan = _start;
+    return true;
+}
+
+void LineBuffer::putBack(const char* line) {
+    _start = static_cast<size_t>(line - _data);
+    _scan = _start;
+}
@@ -0,0 +1,46 @@
+#ifndef LINEBUFFER_HPP
+#define LINEBUFFER_HPP
+
+#include <cstddef>
+
+// Fixed-capacity, compacting input buffer of one client.
+// recv() writes straight into it and complete lines are handed out as
+// (pointer, length) views into the buffer, nothing is copied or erased.
+// Only the unfinished tail (at most one line) is ever moved, when the
+// free space at the end runs out.
+class LineBuffer {
+    public:
+        enum { CAPACITY = 8704 }; // the longest line: 8191 bytes of tags, then 512
+
+        LineBuffer();
+        LineBuffer(const LineBuffer& other);
+        LineBuffer& operator=(const LineBuffer& other);
+        ~LineBuffer();
+
+        // Free space for the next recv(), compacting first if needed.
+        char* writePtr();
+        size_t writable();
+        void commit(size_t n);
+
+        // Next complete line without "\n" / "\r\n".
+        // The view is valid until the next writePtr()/writable() call.
+        bool nextLine(const char*& line, size_t& len);
+        // Gives back the line nextLine() just returned (line: its view),
+        // the next call returns it again.
+        void putBack(const char* line);
+
+        // Bytes received but not handed out as a line yet
+        size_t pending() const { return _end - _start; }
+        // ... and where they start (hot restart copies them out)
+        const char* pendingData() const { return _data + _start; }
+
+    private:
+        char* _data;   // allocated on first use
+        size_t _start; // first byte not handed out yet
+        size_t _end;   // one past the last received byte
+        size_t _scan;  // bytes in [_start, _scan) are known to hold no '\n'
+
+        void compact();
+};
+
+#endif
@@ -0,0 +1,304 @@
+#include "Logger.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+volatile int Logger::_level = Logger::INFO;
+volatile int Logger::_baseLevel = Logger::INFO;
+
+namespace {
+    const unsigned long kCapacity = 4096;      // records in the ring, a power of two
+    const size_t kRecordSize = 512;            // 2 MB of ring
+    const size_t kFlushAt = 64 * 1024;         // formatted bytes per write()
+    const long kIdleNs = 2 * 1000 * 1000;      // writer's nap when the ring is empty
+
+    const char* const kLevelNames[] = { "ERROR", "WARN", "INFO", "DEBUG", "RAW" };
+
+    struct Header {
+        volatile unsigned long seq; // ring position the slot is ready for
+        uint64_t timeNs;            // CLOCK_REALTIME, taken by the producer
+        const char* event;
+        const char* key;
+        int level;
+        int fd;
+        int err;
+        unsigned short len;
+        bool truncated;
+    };
+
+    const size_t kTextMax = kRecordSize - sizeof(Header);
+
+    struct Record {
+        Header h;
+        char text[kTextMax];
+    };
+
+    // Bounded multi-producer / single-consumer ring: a producer claims a
+    // position with one CAS on the tail, fills the slot, then publishes it
+    // through its sequence number (position + 1). The writer frees it for
+    // the next lap (position + capacity). Slot sequences tell a producer
+    // whether the writer is a lap behind, i.e. the ring is full.
+    Record* g_ring = 0;
+    volatile unsigned long g_tail = 0;    // next position to claim
+    unsigned long g_head = 0;             // next position to write out: writer thread only
+    volatile unsigned long g_dropped = 0;
+    unsigned long g_reported = 0;         // drops already logged: writer thread only
+    volatile int g_running = 0;
+    volatile int g_stopping = 0;
+    pthread_t g_writer;
+
+    unsigned long loadAcquire(const volatile unsigned long& v) {
+        unsigned long x = v;
+        __sync_synchronize();
+        return x;
+    }
+
+    void storeRelease(volatile unsigned long& v, unsigned long x) {
+        __sync_synchronize();
+        v = x;
+    }
+
+    uint64_t wallNs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    // "..." with quotes, backslashes and control bytes escaped
+    void appendQuoted(std::string& out, const char* s, size_t len) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (size_t i = 0; i < len; i++) {
+            unsigned char ch = static_cast<unsigned char>(s[i]);
+            if (ch == '"' || ch == '\\') {
+                out += '\\';
+                out += static_cast<char>(ch);
+            } else if (ch < 0x20 || ch == 0x7f) {
+                out += "\\x";
+                out += hex[ch >> 4];
+                out += hex[ch & 0xf];
+            } else
+                out += static_cast<char>(ch);
+        }
+        out += '"';
+    }
+
+    void format(std::string& out, const Header& h, const char* text) {
+        char stamp[48];
+        time_t secs = static_cast<time_t>(h.timeNs / 1000000000ULL);
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        std::snprintf(stamp + n, sizeof(stamp) - n, ".%06luZ ",
+                      static_cast<unsigned long>(h.timeNs % 1000000000ULL / 1000));
+        out += stamp;
+        out += kLevelNames[h.level];
+        out += ' ';
+        out += h.event;
+        if (h.fd >= 0) {
+            char fd[24];
+            std::snprintf(fd, sizeof(fd), " fd=%d", h.fd);
+            out += fd;
+        }
+        if (h.key) {
+            out += ' ';
+            out += h.key;
+            out += '=';
+            appendQuoted(out, text, h.len);
+            if (h.truncated)
+                out += "...";
+        }
+        if (h.err) {
+            char buf[128];
+            const char* msg = strerror_r(h.err, buf, sizeof(buf));
+            out += " error=";
+            appendQuoted(out, msg, std::strlen(msg));
+        }
+        out += '\n';
+    }
+
+    void writeAll(int fd, std::string& buf) {
+        size_t off = 0;
+        while (off < buf.size()) {
+            ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+            if (n > 0)
+                off += static_cast<size_t>(n);
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && errno == EAGAIN) {
+                struct timespec nap = { 0, kIdleNs };
+                nanosleep(&nap, 0); // only this thread waits
+            } else
+                break; // stdout closed: nothing to do about it
+        }
+        buf.clear();
+    }
+
+    // Formats and writes every published record; returns how many
+    size_t drain() {
+        static std::string out, err; // stdout / stderr, kept for their capacity
+        size_t n = 0;
+        while (true) {
+            Record& r = g_ring[g_head & (kCapacity - 1)];
+            if (loadAcquire(r.h.seq) != g_head + 1)
+                break; // empty, or the next producer is still filling its slot
+            std::string& dest = r.h.level <= Logger::WARN ? err : out;
+            format(dest, r.h, r.text);
+            storeRelease(r.h.seq, g_head + kCapacity);
+            ++g_head;
+            ++n;
+            if (dest.size() >= kFlushAt)
+                writeAll(&dest == &err ? 2 : 1, dest);
+        }
+
+        unsigned long dropped = __sync_fetch_and_add(&g_dropped, 0);
+        if (dropped != g_reported) {
+            char count[24];
+            int len = std::snprintf(count, sizeof(count), "%lu", dropped - g_reported);
+            Header h;
+            std::memset(&h, 0, sizeof(h));
+            h.timeNs = wallNs();
+            h.event = "log records dropped, ring full";
+            h.key = "count";
+            h.level = Logger::WARN;
+            h.fd = -1;
+            h.len = static_cast<unsigned short>(len);
+            format(err, h, count);
+            g_reported = dropped;
+        }
+
+        if (!out.empty())
+            writeAll(1, out);
+        if (!err.empty())
+            writeAll(2, err);
+        return n;
+    }
+
+    void* writerMain(void*) {
+        while (true) {
+            bool last = __sync_fetch_and_add(&g_stopping, 0) != 0;
+            if (drain() == 0) {
+                if (last)
+                    break; // every producer was done before stop()
+                struct timespec nap = { 0, kIdleNs };
+                nanosleep(&nap, 0);
+            }
+        }
+        return 0;
+    }
+}
+
+bool Logger::parseLevel(const char* name, Level& out) {
+    for (int i = ERROR; i <= RAW; i++) {
+        if (strcasecmp(name, kLevelNames[i]) == 0) {
+            out = static_cast<Level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Logger::setLevel(Level level) {
+    _baseLevel = level == RAW ? DEBUG : level;
+    _level = level;
+}
+
+void Logger::toggleRaw() {
+    _level = _level == RAW ? _baseLevel : RAW;
+}
+
+bool Logger::start() {
+    if (g_running)
+        return true;
+    // lines already written through the streams come first
+    std::cout.flush();
+    std::cerr.flush();
+
+    g_ring = new Record[kCapacity];
+    for (unsigned long i = 0; i < kCapacity; i++)
+        g_ring[i].h.seq = i;
+    g_tail = 0;
+    g_head = 0;
+    g_stopping = 0;
+    if (pthread_create(&g_writer, 0, writerMain, 0) != 0) {
+        std::cerr << "pthread_create() failed for the logger\n";
+        delete[] g_ring;
+        g_ring = 0;
+        return false;
+    }
+    __sync_synchronize(); // the ring is set up before anyone sees g_running
+    g_running = 1;
+    return true;
+}
+
+void Logger::stop() {
+    if (!g_running)
+        return;
+    __sync_lock_test_and_set(&g_stopping, 1);
+    pthread_join(g_writer, 0);
+    g_running = 0;
+    delete[] g_ring;
+    g_ring = 0;
+}
+
+void Logger::log(Level level, const char* event, int fd, int err, const char* key, const char* text, size_t len) {
+    if (!enabled(level))
+        return;
+    Header h;
+    h.timeNs = wallNs();
+    h.event = event;
+    h.key = key;
+    h.level = level;
+    h.fd = fd;
+    h.err = err;
+    h.truncated = len > kTextMax;
+    h.len = static_cast<unsigned short>(h.truncated ? kTextMax : len);
+
+    if (!g_running) {
+        // no writer thread: format and write right here
+        std::string line;
+        format(line, h, text);
+        std::cout.flush();
+        writeAll(level <= WARN ? 2 : 1, line);
+        return;
+    }
+
+    unsigned long pos = g_tail;
+    Record* r;
+    while (true) {
+        r = &g_ring[pos & (kCapacity - 1)];
+        long lap = static_cast<long>(loadAcquire(r->h.seq) - pos);
+        if (lap == 0) {
+            if (__sync_bool_compare_and_swap(&g_tail, pos, pos + 1))
+                break;
+            pos = g_tail;
+        } else if (lap < 0) {
+            __sync_fetch_and_add(&g_dropped, 1); // the writer is a lap behind: drop, never wait
+            return;
+        } else
+            pos = g_tail; // claimed by another producer meanwhile
+    }
+
+    r->h.timeNs = h.timeNs;
+    r->h.event = h.event;
+    r->h.key = h.key;
+    r->h.level = h.level;
+    r->h.fd = h.fd;
+    r->h.err = h.err;
+    r->h.len = h.len;
+    r->h.truncated = h.truncated;
+    if (h.len)
+        std::memcpy(r->text, text, h.len);
+    storeRelease(r->h.seq, pos + 1);
+}
+
+unsigned long Logger::dropped() {
+    return __sync_fetch_and_add(&g_dropped, 0);
+}
@@ -0,0 +1,62 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <cstddef>
+#include <stdint.h>
+
+// Asynchronous logger. The reactor threads push fixed-size records into a
+// bounded lock-free ring (one CAS, no allocation, no syscall); a background
+// thread formats them and writes them out, errors and warnings to stderr,
+// the rest to stdout. A full ring drops the record and counts it: the event
+// loop never waits for a slow terminal, pipe or journald.
+//
+// One line per record: time, level, message, then key=value fields
+//   2026-01-01T12:00:00.000123Z INFO connected fd=7
+//   2026-01-01T12:00:01.250000Z ERROR recv failed fd=7 error="Connection reset by peer"
+class Logger {
+    public:
+        enum Level { ERROR, WARN, INFO, DEBUG, RAW };
+
+        // "error", "warn", "info", "debug" or "raw"; false if unknown
+        static bool parseLevel(const char* name, Level& out);
+        static void setLevel(Level level);
+        // RAW on, or back to the configured level; async-signal-safe (SIGUSR1)
+        static void toggleRaw();
+
+        static bool enabled(Level level) { return level <= _level; }
+
+        // Starts the writer thread. Until then, and after stop(), records
+        // are written synchronously by the caller (startup, benchmarks).
+        static bool start();
+        // writes what is left in the ring, then joins the writer
+        static void stop();
+
+        // event and key: string literals; err: errno or 0; key / text: one
+        // extra field (text is copied, about 460 bytes at most)
+        static void log(Level level, const char* event, int fd = -1, int err = 0,
+                        const char* key = 0, const char* text = 0, size_t len = 0);
+
+        static void error(const char* event, int fd = -1, int err = 0) {
+            if (enabled(ERROR))
+                log(ERROR, event, fd, err);
+        }
+        static void warn(const char* event, int fd = -1, int err = 0) {
+            if (enabled(WARN))
+                log(WARN, event, fd, err);
+        }
+        static void info(const char* event, int fd = -1) {
+            if (enabled(INFO))
+                log(INFO, event, fd);
+        }
+
+        // records lost to a full ring
+        static unsigned long dropped();
+
+    private:
+        Logger();
+
+        static volatile int _level;
+        static volatile int _baseLevel; // what toggleRaw() returns to
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "MessageHistory.hpp"
+
+#include <algorithm>
+#include <sys/time.h>
+
+namespace {
+    struct EarlierThan {
+        bool operator()(const HistoryEntry& e, uint64_t time) const { return e.time < time; }
+        bool operator()(uint64_t time, const HistoryEntry& e) const { return time < e.time; }
+    };
+}
+
+MessageHistory::MessageHistory()
+    : _maxLines(0), _maxBytes(0), _budget(0), _bytes(0), _lines(0), _evictions(0) { }
+
+void MessageHistory::configure(size_t maxLines, size_t maxBytes, size_t budget) {
+    _maxLines = maxLines;
+    _maxBytes = maxBytes;
+    _budget = budget;
+}
+
+uint64_t MessageHistory::nowMs() {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000 + static_cast<uint64_t>(tv.tv_usec) / 1000;
+}
+
+// the line, and what the deque keeps for it
+size_t MessageHistory::cost(const HistoryEntry& e) {
+    return e.line.size() + sizeof(HistoryEntry);
+}
+
+// channel's ring, made if needed, now the most recently used
+MessageHistory::Ring* MessageHistory::use(const std::string& channel) {
+    std::map<std::string, Ring>::iterator it = _rings.find(channel);
+    if (it == _rings.end()) {
+        it = _rings.insert(std::make_pair(channel, Ring())).first;
+        it->second.channel = channel;
+        _lru.push_front(&it->second);
+        it->second.lru = _lru.begin();
+    } else {
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+    }
+    return &it->second;
+}
+
+void MessageHistory::dropOldest(Ring& r) {
+    size_t c = cost(r.entries.front());
+    r.bytes -= c;
+    _bytes -= c;
+    --_lines;
+    r.entries.pop_front();
+}
+
+void MessageHistory::drop(std::map<std::string, Ring>::iterator it) {
+    Ring& r = it->second;
+    _bytes -= r.bytes;
+    _lines -= r.entries.size();
+    _lru.erase(r.lru);
+    _rings.erase(it);
+}
+
+void MessageHistory::record(const std::string& channel, const Payload& line, uint64_t time) {
+    if (!enabled())
+        return;
+    Ring& r = *use(channel);
+    // the time index stays sorted whatever the wall clock does
+    if (!r.entries.empty() && time < r.entries.back().time)
+        time = r.entries.back().time;
+    r.entries.push_back(HistoryEntry(time, line));
+    size_t c = cost(r.entries.back());
+    r.bytes += c;
+    _bytes += c;
+    ++_lines;
+
+    while (!r.entries.empty() && (r.entries.size() > _maxLines || r.bytes > _maxBytes))
+        dropOldest(r);
+
+    // over the budget: the least recently used channel gives up its oldest lines
+    while (_bytes > _budget && !_lru.empty()) {
+        Ring& victim = *_lru.back();
+        if (!victim.entries.empty()) {
+            dropOldest(victim);
+            ++_evictions;
+        }
+        if (victim.entries.empty())
+            drop(_rings.find(victim.channel));
+    }
+}
+
+void MessageHistory::forget(const std::string& channel) {
+    std::map<std::string, Ring>::iterator it = _rings.find(channel);
+    if (it != _rings.end())
+        drop(it);
+}
+
+size_t MessageHistory::firstAfter(const Ring& r, uint64_t time) {
+    return std::upper_bound(r.entries.begin(), r.entries.end(), time, EarlierThan()) - r.entries.begin();
+}
+
+size_t MessageHistory::firstAtOrAfter(const Ring& r, uint64_t time) {
+    return std::lower_bound(r.entries.begin(), r.entries.end(), time, EarlierThan()) - r.entries.begin();
+}
+
+void MessageHistory::copy(const Ring& r, size_t from, size_t to, std::vector<HistoryEntry>& out) const {
+    for (size_t i = from; i < to; i++)
+        out.push_back(r.entries[i]);
+}
+
+void MessageHistory::latest(const std::string& channel, size_t limit, std::vector<HistoryEntry>& out) {
+    if (_rings.find(channel) == _rings.end())
+        return;
+    const Ring& r = *use(channel);
+    size_t n = r.entries.size();
+    copy(r, n > limit ? n - limit : 0, n, out);
+}
+
+void MessageHistory::before(const std::string& channel, uint64_t time, size_t limit,
+                            std::vector<HistoryEntry>& out) {
+    if (_rings.find(channel) == _rings.end())
+        return;
+    const Ring& r = *use(channel);
+    size_t end = firstAtOrAfter(r, time);
+    copy(r, end > limit ? end - limit : 0, end, out);
+}
+
+void MessageHistory::after(const std::string& channel, uint64_t time, size_t limit,
+                           std::vector<HistoryEntry>& out) {
+    if (_rings.find(channel) == _rings.end())
+        return;
+    const Ring& r = *use(channel);
+    size_t from = firstAfter(r, time);
+    copy(r, from, std::min(from + limit, r.entries.size()), out);
+}
+
+void MessageHistory::around(const std::string& channel, uint64_t time, size_t limit,
+                            std::vector<HistoryEntry>& out) {
+    if (_rings.find(channel) == _rings.end())
+        return;
+    const Ring& r = *use(channel);
+    size_t mid = firstAtOrAfter(r, time);
+    size_t from = mid > limit / 2 ? mid - limit / 2 : 0;
+    copy(r, from, std::min(from + limit, r.entries.size()), out);
+}
+
+void MessageHistory::between(const std::string& channel, uint64_t from, uint64_t to, size_t limit,
+                             std::vector<HistoryEntry>& out) {
+    if (_rings.find(channel) == _rings.end())
+        return;
+    const Ring& r = *use(channel);
+    if (from <= to) {
+        size_t start = firstAfter(r, from);
+        size_t end = std::max(start, firstAtOrAfter(r, to));
+        copy(r, start, std::min(start + limit, end), out);
+    } else {
+        size_t start = firstAfter(r, to);
+        size_t end = std::max(start, firstAtOrAfter(r, from));
+        copy(r, end - start > limit ? end - limit : start, end, out);
+    }
+}
+
+void MessageHistory::dump(std::vector<std::pair<std::string, HistoryEntry> >& out) const {
+    for (std::map<std::string, Ring>::const_iterator it = _rings.begin(); it != _rings.end(); ++it) {
+        const std::deque<HistoryEntry>& entries = it->second.entries;
+        for (size_t i = 0; i < entries.size(); i++)
+            out.push_back(std::make_pair(it->first, entries[i]));
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef MESSAGEHISTORY_HPP
+#define MESSAGEHISTORY_HPP
+
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include "Payload.hpp"
+
+// One line of a channel's history: the payload its members got, and when
+struct HistoryEntry {
+    uint64_t time; // ms since the epoch, never less than the entry before
+    Payload line;
+
+    HistoryEntry(uint64_t t, const Payload& p) : time(t), line(p) {}
+};
+
+// Recent channel messages, for CHATHISTORY and the replay on JOIN.
+//
+// A channel's lines are kept as the payloads its members were sent: a line
+// in history is one more reference to the block the fan-out already built,
+// never a copy. Each channel's ring is ordered by time, so a timestamp is
+// found by binary search. A ring is bounded in lines and in bytes; every
+// ring together by a budget. Going over the budget takes lines from the
+// channel whose history was used (written or read) least recently.
+class MessageHistory {
+    public:
+        MessageHistory();
+
+        // maxLines 0: no history at all
+        void configure(size_t maxLines, size_t maxBytes, size_t budget);
+        bool enabled() const { return _maxLines != 0; }
+
+        void record(const std::string& channel, const Payload& line, uint64_t time);
+        // the channel is gone, its history with it
+        void forget(const std::string& channel);
+
+        // Queries append up to limit entries to out, oldest first; times are
+        // exclusive bounds
+        // the last limit lines
+        void latest(const std::string& channel, size_t limit, std::vector<HistoryEntry>& out);
+        // the last limit lines before time
+        void before(const std::string& channel, uint64_t time, size_t limit, std::vector<HistoryEntry>& out);
+        // the first limit lines after time
+        void after(const std::string& channel, uint64_t time, size_t limit, std::vector<HistoryEntry>& out);
+        // limit lines around time, half before it (less if history starts there)
+        void around(const std::string& channel, uint64_t time, size_t limit, std::vector<HistoryEntry>& out);
+        // between the two times, starting at the first one: from > to takes the last ones
+        void between(const std::string& channel, uint64_t from, uint64_t to, size_t limit,
+                     std::vector<HistoryEntry>& out);
+
+        // every channel's lines, oldest first (hot restart)
+        void dump(std::vector<std::pair<std::string, HistoryEntry> >& out) const;
+
+        size_t bytes() const { return _bytes; }
+        size_t lines() const { return _lines; }
+        unsigned long evictions() const { return _evictions; }
+
+        // ms since the epoch, the clock of record()
+        static uint64_t nowMs();
+
+    private:
+        MessageHistory(const MessageHistory&);
+        MessageHistory& operator=(const MessageHistory&);
+
+        struct Ring;
+        typedef std::list<Ring*> LruList;
+
+        struct Ring {
+            std::string channel;
+            std::deque<HistoryEntry> entries;
+            size_t bytes;
+            LruList::iterator lru;
+
+            Ring() : bytes(0) {}
+        };
+
+        size_t _maxLines;
+        size_t _maxBytes;
+        size_t _budget;
+        std::map<std::string, Ring> _rings;
+        LruList _lru; // most recently used first
+        size_t _bytes;
+        size_t _lines;
+        unsigned long _evictions;
+
+        Ring* use(const std::string& channel);
+        void dropOldest(Ring& r);
+        void drop(std::map<std::string, Ring>::iterator it);
+        void copy(const Ring& r, size_t from, size_t to, std::vector<HistoryEntry>& out) const;
+        static size_t firstAfter(const Ring& r, uint64_t time);
+        static size_t firstAtOrAfter(const Ring& r, uint64_t time);
+        static size_t cost(const HistoryEntry& e);
+};
+
+#endif
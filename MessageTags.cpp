@@ -0,0 +1,103 @@
+#include "MessageTags.hpp"
+#include "Client.hpp"
+
+#include <cstdio>
+#include <ctime>
+
+TaggedLine::TaggedLine(const Payload& plain, uint64_t timeMs) : _time(timeMs) {
+    _variants[0] = plain;
+}
+
+TaggedLine::TaggedLine(const Payload& plain, uint64_t timeMs, const std::string& clientTags)
+    : _time(timeMs), _clientTags(clientTags) {
+    _variants[0] = plain;
+}
+
+int TaggedLine::variantFor(unsigned char caps) const {
+    int v = 0;
+    if (caps & Client::CAP_SERVER_TIME)
+        v |= TIME;
+    if ((caps & Client::CAP_MESSAGE_TAGS) && !_clientTags.empty())
+        v |= CLIENT_TAGS;
+    return v;
+}
+
+const Payload& TaggedLine::variant(int v) {
+    if (v == 0 || !_variants[v].empty())
+        return _variants[v];
+
+    std::string line;
+    line.reserve(1 + 30 + _clientTags.size() + 1 + plain().size());
+    line += '@';
+    if (v & TIME) {
+        char stamp[25];
+        formatServerTime(_time, stamp);
+        line += "time=";
+        line += stamp;
+    }
+    if (v & CLIENT_TAGS) {
+        if (v & TIME)
+            line += ';';
+        line += _clientTags;
+    }
+    line += ' ';
+    line.append(plain().data(), plain().size());
+    _variants[v] = Payload(line.data(), line.size());
+    return _variants[v];
+}
+
+void formatServerTime(uint64_t ms, char* out) {
+    time_t secs = static_cast<time_t>(ms / 1000);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    size_t n = strftime(out, 25, "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(out + n, 25 - n, ".%03uZ", static_cast<unsigned int>(ms % 1000));
+}
+
+namespace {
+    bool isKeyChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+    }
+
+    // "+[vendor/]name": the vendor a host name, the name letters, digits and '-'
+    bool validClientKey(const std::string& tags, size_t start, size_t end) {
+        size_t name = start + 1;
+        size_t slash = tags.find('/', name);
+        if (slash < end) {
+            if (slash == name)
+                return false;
+            for (size_t i = name; i < slash; i++) {
+                if (!isKeyChar(tags[i]) && tags[i] != '.')
+                    return false;
+            }
+            name = slash + 1;
+        }
+        if (name == end)
+            return false;
+        for (size_t i = name; i < end; i++) {
+            if (!isKeyChar(tags[i]))
+                return false;
+        }
+        return true;
+    }
+}
+
+void clientOnlyTags(const std::string& tags, std::string& out) {
+    out.clear();
+    size_t start = 0;
+    while (start < tags.size()) {
+        size_t end = tags.find(';', start);
+        if (end == std::string::npos)
+            end = tags.size();
+        size_t key = tags.find('=', start);
+        if (key > end)
+            key = end;
+        size_t used = out.empty() ? 0 : out.size() + 1;
+        if (tags[start] == '+' && validClientKey(tags, start, key) && used + end - start <= kMaxClientTags) {
+            if (!out.empty())
+                out += ';';
+            out.append(tags, start, end - start);
+        }
+        start = end + 1;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef MESSAGETAGS_HPP
+#define MESSAGETAGS_HPP
+
+#include <string>
+#include <stdint.h>
+
+#include "Payload.hpp"
+
+// One line as each kind of recipient gets it: without tags, with the
+// server-time tag, with the sender's client-only tags ("+key=value",
+// message-tags), or both. A variant is rendered the first time a recipient
+// needs it and then shared like any payload, so a broadcast costs at most
+// one rendering per variant, whatever the number of recipients; a channel
+// where nobody negotiated tags only ever uses the plain line.
+class TaggedLine {
+    public:
+        TaggedLine(const Payload& plain, uint64_t timeMs);
+        TaggedLine(const Payload& plain, uint64_t timeMs, const std::string& clientTags);
+
+        const Payload& plain() const { return _variants[0]; }
+        uint64_t time() const { return _time; }
+        // the variant for a client with these Client::CAP_* bits
+        const Payload& forCaps(unsigned char caps) { return variant(variantFor(caps)); }
+        // the same in two steps, for callers grouping recipients by variant
+        int variantFor(unsigned char caps) const;
+        const Payload& variant(int v);
+
+        enum { kVariants = 4 };
+
+    private:
+        enum { TIME = 1, CLIENT_TAGS = 2 };
+
+        uint64_t _time;
+        std::string _clientTags;
+        Payload _variants[4]; // by TIME | CLIENT_TAGS, [0] given
+};
+
+// "YYYY-MM-DDThh:mm:ss.sssZ", the server-time format; out holds 25 bytes
+void formatServerTime(uint64_t ms, char* out);
+// Bytes of tag data a client may send, or a server add to a line (IRCv3)
+const size_t kMaxClientTags = 4094;
+
+// The client-only tags ('+' keys) of a received tag string, ';'-separated;
+// malformed keys are dropped, and tags that would take it past kMaxClientTags
+void clientOnlyTags(const std::string& tags, std::string& out);
+
+#endif
@@ -0,0 +1,69 @@
+#include "Metrics.hpp"
+
+#include <cmath>
+#include <time.h>
+
+Histogram::Histogram() : _sum(0) {
+    for (size_t i = 0; i < BUCKETS; i++)
+        _counts[i] = 0;
+}
+
+size_t Histogram::indexOf(uint64_t v) {
+    if (v < LINEAR)
+        return static_cast<size_t>(v);
+    unsigned bit = 63;
+    while (!(v >> bit))
+        --bit;
+    size_t octave = bit - 4; // bit >= 4 here
+    if (octave >= OCTAVES)
+        return BUCKETS - 1;
+    size_t sub = static_cast<size_t>(v >> (bit - 3)) - PER_OCTAVE;
+    return LINEAR + octave * PER_OCTAVE + sub;
+}
+
+uint64_t Histogram::upperOf(size_t i) {
+    if (i < LINEAR)
+        return i;
+    size_t octave = (i - LINEAR) / PER_OCTAVE;
+    size_t sub = (i - LINEAR) % PER_OCTAVE;
+    return ((static_cast<uint64_t>(PER_OCTAVE + sub) + 1) << (octave + 1)) - 1;
+}
+
+void Histogram::addTo(Summary& s) const {
+    for (size_t i = 0; i < BUCKETS; i++) {
+        unsigned long n = _counts[i];
+        s.counts[i] += n;
+        s.count += n;
+    }
+    s.sum += _sum;
+}
+
+uint64_t Histogram::Summary::percentile(double q) const {
+    if (count == 0)
+        return 0;
+    unsigned long want = static_cast<unsigned long>(std::ceil(q * count));
+    if (want == 0)
+        want = 1;
+    unsigned long seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= want)
+            return upperOf(i);
+    }
+    return upperOf(BUCKETS - 1);
+}
+
+// bucket edges fall on powers of two, so this is exact
+unsigned long Histogram::Summary::countBelowPow2(unsigned bits) const {
+    uint64_t limit = (static_cast<uint64_t>(1) << bits) - 1;
+    unsigned long n = 0;
+    for (size_t i = 0; i < BUCKETS && upperOf(i) <= limit; i++)
+        n += counts[i];
+    return n;
+}
+
+uint64_t Metrics::nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
@@ -0,0 +1,71 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+// Log-linear histogram: exact below 16, then 8 buckets per power of two
+// (at most 12.5% wide). Written by one thread, without locked instructions;
+// other threads read it (aligned word loads) and merge into a Summary.
+class Histogram {
+    public:
+        enum { LINEAR = 16, PER_OCTAVE = 8, OCTAVES = 44, BUCKETS = LINEAR + OCTAVES * PER_OCTAVE };
+
+        Histogram();
+
+        void record(uint64_t v) {
+            size_t i = indexOf(v);
+            _counts[i] = _counts[i] + 1;
+            _sum = _sum + v;
+        }
+
+        // the counts of every thread added up
+        struct Summary {
+            std::vector<unsigned long> counts;
+            unsigned long count;
+            unsigned long sum;
+
+            Summary() : counts(BUCKETS, 0), count(0), sum(0) {}
+
+            // upper bound of the bucket holding the q-th fraction of the values
+            uint64_t percentile(double q) const;
+            // values <= 2^bits - 1, for the coarse buckets of an exposition
+            unsigned long countBelowPow2(unsigned bits) const;
+        };
+
+        void addTo(Summary& s) const;
+
+        static size_t indexOf(uint64_t v);
+        static uint64_t upperOf(size_t i);
+
+    private:
+        volatile unsigned long _counts[BUCKETS];
+        volatile unsigned long _sum;
+};
+
+// Counters of one reactor thread: only that thread writes them (plain
+// stores), STATS m and the metrics endpoint add every shard's up on read.
+struct Metrics {
+    volatile unsigned long connections;   // accepted
+    volatile unsigned long registrations;
+    volatile unsigned long bytesIn;
+    volatile unsigned long bytesOut;
+    volatile unsigned long backlogClients; // sampled every loop iteration
+
+    Histogram handlerNs; // one dispatched command
+    Histogram loopNs;    // one loop iteration, from the end of the wait
+    Histogram fanout;    // recipients of one channel line (PRIVMSG, JOIN, QUIT, ...)
+
+    Metrics() : connections(0), registrations(0), bytesIn(0), bytesOut(0), backlogClients(0) {}
+
+    static void bump(volatile unsigned long& counter, unsigned long n = 1) { counter = counter + n; }
+    static unsigned long read(const volatile unsigned long& counter) { return counter; }
+    static uint64_t nowNs();
+
+    private:
+        Metrics(const Metrics&);
+        Metrics& operator=(const Metrics&);
+};
+
+#endif
@@ -8,9 +8,9 @@ std::string Server::makeModeBroadcastLine(int fd,
     if (modeStr.empty())
         return "";
     std::string prefix = "*";
-    std::map<int, Client>::const_iterator it = _clients.find(fd);
-    if (it != _clients.end()) {
-        prefix = userPrefix(it->second);
+    const Client* c = _clients.find(fd);
+    if (c) {
+        prefix = userPrefix(*c);
     }
     std::string line = ":" + prefix + " MODE " + chan + " " + modeStr;
     for (size_t i = 0; i < modeParams.size(); i++)
@@ -49,8 +49,7 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
     // msg.params: [0]=#chan, [1] = mode string, [2..] = mode params
     if (msg.params.size() < 2) {
         // Not enough params for a "change" call (MODE #channel)
-        std::string nick = nickOf(fd);
-        sendLine(fd, ":" + _serverName + " 461 " + nick + " MODE :Not enough parameters");
+        sendNumeric(fd, "461", nickOf(fd), "MODE", "Not enough parameters");
         return res;
     }
 
@@ -92,8 +91,7 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
             if (adding) {
                 // +k requires key afterwards, just "+k" is unacceptable
                 if (argi >= msg.params.size()) {
-                    std::string nick = nickOf(fd);
-                    sendLine(fd, ":" + _serverName + " 461 " + nick + " MODE :Not enough parameters");
+                    sendNumeric(fd, "461", nickOf(fd), "MODE", "Not enough parameters");
                     break;
                 }
 
@@ -104,6 +102,7 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
 
                 if (changed) {
                     appendModeChar(res.appliedModes, currentOutSign, true, 'k');
+                    res.linkParams.push_back(newKey);
                     res.anyChange = true;
                 }
             // -k
@@ -121,16 +120,14 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
             // +l needs a param
             if (adding) {
                 if (argi >= msg.params.size()) {
-                    std::string nick = nickOf(fd);
-                    sendLine(fd, ":" + _serverName + " 461 " + nick + " MODE :Not enough parameters");
+                    sendNumeric(fd, "461", nickOf(fd), "MODE", "Not enough parameters");
                     break;
                 }
 
                 const std::string& limStr = msg.params[argi++];
                 size_t lim = 0;
                 if (!parsePositiveSizeT(limStr, lim)) {
-                    std::string nick = nickOf(fd);
-                    sendLine(fd, ":" + _serverName + " 461 " + nick + " MODE :Invalid limit");
+                    sendNumeric(fd, "461", nickOf(fd), "MODE", "Invalid limit");
                     continue;
                 }
 
@@ -140,6 +137,7 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
                 if (changed) {
                     appendModeChar(res.appliedModes, currentOutSign, true, 'l');
                     res.modeParams.push_back(limStr);
+                    res.linkParams.push_back(limStr);
                     res.anyChange = true;
                 }
             // l-
@@ -155,8 +153,7 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
         // o: give/take operator
         else if (m == 'o') {
             if (argi >= msg.params.size()) {
-                std::string nick = nickOf(fd);
-                sendLine(fd, ":" + _serverName + " 461 " + nick + " MODE :Not enough parameters");
+                sendNumeric(fd, "461", nickOf(fd), "MODE", "Not enough parameters");
                 break;
             }
 
@@ -164,14 +161,14 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
             int targetFd = findFdByNick(nickArg);
             // no such nick
             if (targetFd < 0) {
-                std::string nick = nickOf(fd);
-                sendLine(fd, ":" + _serverName + " 401 " + nick + " " + nickArg + " :No such nick/channel");
+                sendNumeric(fd, "401", nickOf(fd), nickArg, "No such nick/channel");
                 continue;
             }
             // no such nick in the channel
-            if (ch.members.count(targetFd) == 0) {
-                std::string nick = nickOf(fd);
-                sendLine(fd, ":" + _serverName + " 441 " + nick + " " + nickArg + " " + ch.name + " :They aren't on that channel");
+            if (!ch.isMember(targetFd)) {
+                Reply r;
+                numeric(r, "441", nickOf(fd)) << nickArg << ' ' << ch.name << " :They aren't on that channel";
+                sendReply(fd, r);
                 continue;
             }
 
@@ -182,21 +179,22 @@ ModeResult Server::applyChannelModeChanges(int fd, Channel& ch, const ParsedMess
             .second → true if insertion happened
             .second → false if element already existed
             */
-                changed = ch.operators.insert(targetFd).second;
+                changed = ch.setOperator(targetFd, true);
             else
-                changed = (ch.operators.erase(targetFd) > 0); // returns number of el-s removed
+                changed = ch.setOperator(targetFd, false);
 
             if (changed) {
                 appendModeChar(res.appliedModes, currentOutSign, adding, 'o'); 
                 res.modeParams.push_back(nickArg);
+                res.linkParams.push_back(nickArg);
                 res.anyChange = true;
             }
         }
         // unknown mode char
         else {
-            std::string nick = nickOf(fd);
-            std::string mc(1, m); // to treat it like "a" not 'a'
-            sendLine(fd, ":" + _serverName + " 472 " + nick + " " + mc + " :is unknown mode char to me");
+            Reply r;
+            numeric(r, "472", nickOf(fd)) << m << " :is unknown mode char to me";
+            sendReply(fd, r);
             // keep going
         }
     }
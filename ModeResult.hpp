@@ -8,6 +8,7 @@ struct ModeResult {
     bool anyChange;
     std::string appliedModes;   // "+it-k"
     std::vector<std::string> modeParams; // ["secretKey", "10"] 
+    std::vector<std::string> linkParams; // modeParams with the key, for linked servers
     std::string broadcastLine;  // full IRC line we send to channel
     ModeResult(): anyChange(false) {}
 };
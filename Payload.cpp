@@ -0,0 +1,195 @@
+#include "Payload.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <pthread.h>
+
+// PAYLOAD
+
+namespace {
+    // Every small block has room for SMALL_LINE bytes, so a freed one fits
+    // any small line. A thread keeps the blocks it frees (whichever thread
+    // built them) for the next lines it builds, up to kMaxCached of them.
+    // A cached block's first bytes link it to the next one.
+    const size_t kMaxCached = 4096;
+
+    __thread void* t_cache = 0;
+    __thread size_t t_cached = 0;
+    __thread bool t_keySet = false;
+
+    pthread_key_t g_cacheKey;
+    pthread_once_t g_cacheOnce = PTHREAD_ONCE_INIT;
+
+    // at thread exit: the cache goes back to malloc
+    void freeCache(void*) {
+        while (t_cache) {
+            void* next = *static_cast<void**>(t_cache);
+            std::free(t_cache);
+            t_cache = next;
+        }
+        t_cached = 0;
+    }
+
+    void makeCacheKey() {
+        pthread_key_create(&g_cacheKey, freeCache);
+    }
+
+    void* takeCached() {
+        void* mem = t_cache;
+        if (mem) {
+            t_cache = *static_cast<void**>(mem);
+            --t_cached;
+        }
+        return mem;
+    }
+
+    bool cache(void* mem) {
+        if (t_cached >= kMaxCached)
+            return false;
+        if (!t_keySet) {
+            // the first block this thread keeps: have them handed back at exit
+            pthread_once(&g_cacheOnce, makeCacheKey);
+            pthread_setspecific(g_cacheKey, &g_cacheKey);
+            t_keySet = true;
+        }
+        *static_cast<void**>(mem) = t_cache;
+        t_cache = mem;
+        ++t_cached;
+        return true;
+    }
+}
+
+Payload::Payload() : _b(0) { }
+
+Payload::Payload(const std::string& line) : _b(0) {
+    build(line.data(), line.size());
+}
+
+Payload::Payload(const char* data, size_t len) : _b(0) {
+    build(data, len);
+}
+
+Payload::Payload(const Payload& other) : _b(other._b) {
+    if (_b)
+        __sync_add_and_fetch(&_b->refs, 1);
+}
+
+Payload& Payload::operator=(const Payload& other) {
+    if (other._b)
+        __sync_add_and_fetch(&other._b->refs, 1); // before release(): safe for self-assignment
+    release();
+    _b = other._b;
+    return *this;
+}
+
+Payload::~Payload() {
+    release();
+}
+
+const char* Payload::data() const {
+    return _b ? _b->bytes : "";
+}
+
+size_t Payload::size() const {
+    return _b ? _b->len : 0;
+}
+
+Payload Payload::prefix(const std::string& bytes) {
+    Payload p;
+    p.build(bytes.data(), bytes.size(), false);
+    return p;
+}
+
+void Payload::build(const char* data, size_t len, bool line) {
+    bool addCrlf = line && !(len >= 2 && data[len - 2] == '\r' && data[len - 1] == '\n');
+    size_t total = addCrlf ? len + 2 : len;
+
+    // header + bytes in one allocation, a recycled one for small lines
+    void* mem = 0;
+    if (total <= SMALL_LINE) {
+        mem = takeCached();
+        if (!mem)
+            mem = std::malloc(sizeof(Block) + SMALL_LINE);
+    } else {
+        mem = std::malloc(sizeof(Block) + total);
+    }
+    if (!mem)
+        throw std::bad_alloc();
+    _b = static_cast<Block*>(mem);
+    _b->refs = 1;
+    _b->len = total;
+    std::memcpy(_b->bytes, data, len);
+    if (addCrlf) {
+        _b->bytes[len] = '\r';
+        _b->bytes[len + 1] = '\n';
+    }
+}
+
+void Payload::release() {
+    if (_b && __sync_sub_and_fetch(&_b->refs, 1) == 0) {
+        if (_b->len > SMALL_LINE || !cache(_b))
+            std::free(_b);
+    }
+    _b = 0;
+}
+
+// OUTQUEUE
+
+OutQueue::OutQueue() : _bytes(0), _frontOff(0) { }
+
+void OutQueue::push(const Payload& p) {
+    if (p.empty())
+        return;
+    _q.push_back(p);
+    _bytes += p.size();
+}
+
+int OutQueue::gather(struct iovec* iov, int max) const {
+    int n = 0;
+    for (std::deque<Payload>::const_iterator it = _q.begin(); it != _q.end() && n < max; ++it) {
+        size_t off = (n == 0) ? _frontOff : 0;
+        iov[n].iov_base = const_cast<char*>(it->data() + off);
+        iov[n].iov_len = it->size() - off;
+        ++n;
+    }
+    return n;
+}
+
+void OutQueue::copyTo(std::string& out) const {
+    for (std::deque<Payload>::const_iterator it = _q.begin(); it != _q.end(); ++it) {
+        size_t off = (it == _q.begin()) ? _frontOff : 0;
+        out.append(it->data() + off, it->size() - off);
+    }
+}
+
+size_t OutQueue::consume(size_t n) {
+    size_t done = 0;
+    _bytes -= n;
+    while (n > 0 && !_q.empty()) {
+        size_t left = _q.front().size() - _frontOff;
+        if (n < left) {
+            _frontOff += n;
+            break;
+        }
+        n -= left;
+        if (_q.front().data()[_q.front().size() - 1] == '\n')
+            ++done;
+        _q.pop_front();
+        _frontOff = 0;
+    }
+    return done;
+}
+
+void OutQueue::clear() {
+    _q.clear();
+    _frontOff = 0;
+    _bytes = 0;
+}
+
+void OutQueue::swap(OutQueue& other) {
+    _q.swap(other._q);
+    std::swap(_frontOff, other._frontOff);
+    std::swap(_bytes, other._bytes);
+}
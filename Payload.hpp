@@ -0,0 +1,72 @@
+#ifndef PAYLOAD_HPP
+#define PAYLOAD_HPP
+
+#include <string>
+#include <deque>
+#include <sys/uio.h>
+
+// Immutable, reference counted wire line (ends with "\r\n", except a
+// prefix(), queued in front of one).
+// A broadcast formats the line once; every recipient's OutQueue only
+// holds another reference to the same block. The count is atomic: copies
+// cross reactor threads on the way to the recipient's shard.
+// Blocks of lines within the IRC limit are recycled per thread, so in a
+// steady state making a payload doesn't reach malloc.
+class Payload {
+    public:
+        Payload();
+        explicit Payload(const std::string& line);
+        Payload(const char* data, size_t len);
+        Payload(const Payload& other);
+        // bytes queued as they are, no "\r\n" added: what goes in front of
+        // a shared line (a tag section)
+        static Payload prefix(const std::string& bytes);
+        Payload& operator=(const Payload& other);
+        ~Payload();
+
+        const char* data() const;
+        size_t size() const;
+        bool empty() const { return size() == 0; }
+
+        enum { SMALL_LINE = 512 }; // lines up to this size get recycled blocks
+
+    private:
+        struct Block {
+            int refs;
+            size_t len;
+            char bytes[1]; // len bytes follow
+        };
+
+        Block* _b;
+
+        void build(const char* data, size_t len, bool line = true);
+        void release();
+};
+
+// Per-client output queue: references to payloads + offset into the first one.
+// Draining is O(sent bytes), nothing is ever shifted.
+class OutQueue {
+    public:
+        OutQueue();
+
+        void push(const Payload& p);
+        bool empty() const { return _q.empty(); }
+        size_t bytes() const { return _bytes; }
+
+        // fills up to max iovecs starting at the unsent part, returns how many
+        int gather(struct iovec* iov, int max) const;
+        // drops n already-sent bytes from the front, returns how many lines were
+        // finished (payloads ending with '\n': a tag prefix is not a line)
+        size_t consume(size_t n);
+        // appends the unsent bytes to out
+        void copyTo(std::string& out) const;
+        void clear();
+        void swap(OutQueue& other);
+
+    private:
+        size_t _bytes;    // unsent bytes in total
+        size_t _frontOff; // bytes of _q.front() already sent
+        std::deque<Payload> _q;
+};
+
+#endif
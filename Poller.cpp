@@ -0,0 +1,674 @@
+#include "Poller.hpp"
+#include "Logger.hpp"
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+Poller* Poller::create(const std::string& backend) {
+    if (backend == "poll")
+        return new PollPoller();
+    if (backend.empty() || backend == "epoll")
+        return new EpollPoller();
+    if (backend == "uring") {
+        if (UringPoller::supported())
+            return new UringPoller();
+        std::cerr << "io_uring backend not available, falling back to epoll\n";
+        return new EpollPoller();
+    }
+    std::cerr << "unknown event loop backend '" << backend << "'\n";
+    return 0;
+}
+
+// POLL BACKEND
+
+bool PollPoller::init() {
+    return true;
+}
+
+bool PollPoller::add(int fd, uint64_t token, bool) {
+    if (fd < 0)
+        return false;
+    if (static_cast<size_t>(fd) >= _slotOf.size())
+        _slotOf.resize(fd + 1, -1);
+
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    _slotOf[fd] = static_cast<int>(_fds.size());
+    _fds.push_back(p);
+    _tokens.push_back(token);
+    return true;
+}
+
+void PollPoller::remove(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _slotOf.size() || _slotOf[fd] == -1)
+        return;
+
+    // swap with the last slot instead of erasing from the middle
+    size_t slot = static_cast<size_t>(_slotOf[fd]);
+    size_t last = _fds.size() - 1;
+    if (slot != last) {
+        _fds[slot] = _fds[last];
+        _tokens[slot] = _tokens[last];
+        _slotOf[_fds[slot].fd] = static_cast<int>(slot);
+    }
+    _fds.pop_back();
+    _tokens.pop_back();
+    _slotOf[fd] = -1;
+}
+
+void PollPoller::setWriteInterest(int fd, bool on) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _slotOf.size() || _slotOf[fd] == -1)
+        return;
+    pollfd& p = _fds[_slotOf[fd]];
+    if (on)
+        p.events |= POLLOUT;
+    else
+        p.events &= ~POLLOUT;
+}
+
+void PollPoller::setReadInterest(int fd, bool on) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _slotOf.size() || _slotOf[fd] == -1)
+        return;
+    pollfd& p = _fds[_slotOf[fd]];
+    if (on)
+        p.events |= POLLIN;
+    else
+        p.events &= ~POLLIN;
+}
+
+int PollPoller::wait(int timeoutMs) {
+    _ready.clear();
+    countSyscall();
+    int ret = poll(_fds.empty() ? 0 : &_fds[0], _fds.size(), timeoutMs);
+    if (ret <= 0)
+        return ret;
+
+    // snapshot into _ready: handlers may add/remove fds (and reshuffle _fds) meanwhile
+    for (size_t i = 0; i < _fds.size() && static_cast<int>(_ready.size()) < ret; i++) {
+        short re = _fds[i].revents;
+        if (re == 0)
+            continue;
+        _fds[i].revents = 0;
+
+        PollEvent ev;
+        ev.token = _tokens[i];
+        ev.readable = (re & POLLIN) != 0;
+        ev.writable = (re & POLLOUT) != 0;
+        ev.error = (re & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+        _ready.push_back(ev);
+    }
+    return static_cast<int>(_ready.size());
+}
+
+// EPOLL BACKEND
+
+EpollPoller::EpollPoller() : _epfd(-1) { }
+
+EpollPoller::~EpollPoller() {
+    if (_epfd != -1)
+        close(_epfd);
+}
+
+bool EpollPoller::init() {
+    _epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epfd < 0) {
+        std::cerr << "epoll_create1() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    _events.resize(1024);
+    return true;
+}
+
+bool EpollPoller::add(int fd, uint64_t token, bool edge) {
+    if (fd < 0)
+        return false;
+    if (static_cast<size_t>(fd) >= _regs.size())
+        _regs.resize(fd + 1);
+
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (edge)
+        ev.events |= EPOLLET;
+    ev.data.u64 = token;
+    countSyscall();
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        Logger::error("epoll_ctl(ADD) failed", fd, errno);
+        return false;
+    }
+
+    Reg& r = _regs[fd];
+    r.token = token;
+    r.edge = edge;
+    r.wantRead = true;
+    r.wantWrite = false;
+    r.used = true;
+    return true;
+}
+
+void EpollPoller::remove(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _regs.size() || !_regs[fd].used)
+        return;
+    countSyscall();
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, 0);
+    _regs[fd] = Reg();
+}
+
+void EpollPoller::setWriteInterest(int fd, bool on) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _regs.size() || !_regs[fd].used)
+        return;
+    Reg& r = _regs[fd];
+    if (r.wantWrite == on)
+        return; // already in the requested state, skip the syscall
+
+    Reg next = r;
+    next.wantWrite = on;
+    if (modify(fd, next))
+        r = next;
+}
+
+void EpollPoller::setReadInterest(int fd, bool on) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _regs.size() || !_regs[fd].used)
+        return;
+    Reg& r = _regs[fd];
+    if (r.wantRead == on)
+        return;
+
+    Reg next = r;
+    next.wantRead = on;
+    if (modify(fd, next))
+        r = next;
+}
+
+// EPOLL_CTL_MOD with the mask r describes (MOD also re-arms an edge-triggered fd)
+bool EpollPoller::modify(int fd, const Reg& r) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    if (r.wantRead)
+        ev.events |= EPOLLIN;
+    if (r.wantWrite)
+        ev.events |= EPOLLOUT;
+    if (r.edge)
+        ev.events |= EPOLLET;
+    ev.data.u64 = r.token;
+    countSyscall();
+    if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        Logger::error("epoll_ctl(MOD) failed", fd, errno);
+        return false;
+    }
+    return true;
+}
+
+int EpollPoller::wait(int timeoutMs) {
+    _ready.clear();
+    countSyscall();
+    int ret = epoll_wait(_epfd, &_events[0], static_cast<int>(_events.size()), timeoutMs);
+    if (ret <= 0)
+        return ret;
+
+    for (int i = 0; i < ret; i++) {
+        const epoll_event& e = _events[i];
+        PollEvent ev;
+        ev.token = e.data.u64;
+        ev.readable = (e.events & (EPOLLIN | EPOLLRDHUP)) != 0;
+        ev.writable = (e.events & EPOLLOUT) != 0;
+        ev.error = (e.events & (EPOLLHUP | EPOLLERR)) != 0;
+        _ready.push_back(ev);
+    }
+    // a full batch means more may be waiting: grow for the next round
+    if (ret == static_cast<int>(_events.size()))
+        _events.resize(_events.size() * 2);
+    return ret;
+}
+
+// IO_URING BACKEND
+// (raw syscalls: the ring layout comes from <linux/io_uring.h>, no liburing)
+
+namespace {
+    int uringSetup(unsigned entries, struct io_uring_params* p) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    int uringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+                   const void* arg, size_t argSize) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                                        flags, arg, argSize));
+    }
+
+    int uringRegister(int ringFd, unsigned opcode, const void* arg, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+    // the kernel writes these concurrently: read them with acquire semantics
+    unsigned loadAcquire(const unsigned* p) {
+        unsigned v = *static_cast<const volatile unsigned*>(p);
+        __sync_synchronize();
+        return v;
+    }
+
+    void storeRelease(unsigned* p, unsigned v) {
+        __sync_synchronize();
+        *static_cast<volatile unsigned*>(p) = v;
+    }
+}
+
+UringPoller::UringPoller()
+    : _ringFd(-1),
+    _ringMem(0),
+    _ringSize(0),
+    _sqes(0),
+    _sqesSize(0),
+    _sqHead(0),
+    _sqTail(0),
+    _sqMask(0),
+    _sqEntries(0),
+    _cqHead(0),
+    _cqTail(0),
+    _cqMask(0),
+    _cqes(0),
+    _unsubmitted(0),
+    _bufRing(0),
+    _bufRingSize(0),
+    _bufs(0) { }
+
+UringPoller::~UringPoller() {
+    if (_ringFd != -1)
+        close(_ringFd); // cancels whatever is still in flight
+    if (_sqes)
+        munmap(_sqes, _sqesSize);
+    if (_ringMem)
+        munmap(_ringMem, _ringSize);
+    if (_bufRing)
+        munmap(_bufRing, _bufRingSize);
+    delete[] _bufs;
+    for (size_t i = 0; i < _sends.size(); i++)
+        delete _sends[i];
+}
+
+bool UringPoller::supported() {
+    UringPoller probe;
+    return probe.init();
+}
+
+bool UringPoller::init() {
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    // multishot requests post many completions per submission: a larger CQ
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = RING_ENTRIES * 4;
+    _ringFd = uringSetup(RING_ENTRIES, &p);
+    if (_ringFd < 0) {
+        std::cerr << "io_uring_setup() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & needed) != needed) {
+        std::cerr << "io_uring: kernel lacks single mmap / nodrop / ext arg support\n";
+        return false;
+    }
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    _ringSize = sqSize > cqSize ? sqSize : cqSize;
+    void* ring = mmap(0, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      _ringFd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        std::cerr << "io_uring ring mmap() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    _ringMem = ring;
+
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      _ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        std::cerr << "io_uring sqe mmap() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    _sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* base = static_cast<char*>(_ringMem);
+    _sqHead = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    _sqEntries = p.sq_entries;
+    // SQ slot i always holds SQE i, so only the tail moves
+    unsigned* array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    _cqHead = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(base + p.cq_off.cqes);
+
+    // provided buffer ring: multishot recv picks a buffer per completion
+    _bufRingSize = BUF_COUNT * sizeof(struct io_uring_buf);
+    void* br = mmap(0, _bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) {
+        std::cerr << "io_uring buffer ring mmap() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    _bufRing = static_cast<struct io_uring_buf*>(br);
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(_bufRing);
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (uringRegister(_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        std::cerr << "io_uring buffer ring registration failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    _bufs = new char[static_cast<size_t>(BUF_COUNT) * BUF_SIZE];
+    for (unsigned i = 0; i < BUF_COUNT; i++) {
+        struct io_uring_buf& b = _bufRing[i];
+        b.addr = reinterpret_cast<uint64_t>(_bufs + static_cast<size_t>(i) * BUF_SIZE);
+        b.len = BUF_SIZE;
+        b.bid = static_cast<unsigned short>(i);
+    }
+    __sync_synchronize();
+    _bufRing[0].resv = BUF_COUNT;
+    return true;
+}
+
+uint64_t UringPoller::userData(unsigned int gen, int fd, Op op) {
+    return (static_cast<uint64_t>(gen) << 32) | (static_cast<uint64_t>(fd) << 4) | op;
+}
+
+bool UringPoller::registered(int fd) const {
+    return fd >= 0 && static_cast<size_t>(fd) < _regs.size() && _regs[fd].kind != NONE;
+}
+
+// Next free SQE, zeroed. The tail is published right away: the kernel only
+// reads the SQ inside io_uring_enter(), which this thread calls after filling it.
+struct io_uring_sqe* UringPoller::nextSqe() {
+    unsigned tail = *_sqTail;
+    if (tail - loadAcquire(_sqHead) >= _sqEntries) {
+        // full: hand the queued batch over first
+        if (enter(_unsubmitted, 0, 0, -1) < 0 || tail - loadAcquire(_sqHead) >= _sqEntries) {
+            Logger::error("io_uring submission queue full");
+            return 0;
+        }
+    }
+    struct io_uring_sqe* sqe = &_sqes[tail & _sqMask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    storeRelease(_sqTail, tail + 1);
+    ++_unsubmitted;
+    return sqe;
+}
+
+int UringPoller::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, int timeoutMs) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    const void* argp = 0;
+    size_t argSize = 0;
+    if ((flags & IORING_ENTER_GETEVENTS) && timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+        std::memset(&arg, 0, sizeof(arg));
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argSize = sizeof(arg);
+    }
+
+    countSyscall();
+    int ret = uringEnter(_ringFd, toSubmit, minComplete, flags, argp, argSize);
+    if (ret > 0)
+        _unsubmitted -= static_cast<unsigned>(ret) < _unsubmitted ? static_cast<unsigned>(ret) : _unsubmitted;
+    return ret;
+}
+
+bool UringPoller::add(int fd, uint64_t token, bool edge) {
+    return watch(fd, token, edge ? CLIENT : WATCH);
+}
+
+bool UringPoller::addListener(int fd, uint64_t token) {
+    return watch(fd, token, LISTENER);
+}
+
+bool UringPoller::watch(int fd, uint64_t token, Kind kind) {
+    if (fd < 0 || fd > 0x0fffffff)
+        return false;
+    if (static_cast<size_t>(fd) >= _regs.size())
+        _regs.resize(fd + 1);
+
+    Reg& r = _regs[fd];
+    r.token = token;
+    ++r.gen;
+    r.kind = kind;
+    r.wantRead = true;
+    r.armed = false;
+    r.cancelling = false;
+    return arm(fd);
+}
+
+// Starts fd's multishot request
+bool UringPoller::arm(int fd) {
+    Reg& r = _regs[fd];
+    struct io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return false;
+
+    sqe->fd = fd;
+    if (r.kind == LISTENER) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = userData(r.gen, fd, OP_ACCEPT);
+    } else if (r.kind == CLIENT) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        sqe->user_data = userData(r.gen, fd, OP_RECV);
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = userData(r.gen, fd, OP_POLL);
+    }
+    r.armed = true;
+    return true;
+}
+
+void UringPoller::cancel(uint64_t target) {
+    struct io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = OP_CANCEL;
+}
+
+UringPoller::Op UringPoller::opOf(Kind kind) {
+    if (kind == LISTENER)
+        return OP_ACCEPT;
+    if (kind == CLIENT)
+        return OP_RECV;
+    return OP_POLL;
+}
+
+// The multishot request is cancelled; completions already posted for it
+// are dropped by the generation check. An in-flight send still completes.
+void UringPoller::remove(int fd) {
+    if (!registered(fd))
+        return;
+    Reg& r = _regs[fd];
+    if (r.armed && !r.cancelling)
+        cancel(userData(r.gen, fd, opOf(r.kind)));
+    unsigned int gen = r.gen;
+    r = Reg();
+    r.gen = gen;
+}
+
+void UringPoller::setWriteInterest(int, bool) {
+    // output is submitted with submitSend() and completes on its own
+}
+
+void UringPoller::setReadInterest(int fd, bool on) {
+    if (!registered(fd))
+        return;
+    Reg& r = _regs[fd];
+    if (r.wantRead == on)
+        return;
+    r.wantRead = on;
+
+    if (on) {
+        // while a cancel is still pending, its last completion re-arms instead
+        if (!r.armed)
+            arm(fd);
+    } else if (r.armed && !r.cancelling) {
+        cancel(userData(r.gen, fd, opOf(r.kind)));
+        r.cancelling = true;
+    }
+}
+
+bool UringPoller::submitSend(int fd, const struct iovec* iov, int count) {
+    if (!registered(fd) || count <= 0 || count > kMaxSendIov)
+        return false;
+
+    unsigned slot;
+    if (_freeSends.empty()) {
+        slot = static_cast<unsigned>(_sends.size());
+        _sends.push_back(new SendOp);
+    } else {
+        slot = _freeSends.back();
+        _freeSends.pop_back();
+    }
+    SendOp& op = *_sends[slot];
+    op.token = _regs[fd].token;
+    std::memcpy(op.iov, iov, count * sizeof(struct iovec));
+    std::memset(&op.msg, 0, sizeof(op.msg));
+    op.msg.msg_iov = op.iov;
+    op.msg.msg_iovlen = count;
+
+    struct io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        _freeSends.push_back(slot);
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&op.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (static_cast<uint64_t>(slot) << 4) | OP_SEND;
+    return true;
+}
+
+// Gives the buffers handed out by the previous wait() back to the kernel
+// and restarts the multishot requests that ended since
+void UringPoller::recycle() {
+    if (!_spent.empty()) {
+        unsigned short tail = _bufRing[0].resv;
+        const unsigned mask = BUF_COUNT - 1;
+        for (size_t i = 0; i < _spent.size(); i++) {
+            unsigned short bid = _spent[i];
+            struct io_uring_buf& b = _bufRing[(tail + i) & mask];
+            b.addr = reinterpret_cast<uint64_t>(_bufs + static_cast<size_t>(bid) * BUF_SIZE);
+            b.len = BUF_SIZE;
+            b.bid = bid;
+        }
+        __sync_synchronize();
+        _bufRing[0].resv = static_cast<unsigned short>(tail + _spent.size());
+        _spent.clear();
+    }
+
+    for (size_t i = 0; i < _rearm.size(); i++) {
+        uint64_t ud = _rearm[i];
+        int fd = static_cast<int>((ud >> 4) & 0x0fffffff);
+        if (!registered(fd))
+            continue;
+        Reg& r = _regs[fd];
+        if (r.gen == static_cast<unsigned int>(ud >> 32) && r.wantRead && !r.armed)
+            arm(fd);
+    }
+    _rearm.clear();
+}
+
+int UringPoller::wait(int timeoutMs) {
+    _ready.clear();
+    recycle();
+
+    // submit the batch and sleep for completions in one call; when completions
+    // are already waiting (and nothing is queued) there is no syscall at all
+    bool waiting = loadAcquire(_cqTail) != *_cqHead;
+    if (!waiting || _unsubmitted) {
+        unsigned flags = waiting ? 0 : IORING_ENTER_GETEVENTS;
+        int ret = enter(_unsubmitted, waiting ? 0 : 1, flags, timeoutMs);
+        if (ret < 0 && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+            return -1; // EINTR included, the caller retries
+    }
+
+    unsigned head = *_cqHead;
+    unsigned tail = loadAcquire(_cqTail);
+    for (; head != tail; head++)
+        complete(_cqes[head & _cqMask]);
+    storeRelease(_cqHead, head);
+    return static_cast<int>(_ready.size());
+}
+
+void UringPoller::complete(const struct io_uring_cqe& cqe) {
+    Op op = static_cast<Op>(cqe.user_data & 0xf);
+    PollEvent ev;
+
+    if (op == OP_SEND) {
+        unsigned slot = static_cast<unsigned>(cqe.user_data >> 4);
+        ev.token = _sends[slot]->token;
+        ev.kind = PollEvent::SENT;
+        ev.result = cqe.res;
+        _freeSends.push_back(slot);
+        _ready.push_back(ev); // also for a removed fd: the caller owns the bytes
+        return;
+    }
+    if (op == OP_CANCEL)
+        return; // only failures are posted: the request had already ended
+
+    int fd = static_cast<int>((cqe.user_data >> 4) & 0x0fffffff);
+    bool hasBuffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+    unsigned short bid = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (hasBuffer)
+        _spent.push_back(bid);
+
+    if (!registered(fd) || _regs[fd].gen != static_cast<unsigned int>(cqe.user_data >> 32))
+        return; // removed since (maybe the fd was reused)
+    Reg& r = _regs[fd];
+
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!more) {
+        r.armed = false;
+        r.cancelling = false;
+        // ended by a cancel, buffer shortage or similar: restart at the next
+        // wait (after buffers were returned); EOF and errors end it for good
+        bool restart = op != OP_RECV || cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED;
+        if (restart && r.wantRead)
+            _rearm.push_back(cqe.user_data);
+    }
+    if (cqe.res == -ECANCELED || cqe.res == -ENOBUFS)
+        return;
+
+    ev.token = r.token;
+    if (op == OP_ACCEPT) {
+        ev.kind = PollEvent::ACCEPTED;
+        ev.result = cqe.res;
+    } else if (op == OP_RECV) {
+        ev.kind = PollEvent::RECEIVED;
+        ev.result = cqe.res;
+        if (cqe.res > 0 && hasBuffer)
+            ev.data = _bufs + static_cast<size_t>(bid) * BUF_SIZE;
+    } else {
+        ev.readable = cqe.res > 0 && (cqe.res & POLLIN) != 0;
+        ev.error = cqe.res < 0 || (cqe.res & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+    }
+    _ready.push_back(ev);
+}
@@ -0,0 +1,240 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "Metrics.hpp"
+
+// One notification returned by Poller::wait().
+struct PollEvent {
+    enum Kind {
+        READY,    // readiness, see readable / writable / error
+        // completion backends only (Poller::completesIo())
+        ACCEPTED, // result: fd of the new connection, or -errno
+        RECEIVED, // result bytes at data (0: peer closed, < 0: -errno); valid until the next wait()
+        SENT      // a submitSend() finished, result: bytes written or -errno
+    };
+
+    uint64_t token; // value registered with add(), handed back untouched
+    Kind kind;
+    bool readable;
+    bool writable;
+    bool error;     // hangup / error / invalid fd
+    int result;
+    const char* data;
+
+    PollEvent() : token(0), kind(READY), readable(false), writable(false), error(false),
+                  result(0), data(0) {}
+};
+
+// Event loop backend. Server::run only talks to this interface, so the
+// poll(), epoll and io_uring backends can be swapped
+// (IRCSERV_BACKEND=poll|epoll|uring) and benchmarked against each other.
+class Poller {
+    public:
+        Poller() : _syscalls(0) {}
+        virtual ~Poller() {}
+
+        virtual bool init() = 0;
+        // edge: edge-triggered where the backend supports it (client sockets);
+        // the listening socket stays level-triggered so a failed accept() is retried.
+        virtual bool add(int fd, uint64_t token, bool edge) = 0;
+        virtual void remove(int fd) = 0;
+        // Toggle write readiness reporting (POLLOUT / EPOLLOUT) for fd.
+        virtual void setWriteInterest(int fd, bool on) = 0;
+        // Toggle read readiness reporting (on by default after add()).
+        // Turning it back on re-arms an edge-triggered fd.
+        virtual void setReadInterest(int fd, bool on) = 0;
+        // Blocks up to timeoutMs, returns number of ready events or -1 on error.
+        virtual int wait(int timeoutMs) = 0;
+        virtual const char* name() const = 0;
+
+        // Completion backends do the socket I/O themselves: the listener and
+        // client sockets report ACCEPTED / RECEIVED / SENT instead of readiness,
+        // and output goes through submitSend() instead of writev().
+        virtual bool completesIo() const { return false; }
+        virtual bool addListener(int fd, uint64_t token) { return add(fd, token, false); }
+        // Queues one write of iov[0..count) (count <= kMaxSendIov) on a client fd.
+        // The bytes must stay valid until the matching SENT event.
+        virtual bool submitSend(int, const struct iovec*, int) { return false; }
+
+        size_t eventCount() const { return _ready.size(); }
+        const PollEvent& event(size_t i) const { return _ready[i]; }
+
+        // syscalls made by the backend itself: counted by the owning thread
+        // only, like Metrics, and readable from any thread
+        unsigned long syscalls() const { return Metrics::read(_syscalls); }
+
+        static Poller* create(const std::string& backend);
+
+        enum { kMaxSendIov = 64 };
+
+    protected:
+        std::vector<PollEvent> _ready;
+
+        void countSyscall() { Metrics::bump(_syscalls); }
+
+    private:
+        volatile unsigned long _syscalls;
+};
+
+// poll() over a dense pollfd array; fd -> slot index keeps add/remove O(1)
+class PollPoller : public Poller {
+    public:
+        PollPoller() {}
+        bool init();
+        bool add(int fd, uint64_t token, bool edge);
+        void remove(int fd);
+        void setWriteInterest(int fd, bool on);
+        void setReadInterest(int fd, bool on);
+        int wait(int timeoutMs);
+        const char* name() const { return "poll"; }
+
+    private:
+        std::vector<struct pollfd> _fds;
+        std::vector<uint64_t> _tokens; // parallel to _fds
+        std::vector<int> _slotOf;   // fd -> index in _fds, -1 if absent
+};
+
+// Edge-triggered epoll; the token (fd + generation of the connection record)
+// comes back in epoll_event.data.u64, so the event leads straight to the record
+class EpollPoller : public Poller {
+    public:
+        EpollPoller();
+        ~EpollPoller();
+        bool init();
+        bool add(int fd, uint64_t token, bool edge);
+        void remove(int fd);
+        void setWriteInterest(int fd, bool on);
+        void setReadInterest(int fd, bool on);
+        int wait(int timeoutMs);
+        const char* name() const { return "epoll"; }
+
+    private:
+        EpollPoller(const EpollPoller&);
+        EpollPoller& operator=(const EpollPoller&);
+
+        struct Reg {
+            uint64_t token;
+            bool edge;
+            bool wantRead;
+            bool wantWrite;
+            bool used;
+            Reg() : token(0), edge(false), wantRead(true), wantWrite(false), used(false) {}
+        };
+
+        int _epfd;
+        std::vector<struct epoll_event> _events;
+        std::vector<Reg> _regs; // fd -> registration (needed to rebuild the mask on MOD)
+
+        bool modify(int fd, const Reg& r);
+};
+
+// io_uring (Linux 6.0+): one io_uring_enter() both submits everything queued
+// since the last wait and reaps the completions, and returns without a
+// syscall when completions are already waiting.
+//  - listener: multishot accept, one completion per new connection
+//  - clients: multishot recv into a ring of provided buffers, handed out as
+//    RECEIVED and given back to the kernel at the next wait()
+//  - output: sendmsg per submitSend(), completed as SENT
+//  - anything else (the wake eventfd): multishot poll, reported as READY
+// Completions carry (registration generation, fd, op) so the ones of a
+// removed fd are recognised even when the fd number was reused.
+class UringPoller : public Poller {
+    public:
+        UringPoller();
+        ~UringPoller();
+        bool init();
+        bool add(int fd, uint64_t token, bool edge);
+        bool addListener(int fd, uint64_t token);
+        void remove(int fd);
+        void setWriteInterest(int fd, bool on);
+        void setReadInterest(int fd, bool on);
+        int wait(int timeoutMs);
+        const char* name() const { return "uring"; }
+
+        bool completesIo() const { return true; }
+        bool submitSend(int fd, const struct iovec* iov, int count);
+
+        // Whether this kernel has everything the backend needs (probes a small ring)
+        static bool supported();
+
+    private:
+        UringPoller(const UringPoller&);
+        UringPoller& operator=(const UringPoller&);
+
+        enum Op { OP_ACCEPT = 1, OP_RECV, OP_POLL, OP_SEND, OP_CANCEL };
+        enum Kind { NONE, LISTENER, CLIENT, WATCH };
+        enum {
+            RING_ENTRIES = 4096,
+            BUF_COUNT = 2048,  // provided buffers (power of two)
+            BUF_SIZE = 4096,
+            BUF_GROUP = 0
+        };
+
+        struct Reg {
+            uint64_t token;
+            unsigned int gen;  // bumped on every add(), part of user_data
+            Kind kind;
+            bool wantRead;
+            bool armed;        // the multishot request is live
+            bool cancelling;   // an ASYNC_CANCEL for it is queued
+            Reg() : token(0), gen(0), kind(NONE), wantRead(false), armed(false), cancelling(false) {}
+        };
+
+        // one sendmsg in flight; the header and iovecs must outlive the submission
+        struct SendOp {
+            uint64_t token;
+            struct msghdr msg;
+            struct iovec iov[kMaxSendIov];
+        };
+
+        int _ringFd;
+        void* _ringMem;    // SQ and CQ rings (single mmap)
+        size_t _ringSize;
+        struct io_uring_sqe* _sqes;
+        size_t _sqesSize;
+        unsigned* _sqHead;
+        unsigned* _sqTail;
+        unsigned _sqMask;
+        unsigned _sqEntries;
+        unsigned* _cqHead;
+        unsigned* _cqTail;
+        unsigned _cqMask;
+        struct io_uring_cqe* _cqes;
+        unsigned _unsubmitted;
+
+        // provided buffer ring, indexed directly: in C++ the header's flexible
+        // array member does not start at offset 0. The tail overlays bufs[0].resv.
+        struct io_uring_buf* _bufRing;
+        size_t _bufRingSize;
+        char* _bufs;
+        std::vector<unsigned short> _spent; // buffer ids handed out by the last wait()
+
+        std::vector<Reg> _regs;              // fd -> registration
+        std::vector<uint64_t> _rearm;        // user_data of multishots to restart at the next wait()
+        std::vector<SendOp*> _sends;         // slot -> op, slots are never freed
+        std::vector<unsigned> _freeSends;
+
+        struct io_uring_sqe* nextSqe();
+        int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, int timeoutMs);
+        bool watch(int fd, uint64_t token, Kind kind);
+        bool registered(int fd) const;
+        bool arm(int fd);
+        void cancel(uint64_t target);
+        void recycle();
+        void complete(const struct io_uring_cqe& cqe);
+
+        static uint64_t userData(unsigned int gen, int fd, Op op);
+        static Op opOf(Kind kind);
+};
+
+#endif
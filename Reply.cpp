@@ -0,0 +1,37 @@
+#include "Reply.hpp"
+
+#include <cstring>
+
+Reply& Reply::append(const char* s, size_t n) {
+    if (n > room())
+        n = room();
+    std::memcpy(_buf + _len, s, n);
+    _len += n;
+    return *this;
+}
+
+Reply& Reply::operator<<(const char* s) {
+    return append(s, std::strlen(s));
+}
+
+Reply& Reply::operator<<(char c) {
+    if (room() > 0)
+        _buf[_len++] = c;
+    return *this;
+}
+
+Reply& Reply::operator<<(unsigned long n) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    return append(digits + i, sizeof(digits) - i);
+}
+
+Payload Reply::payload() {
+    _buf[_len] = '\r';
+    _buf[_len + 1] = '\n';
+    return Payload(_buf, _len + 2);
+}
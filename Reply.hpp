@@ -0,0 +1,38 @@
+#ifndef REPLY_HPP
+#define REPLY_HPP
+
+#include <cstddef>
+#include <string>
+
+#include "Payload.hpp"
+
+// One outgoing line, built in place in a buffer the size of the IRC line
+// limit (512 bytes, "\r\n" included). Appending never allocates, and text
+// past the limit is cut off here, so every line the server writes obeys it.
+class Reply {
+    public:
+        enum { MAX_LINE = 512 };
+
+        Reply() : _len(0) {}
+
+        Reply& append(const char* s, size_t n);
+        Reply& operator<<(const std::string& s) { return append(s.data(), s.size()); }
+        Reply& operator<<(const char* s);
+        Reply& operator<<(char c);
+        Reply& operator<<(unsigned long n);
+
+        size_t size() const { return _len; }
+        // bytes left before the limit
+        size_t room() const { return MAX_LINE - 2 - _len; }
+        // drops what was appended after the first len bytes
+        void rewind(size_t len) { if (len < _len) _len = len; }
+
+        // the line with its "\r\n"
+        Payload payload();
+
+    private:
+        char _buf[MAX_LINE];
+        size_t _len; // at most MAX_LINE - 2, room for the "\r\n"
+};
+
+#endif
@@ -2,55 +2,125 @@
 #include "ModeResult.hpp"
 #include <csignal>
 #include <cerrno>
+#include <sstream>
 
 // global flag. volatile - "this value can change unexpectedly”
-// when we receive SIGINT, we flip a flag, main loop checks it later
+// when we receive SIGINT, we flip a flag, every reactor loop checks it later
+// (atomic builtins: several threads read it, and they are signal safe)
 static volatile sig_atomic_t g_stop = 0;
 
+static void requestStop() {
+    __sync_lock_test_and_set(&g_stop, 1);
+}
+
 static void onSigInt(int) {
-    g_stop = 1;
+    requestStop();
+}
+
+// SIGUSR1: raw protocol trace on / off
+static void onSigUsr1(int) {
+    Logger::toggleRaw();
+}
+
+static bool stopping() {
+    return __sync_fetch_and_add(&g_stop, 0) != 0;
 }
 
-Server::Server(int port, const std::string& password)
+// SIGUSR2: hot restart, the loops stop and run() hands everything over
+static volatile sig_atomic_t g_upgrade = 0;
+
+static void onSigUsr2(int) {
+    __sync_lock_test_and_set(&g_upgrade, 1);
+    requestStop();
+}
+
+static bool upgrading() {
+    return __sync_fetch_and_add(&g_upgrade, 0) != 0;
+}
+
+// poller tokens of a shard's listening socket and wake eventfd;
+// client tokens never reach these values
+static const uint64_t kListenToken = ~static_cast<uint64_t>(0);
+static const uint64_t kWakeToken = ~static_cast<uint64_t>(0) - 1;
+// shard 0's metrics listener; a scrape's own socket is tagged with its bare fd
+// (generation 0, which client tokens never have)
+static const uint64_t kMetricsToken = ~static_cast<uint64_t>(0) - 2;
+
+// pthread_create argument for the extra reactor threads
+struct ShardStart {
+    Server* server;
+    Shard* shard;
+};
+
+Server::Server(int port, const std::string& password, const ServerConfig& config)
     :_port(port), 
-    _listenFd(-1),
     _password(password), 
-    _serverName("ircserv") { }
+    _serverName(config.serverName),
+    _serverPrefix(":" + _serverName + " "),
+    _config(config),
+    _current(0),
+    _unknownCommands(0),
+    _fanoutEpoch(0),
+    _metricsFd(-1),
+    _nextSnapshotAt(0),
+    _snapshotWriting(false),
+    _snapshotDone(0),
+    _lastBatch(0),
+    _argv(0) {
+    pthread_mutex_init(&_stateLock, 0);
+    registerCommands();
+    registerLinkCommands();
+    _history.configure(config.historyLines, config.historyBytes, config.historyBudget);
+}
 
 bool Server::init() {
     // SIGPIPE normally kills the process (server tries to send smth to a client that has already gone)
     // SIG_IGN disables that
     signal(SIGPIPE, SIG_IGN);
-    return setupListeningSocket();
+
+    size_t n = _config.threads;
+    for (size_t i = 0; i < n; i++) {
+        Shard* sh = new Shard(static_cast<int>(i), Poller::create(_config.backend));
+        _shards.push_back(sh);
+        if (!sh->init(n) || !setupListeningSocket(*sh, n > 1))
+            return false;
+    }
+    if (_config.metricsPort != 0 && !setupMetricsSocket())
+        return false;
+    if (!setupLinks())
+        return false;
+    loadSnapshot();
+    std::cout << "Event loop backend: " << _shards[0]->poller->name()
+              << ", " << n << " reactor thread" << (n > 1 ? "s" : "") << "\n";
+    return true;
 }
 
 Server::~Server() {
-    for (size_t i = 1; i < _pollFDs.size(); i++) {
-        if (_pollFDs[i].fd >= 0)
-            close(_pollFDs[i].fd);
+    for (int fd = 0; fd < _clients.limit(); fd++) {
+        if (_clients.find(fd))
+            close(fd);
     }
-    _pollFDs.clear();
-    _clients.clear();
-    _inbuf.clear();
     _nickToFd.clear();
 
-    if (_listenFd != -1)
-        close(_listenFd);
+    for (std::map<int, MetricsConn>::iterator it = _metricsConns.begin(); it != _metricsConns.end(); ++it)
+        close(it->first);
+    if (_metricsFd != -1)
+        close(_metricsFd);
+
+    for (size_t i = 0; i < _shards.size(); i++)
+        delete _shards[i];
+    pthread_mutex_destroy(&_stateLock);
 }
 
-int Server::findPollIndexByFd(int fd) const {
-    for (size_t i = 0; i < _pollFDs.size(); i++) {
-        if (_pollFDs[i].fd == fd)
-            return static_cast<int>(i);
-    }
-    return -1;
+namespace {
+    const std::string kNoNick("*");
 }
 
-std::string Server::nickOf(int fd) const {
-    std::map<int, Client>::const_iterator it = _clients.find(fd);
-    if (it != _clients.end() && !it->second.nick.empty())
-        return it->second.nick;
-    return "*";
+const std::string& Server::nickOf(int fd) const {
+    const Client* c = _clients.find(fd);
+    if (c && !c->nick.empty())
+        return c->nick;
+    return kNoNick;
 }
 
 int Server::findFdByNick(const std::string& nick) const {
@@ -68,43 +138,39 @@ bool Server::setNonBlocking(int fd) {
     return true;
 }
 
+// Only for the client whose line is being handled (its shard holds the lock)
 void Server::requestClose(int fd) {
-    std::map<int, Client>::iterator it = _clients.find(fd);
-    if (it != _clients.end())
-        it->second.closing = true;
-
-    // If nothing pending to send, we can disconnect right away.
-    // Otherwise flushClientWrite() will disconnect after buffer drains.
-    std::map<int, std::string>::iterator ob = _outbuf.find(fd);
-    if (ob == _outbuf.end() || ob->second.empty()) {
-        disconnectClientByFd(fd);
-    } else {
-        int idx = findPollIndexByFd(fd);
-        if (idx != -1)
-            _pollFDs[idx].events |= POLLOUT; // make sure we'll flush
-    }
+    Client* c = _clients.find(fd);
+    if (!c)
+        return;
+    c->closing = true; // no more of its lines are handled
+
+    // after the lines already sent to it: flushClientWrite() disconnects
+    // once its queue drains
+    _current->outbound[c->shard].send(ClientTable::tokenOf(*c), Payload(), true);
 }
 
-bool Server::setupListeningSocket() {
-    _listenFd = socket(AF_INET, SOCK_STREAM, 0); //IPV4, TCP, default
-    if (_listenFd < 0) {
+bool Server::setupListeningSocket(Shard& sh, bool reusePort) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0); //IPV4, TCP, default
+    if (fd < 0) {
         std::cerr << "socket() failed: " << std::strerror(errno) << "\n";
         return false;
     }
+    sh.listenFd = fd; // closed by the shard
 
-    if (!setNonBlocking(_listenFd)) {
-        close(_listenFd);
-        _listenFd = -1;
+    if (!setNonBlocking(fd))
         return false;
-    }
 
     int yes = 1;
     // apply options
     // Allow reusing a local address (IP + port) even if it’s still in TIME_WAIT
-    if (setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
         std::cerr << "setsockopt(SO_REUSEADDR) failed: " << std::strerror(errno) << "\n";
-        close(_listenFd);
-        _listenFd = -1;
+        return false;
+    }
+    // Every shard binds the same port; the kernel spreads new connections over them
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        std::cerr << "setsockopt(SO_REUSEPORT) failed: " << std::strerror(errno) << "\n";
         return false;
     }
 
@@ -115,246 +181,649 @@ bool Server::setupListeningSocket() {
     addr.sin_port = htons(static_cast<unsigned short>(_port)); // which port to listen
 
     //attach this socket to this IP address and this port number
-    if (bind(_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         std::cerr << "bind() failed: " << std::strerror(errno) << "\n";
-        close(_listenFd);
-        _listenFd = -1;
         return false;
     }
 
-    if (listen(_listenFd, SOMAXCONN) < 0) { // socket accepts incoming connection attempts
+    if (listen(fd, SOMAXCONN) < 0) { // socket accepts incoming connection attempts
         std::cerr << "listen() failed: " << std::strerror(errno) << "\n";
-        close(_listenFd);
-        _listenFd = -1;
         return false;
     }
 
-    std::cout << "Listening on port " << _port << " (fd=" << _listenFd << ")\n";
+    std::cout << "Listening on port " << _port << " (fd=" << fd << ", shard " << sh.id << ")\n";
     return true;
 }
 
-void Server::acceptNewClients() {
+void Server::acceptNewClients(Shard& sh) {
     while (true) {
         sockaddr_in clientAddr;
         socklen_t clientLen = sizeof(clientAddr);
 
-        int clientFd = accept(_listenFd, reinterpret_cast<sockaddr*>(&clientAddr), &clientLen);
+        Shard::add(sh.syscalls, 1);
+        int clientFd = accept(sh.listenFd, reinterpret_cast<sockaddr*>(&clientAddr), &clientLen);
         if (clientFd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
             }
-            std::cerr << "accept() failed: " << std::strerror(errno) << "\n";
+            Logger::error("accept() failed", -1, errno);
             break;
         }
 
+        Shard::add(sh.syscalls, 1);
         if (!setNonBlocking(clientFd)) {
             close(clientFd);
             continue; // keep server running
         }
-        std::cout << "connected fd=" << clientFd << "\n";
+        adoptClient(sh, clientFd);
+    }
+}
 
-        //add client fd to poll list
-        pollfd clientsPollFd;
-        clientsPollFd.fd = clientFd;
-        clientsPollFd.events = POLLIN | POLLOUT;
-        clientsPollFd.revents = 0;
-        this->_pollFDs.push_back(clientsPollFd);
-        // Ensure client state exists immediately
-        Client& c = _clients[clientFd];
-        c.fd = clientFd;
-        // Ensure input buffer entry exists too
-        _inbuf[clientFd] = "";
+// Gives an accepted socket its connection record and registers it with sh.
+// (With a completion backend the socket stays blocking: io_uring never
+// blocks the thread, it waits for readiness itself.) False if it was closed.
+bool Server::adoptClient(Shard& sh, int clientFd) {
+    if (clientFd >= ClientTable::REMOTE_BASE) {
+        close(clientFd);
+        return false;
     }
+
+    // Ensure client state (and both buffers) exists immediately
+    lockState(sh);
+    Client& c = _clients.open(clientFd);
+    c.shard = sh.id;
+    uint64_t token = ClientTable::tokenOf(c);
+    unlockState();
+
+    if (!sh.poller->add(clientFd, token, true)) {
+        lockState(sh);
+        _clients.release(clientFd);
+        unlockState();
+        close(clientFd);
+        return false;
+    }
+    sh.own(clientFd, token);
+    Metrics::bump(sh.metrics.connections);
+
+    // until registration completes, the only deadline is the registration one
+    c.connectedAt = c.lastInput = c.lastCommand = sh.now;
+    c.floodTokens = static_cast<long>(_config.floodBurst) * 1000;
+    c.floodRefilledAt = sh.now;
+    c.timer.token = token;
+    sh.timers.schedule(c.timer, sh.now + _config.registerTimeout * 1000);
+    Logger::info("connected", clientFd);
+    return true;
 }
 
 void Server::ensureChannelHasOperator(Channel& ch)
 {
-    if (ch.members.empty())
+    if (ch.empty())
         return;
 
-    if (!ch.operators.empty())
+    if (ch.opCount != 0)
         return;
 
     // Pick a member
-    int newOpFd = *ch.members.begin();
-    ch.operators.insert(newOpFd);
+    int newOpFd = ch.firstMember();
+    ch.setOperator(newOpFd, true);
 
     // Broadcast MODE +o if we can resolve a nick
-    std::map<int, Client>::iterator nit = _clients.find(newOpFd);
-    if (nit == _clients.end() || !nit->second.hasNick)
+    const Client* op = _clients.find(newOpFd);
+    if (!op || !op->hasNick)
         return;
 
-    std::string modeLine = ":" + _serverName + " MODE " + ch.name + " +o " + nit->second.nick;
-
-    for (std::set<int>::iterator mit = ch.members.begin(); mit != ch.members.end(); ++mit)
-        sendLine(*mit, modeLine);
+    Reply r;
+    r << _serverPrefix << "MODE " << ch.name << " +o " << op->nick;
+    Payload mode = r.payload();
+    broadcastToChannel(ch, mode, -1);
+    propagate(mode, -1);
 }
 
-void Server::disconnectClient(int pollFDInd) {
-    if (pollFDInd == 0)
-        return;
-
-    int fd = _pollFDs[pollFDInd].fd;
-
-    // Broadcast QUIT if user is known
-    std::map<int, Client>::iterator it = _clients.find(fd);
-    if (it != _clients.end() && it->second.hasNick) {
-        std::string quitLine = ":" + userPrefix(it->second) + " QUIT :Client Quit";
-
-        for (std::map<std::string, Channel>::iterator itc = _channels.begin();
-             itc != _channels.end(); ++itc) {
-
-            Channel& ch = itc->second;
-            if (ch.members.count(fd) == 0)
-                continue;
+void Server::destroyChannel(std::map<std::string, Channel>::iterator it) {
+    // pending invites die with the channel
+    Channel& ch = it->second;
+    for (std::vector<ChannelMember>::iterator mit = ch.roster.begin(); mit != ch.roster.end(); ++mit) {
+        if (!(mit->flags & ChannelMember::INVITED))
+            continue;
+        Client* c = _clients.find(mit->fd);
+        if (c)
+            c->invitedTo.erase(ch.name);
+    }
+    _history.forget(ch.name);
+    _channels.erase(it);
+}
 
-            for (std::set<int>::iterator mit = ch.members.begin();
-                 mit != ch.members.end(); ++mit) {
+// Takes a local client out of the IRC state: its QUIT goes out, it leaves
+// its channels and its nick is free. Any shard can do it, under the lock;
+// a second call does nothing.
+void Server::leaveNetwork(Client& c, const std::string& reason) {
+    int fd = c.fd;
+    // once per peer, however many channels they share, and once per link
+    if (c.hasNick) {
+        Reply quit;
+        quit << ':' << c.prefix << " QUIT :" << reason;
+        Payload quitLine = quit.payload();
+        fanOut(c.channels, quitLine, fd);
+        if (c.registered)
+            propagate(quitLine, -1);
+        _nickToFd.erase(c.nick);
+        c.hasNick = false;
+    }
 
-                if (*mit != fd)
-                    sendLine(*mit, quitLine);
-            }
-        }
+    // Drop pending invites, then leave the channels (only the ones this client is in)
+    for (std::set<std::string>::iterator nit = c.invitedTo.begin(); nit != c.invitedTo.end(); ++nit) {
+        std::map<std::string, Channel>::iterator itc = _channels.find(*nit);
+        if (itc != _channels.end())
+            itc->second.setInvited(fd, false);
     }
+    c.invitedTo.clear();
 
-    // Remove from channels
-    for (std::map<std::string, Channel>::iterator itc = _channels.begin(); itc != _channels.end(); ) {
+    for (std::set<std::string>::iterator nit = c.channels.begin(); nit != c.channels.end(); ++nit) {
+        std::map<std::string, Channel>::iterator itc = _channels.find(*nit);
+        if (itc == _channels.end())
+            continue;
         Channel& ch = itc->second;
 
-        ch.members.erase(fd);
-        ch.operators.erase(fd);
-        ch.invited.erase(fd);
+        ch.removeClient(fd);
 
-        if (ch.members.empty()) {
-            std::map<std::string, Channel>::iterator dead = itc;
-            ++itc;
-        _channels.erase(dead);
-        } else {
+        if (ch.empty())
+            destroyChannel(itc);
+        else
             ensureChannelHasOperator(ch);
-            ++itc;
-        }
     }
+    c.channels.clear();
+}
 
-    // Clean nick map + client
-    if (it != _clients.end()) {
-        if (it->second.hasNick)
-            _nickToFd.erase(it->second.nick);
-        _clients.erase(it);
+void Server::disconnectClient(int fd, const std::string& reason) {
+    Client* c = _clients.find(fd);
+    if (!c)
+        return; // already gone
+    if (c->link >= 0) {
+        killUser(fd, reason); // a remote user: no socket here
+        return;
     }
-
-    _inbuf.erase(fd);
-    _outbuf.erase(fd);
+    if (c->isLink)
+        splitLink(fd);
+    leaveNetwork(*c, reason);
+
+    // Free the client (the slot's generation moves on, stale events are ignored).
+    // Runs on the owning shard: the socket and its poller registration are its own.
+    Shard& sh = *_shards[c->shard];
+    if (c->readPaused)
+        Shard::add(sh.pausedClients, -1);
+    if (c->throttled)
+        Shard::add(sh.throttledClients, -1);
+    Shard::add(sh.queuedBytes, -static_cast<long>(c->out.bytes()));
+    // a send still in the kernel points into the queue: keep it until its SENT event
+    if (c->sending)
+        sh.retired[ClientTable::tokenOf(*c)].swap(c->out);
+    sh.timers.cancel(c->timer);
+    sh.poller->remove(fd);
+    sh.disown(fd);
+    _clients.release(fd);
+    Shard::add(sh.syscalls, 1);
     close(fd);
-    _pollFDs.erase(_pollFDs.begin() + pollFDInd);
 }
 
-void Server::flushClientWrite(int pollIndex) {
-    int fd = _pollFDs[pollIndex].fd;
-
-    std::map<int, std::string>::iterator it = _outbuf.find(fd);
-    if (it == _outbuf.end() || it->second.empty()) {
-        _pollFDs[pollIndex].events &= ~POLLOUT;
-        return;
+void Server::flushClientWrite(Shard& sh, int fd) {
+    Client& c = _clients.at(fd);
+    OutQueue& buf = c.out;
+
+    // completion backend: one send in flight per client, finishSend() goes on from there
+    if (sh.poller->completesIo() && !c.sending && !buf.empty()) {
+        struct iovec iov[Poller::kMaxSendIov];
+        int cnt = buf.gather(iov, Poller::kMaxSendIov);
+        if (!sh.poller->submitSend(fd, iov, cnt)) {
+            lockState(sh);
+            disconnectClient(fd);
+            unlockState();
+            return;
+        }
+        c.sending = true;
     }
 
-    std::string &buf = it->second;
-
-    while (!buf.empty()) {
-        ssize_t n = ::send(fd, buf.c_str(), buf.size(), 0);
+    while (!sh.poller->completesIo() && !buf.empty()) {
+        // one syscall for many queued lines (shared payloads are never copied)
+        struct iovec iov[Poller::kMaxSendIov];
+        int cnt = buf.gather(iov, Poller::kMaxSendIov);
+        Shard::add(sh.syscalls, 1);
+        ssize_t n = ::writev(fd, iov, cnt);
         if (n > 0) {
-            buf.erase(0, static_cast<size_t>(n)); // handle partial send
+            size_t lines = buf.consume(static_cast<size_t>(n)); // handle partial send
+            Shard::add(sh.queuedBytes, -static_cast<long>(n));
+            Metrics::bump(sh.metrics.bytesOut, static_cast<unsigned long>(n));
+            Shard::add(sh.linesOut, static_cast<long>(lines));
             continue;
         }
         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // not writable right now -> wait for next POLLOUT
+            // socket buffer is full -> only now ask the poller for POLLOUT
+            if (!c.wantWrite) {
+                c.wantWrite = true;
+                sh.poller->setWriteInterest(fd, true);
+            }
             break;
         }
         // other error -> disconnect
-        disconnectClient(pollIndex);
+        lockState(sh);
+        disconnectClient(fd);
+        unlockState();
         return;
     }
 
+    // drained back under the soft limit: take its input again, lines it
+    // already has (and held ones) at its next turn
+    if (c.readPaused && buf.bytes() < _config.sendqSoft) {
+        setReading(sh, c, true);
+        if (c.deferred || !c.held.empty())
+            scheduleTurn(sh, c);
+    }
+
     if (buf.empty()) {
-        _outbuf.erase(it);
-        _pollFDs[pollIndex].events &= ~POLLOUT;
+        if (c.wantWrite) {
+            c.wantWrite = false;
+            sh.poller->setWriteInterest(fd, false);
+        }
 
         // if client is marked closing, disconnect now (message is flushed)
-        std::map<int, Client>::iterator cit = _clients.find(fd);
-        if (cit != _clients.end() && cit->second.closing) {
-            disconnectClient(pollIndex);
+        if (c.closing) {
+            lockState(sh);
+            disconnectClient(fd);
+            unlockState();
             return;
         }
     }
 }
 
+// Completion of the send flushClientWrite() submitted for fd
+void Server::finishSend(Shard& sh, int fd, int result) {
+    Client& c = _clients.at(fd);
+    c.sending = false;
+    if (result < 0) {
+        Logger::error("send failed", fd, -result);
+        lockState(sh);
+        disconnectClient(fd);
+        unlockState();
+        return;
+    }
+
+    size_t lines = c.out.consume(static_cast<size_t>(result)); // may be partial
+    Shard::add(sh.queuedBytes, -static_cast<long>(result));
+    Metrics::bump(sh.metrics.bytesOut, static_cast<unsigned long>(result));
+    Shard::add(sh.linesOut, static_cast<long>(lines));
+    flushClientWrite(sh, fd);
+}
+
 void Server::run() {
     std::signal(SIGINT, onSigInt);
+    std::signal(SIGUSR1, onSigUsr1);
+    // a completion backend has input in its provided buffers and sends in
+    // the kernel that could not go with the sockets
+    if (_shards[0]->poller->completesIo())
+        std::signal(SIGUSR2, SIG_IGN);
+    else
+        std::signal(SIGUSR2, onSigUsr2);
+
+    // client sockets are tagged with ClientTable tokens, the listening socket
+    // with kListenToken and the wake eventfd with kWakeToken
+    for (size_t i = 0; i < _shards.size(); i++) {
+        Shard& sh = *_shards[i];
+        if (!sh.poller->addListener(sh.listenFd, kListenToken) || !sh.poller->add(sh.wakeFd, kWakeToken, false))
+            return;
+    }
+    // scrapes are rare and tiny: plain readiness on every backend
+    if (_metricsFd != -1 && !_shards[0]->poller->add(_metricsFd, kMetricsToken, false))
+        return;
 
-    pollfd listeningPollFd;
-    listeningPollFd.fd = _listenFd;
-    listeningPollFd.events = POLLIN;
-    listeningPollFd.revents = 0;
-    _pollFDs.push_back(listeningPollFd);
+    while (true) {
+        runShards();
+        finishSnapshot();
+        if (!upgrading() || handOff())
+            break;
+        // the new process did not take over: serve on
+        Logger::error("upgrade failed, still serving");
+        __sync_lock_release(&g_upgrade);
+        __sync_lock_release(&g_stop);
+    }
+}
 
-    while (!g_stop) {
-        int ret = poll(&_pollFDs[0], _pollFDs.size(), 1000); // number of fds with events
+// Runs every shard until stopping(); they are all stopped when it returns
+void Server::runShards() {
+    // shard 0 runs on this thread, so IRCSERV_THREADS=1 has no extra threads at all
+    size_t started = 1;
+    for (; started < _shards.size(); started++) {
+        Shard& sh = *_shards[started];
+        ShardStart* start = new ShardStart;
+        start->server = this;
+        start->shard = &sh;
+        if (pthread_create(&sh.thread, 0, &Server::shardMain, start) != 0) {
+            std::cerr << "pthread_create() failed for shard " << sh.id << "\n";
+            delete start;
+            requestStop();
+            break;
+        }
+    }
+
+    runShard(*_shards[0]);
+
+    requestStop(); // stop the other shards too
+    for (size_t i = 1; i < started; i++) {
+        uint64_t one = 1;
+        if (write(_shards[i]->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            Logger::error("eventfd write failed", _shards[i]->wakeFd, errno);
+        pthread_join(_shards[i]->thread, 0);
+    }
+}
+
+void* Server::shardMain(void* arg) {
+    ShardStart* start = static_cast<ShardStart*>(arg);
+    Server* self = start->server;
+    Shard* sh = start->shard;
+    delete start;
+
+    // SIGINT and SIGUSR2 are handled by the main thread (its wait returns at once)
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+
+    self->runShard(*sh);
+    return 0;
+}
+
+void Server::runShard(Shard& sh) {
+    while (!stopping()) {
+        // sleep until the next connection deadline, and at most 1 s (stopping() is polled);
+        // not at all while clients wait for their next turn
+        sh.now = TimerWheel::monotonicMs();
+        int timeout = sh.timers.timeoutMs(sh.now);
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+        if (!sh.backlog.empty())
+            timeout = 0;
+        int ret = sh.poller->wait(timeout); // number of fds with events
+        sh.now = TimerWheel::monotonicMs();
         if (ret < 0) {
             if (errno == EINTR) // interrupted by signal (SIGINT)
                 continue;
-            std::cerr << "poll() failed: " << std::strerror(errno) << "\n";
+            Logger::log(Logger::ERROR, "event loop wait failed", -1, errno, "backend", sh.poller->name(),
+                        std::strlen(sh.poller->name()));
+            requestStop();
             break;
         }
-        if (ret == 0)
-            continue;
+        uint64_t busyFrom = Metrics::nowNs();
+
+        // clients with lines left from the last iteration go before new input
+        serveBacklog(sh);
+
+        for (size_t i = 0; i < sh.poller->eventCount(); i++) {
+            const PollEvent& ev = sh.poller->event(i);
+
+            // Accept new clients (a completion backend hands over one it accepted)
+            if (ev.token == kListenToken) {
+                if (ev.kind != PollEvent::ACCEPTED)
+                    acceptNewClients(sh);
+                else if (ev.result >= 0)
+                    adoptClient(sh, ev.result);
+                else
+                    Logger::error("accept() failed", -1, -ev.result);
+                continue;
+            }
 
-        // Accept new clients
-        if (_pollFDs[0].revents & POLLIN) {
-            acceptNewClients();
-            _pollFDs[0].revents = 0;
-            --ret;
-        } else {
-            _pollFDs[0].revents = 0;
-        }
+            // Lines from other shards for our clients
+            if (ev.token == kWakeToken) {
+                sh.clearWake();
+                drainInbox(sh);
+                continue;
+            }
 
-        size_t i = 1;
-        while (i < _pollFDs.size() && ret > 0) {
-            short re = _pollFDs[i].revents;
-            if (re == 0) {
-                ++i;
+            // Metrics endpoint (shard 0): a scraper connecting, or its request
+            if (ev.token == kMetricsToken) {
+                acceptMetrics(sh);
+                continue;
+            }
+            if ((ev.token >> 32) == 0) {
+                serveMetrics(sh, static_cast<int>(ev.token));
                 continue;
             }
 
-            int fd = _pollFDs[i].fd;
+            int fd = static_cast<int>(ev.token & 0xffffffffu);
+            if (!sh.serves(fd, ev.token)) {
+                // the last send of a connection closed while it was in flight
+                if (ev.kind == PollEvent::SENT)
+                    sh.retired.erase(ev.token);
+                continue; // disconnected earlier in this batch (fd may even be reused)
+            }
 
-            // clear now
-            _pollFDs[i].revents = 0;
-            --ret;
+            // Completion backend: the I/O already happened
+            if (ev.kind == PollEvent::RECEIVED) {
+                handleClientData(sh, fd, ev.data, ev.result);
+                continue;
+            }
+            if (ev.kind == PollEvent::SENT) {
+                finishSend(sh, fd, ev.result);
+                continue;
+            }
 
             // IMPORTANT: handle hangup/error immediately
-            if (re & (POLLHUP | POLLERR | POLLNVAL)) {
-                disconnectClient(static_cast<int>(i));
+            if (ev.error) {
+                lockState(sh);
+                disconnectClient(fd);
+                unlockState();
                 continue;
             }
 
             //  Read first
-            if (re & POLLIN) {
-                handleClientRead(static_cast<int>(i));
-
-                if (i >= _pollFDs.size() || _pollFDs[i].fd != fd) {
-                    continue;
-                }
+            if (ev.readable) {
+                handleClientRead(sh, fd);
+                if (!sh.serves(fd, ev.token))
+                    continue; // disconnected while handling its input
             }
 
-            // Write pending output (only if poll said writable)
-            if (re & POLLOUT) {
-                flushClientWrite(static_cast<int>(i));
+            // Write pending output (only if the backend said writable)
+            if (ev.writable)
+                flushClientWrite(sh, fd);
+        }
 
-                if (i >= _pollFDs.size() || _pollFDs[i].fd != fd) {
-                    continue;
-                }
-            }
+        runTimers(sh);
+        if (sh.id == 0 && !_linkTargets.empty())
+            connectLinks(sh);
+        if (sh.id == 0 && !_config.stateFile.empty())
+            snapshotChannels(sh);
+
+        // Replies produced by this batch go out now, not after another wait
+        flushDirtyClients(sh);
+
+        sh.metrics.backlogClients = sh.backlog.size();
+        sh.metrics.loopNs.record(Metrics::nowNs() - busyFrom);
+    }
+}
+
+void Server::runTimers(Shard& sh) {
+    sh.expired.clear();
+    sh.timers.advance(sh.now, sh.expired);
+    for (size_t i = 0; i < sh.expired.size(); i++) {
+        uint64_t token = sh.expired[i];
+        int fd = static_cast<int>(token & 0xffffffffu);
+        if (!sh.serves(fd, token))
+            continue; // disconnected by an earlier timer of this batch
+        lockState(sh);
+        onClientTimer(sh, fd);
+        unlockState();
+
+        // out of flood credit with lines waiting: the bucket has refilled by now
+        if (sh.serves(fd, token) && _clients.at(fd).throttled)
+            scheduleTurn(sh, _clients.at(fd));
+    }
+}
 
-            ++i;
+// Under the state lock: fd's deadline passed. Activity never touches the
+// wheel, it only moves lastInput / lastCommand; here the deadline they imply
+// is either enforced or the timer is pushed to it.
+void Server::onClientTimer(Shard& sh, int fd) {
+    Client& c = _clients.at(fd);
+    uint64_t now = sh.now;
+
+    if (!c.registered) {
+        uint64_t deadline = c.connectedAt + _config.registerTimeout * 1000;
+        if (now >= deadline)
+            disconnectClient(fd, "Registration timed out");
+        else
+            sh.timers.schedule(c.timer, deadline);
+        return;
+    }
+
+    // anything received since our PING answers it
+    if (c.pingPending && c.lastInput > c.pingSentAt)
+        c.pingPending = false;
+
+    uint64_t next;
+    if (c.pingPending) {
+        next = c.pingSentAt + _config.pingTimeout * 1000;
+        if (now >= next) {
+            std::ostringstream reason;
+            reason << "Ping timeout: " << (now - c.lastInput) / 1000 << " seconds";
+            disconnectClient(fd, reason.str());
+            return;
+        }
+    } else {
+        next = c.lastInput + _config.pingInterval * 1000;
+        if (now >= next) {
+            // a client whose reads are paused can't answer: SendQ limits handle it
+            if (!c.readPaused) {
+                Reply ping;
+                ping << "PING :" << _serverName;
+                sendReply(fd, ping);
+                c.pingPending = true;
+                c.pingSentAt = now;
+                next = now + _config.pingTimeout * 1000;
+            } else
+                next = now + _config.pingInterval * 1000;
+        }
+    }
+
+    if (_config.idleTimeout && !c.isLink) {
+        uint64_t idleAt = c.lastCommand + _config.idleTimeout * 1000;
+        if (now >= idleAt) {
+            disconnectClient(fd, "Idle timeout");
+            return;
+        }
+        if (idleAt < next)
+            next = idleAt;
+    }
+    sh.timers.schedule(c.timer, next);
+}
+
+// Backpressure: a client whose SendQ is over the soft limit is not read
+// from, so its own commands can't grow the queue any further.
+void Server::setReading(Shard& sh, Client& c, bool on) {
+    c.readPaused = !on;
+    Shard::add(sh.pausedClients, on ? -1 : 1);
+    sh.poller->setReadInterest(c.fd, on && !c.heldFull && !c.floodHeld);
+}
+
+// Flood control: a throttled client is not read from either, its input waits
+// in the socket until the bucket refills and runTimers() gives it a turn
+void Server::holdForFlood(Shard& sh, Client& c, bool on) {
+    if (c.floodHeld == on)
+        return;
+    c.floodHeld = on;
+    sh.poller->setReadInterest(c.fd, !on && !c.readPaused && !c.heldFull);
+}
+
+void Server::flushDirtyClients(Shard& sh) {
+    // flushing can disconnect a client, whose QUIT marks more clients dirty,
+    // so the list may grow while we walk it
+    for (size_t i = 0; i < sh.dirty.size(); i++) {
+        uint64_t token = sh.dirty[i];
+        int fd = static_cast<int>(token & 0xffffffffu);
+        if (!sh.serves(fd, token))
+            continue; // disconnected since it was marked
+        Client& c = _clients.at(fd);
+        c.dirty = false;
+        if (c.sendqExceeded) {
+            lockState(sh);
+            disconnectClient(fd, "Max SendQ exceeded");
+            unlockState();
+        } else {
+            flushClientWrite(sh, fd);
+        }
+    }
+    sh.dirty.clear();
+}
+
+// Takes the state lock for sh. Lines other shards sent our clients before
+// this point are taken from the inbox now and delivered at unlockState()
+// ahead of our own, so they stay ahead of anything the handlers about to
+// run will send.
+void Server::lockState(Shard& sh) {
+    pthread_mutex_lock(&_stateLock);
+    _current = &sh;
+    sh.inbox.takeAll(sh.incoming);
+}
+
+// Hands the batches built under the lock to their shards before releasing
+// it, so deliveries reach each shard in lock order. Our own batch is
+// delivered after the unlock, the way every shard delivers what it is
+// posted: the per-member part of a fan-out runs on the members' shards,
+// in parallel, and only the roster walk holds the lock.
+void Server::unlockState() {
+    Shard& sh = *_current;
+    for (size_t i = 0; i < sh.outbound.size(); i++) {
+        if (static_cast<int>(i) != sh.id && !sh.outbound[i].empty())
+            _shards[i]->post(sh.outbound[i]);
+    }
+    sh.local.swap(sh.outbound[sh.id]);
+    _current = 0;
+    pthread_mutex_unlock(&_stateLock);
+
+    deliverIncoming(sh);
+    deliverBatch(sh, sh.local);
+    sh.local.clear();
+}
+
+// On the wake event, outside the lock
+void Server::drainInbox(Shard& sh) {
+    sh.inbox.takeAll(sh.incoming);
+    deliverIncoming(sh);
+}
+
+void Server::deliverIncoming(Shard& sh) {
+    for (size_t i = 0; i < sh.incoming.size(); i++)
+        deliverBatch(sh, sh.incoming[i]);
+    sh.incoming.clear();
+}
+
+// On sh's thread (or with the loops stopped), without the state lock:
+// recipients that left since the batch was built are skipped
+void Server::deliverBatch(Shard& sh, const DeliveryBatch& batch) {
+    for (size_t i = 0; i < batch.lines.size(); i++) {
+        const Delivery& d = batch.lines[i];
+        if (d.token == 0) {
+            long queued = 0;
+            for (size_t k = d.from; k < d.from + d.count; k++) {
+                Client* c = servedClient(sh, batch.recipients[k]);
+                if (c)
+                    queued += static_cast<long>(enqueue(sh, *c, d.payload));
+            }
+            Shard::add(sh.queuedBytes, queued);
+            continue;
+        }
+        Client* c = servedClient(sh, d.token);
+        if (!c)
+            continue;
+        if (!d.payload.empty())
+            deliver(sh, *c, d.payload);
+        if (d.close) {
+            c->closing = true;
+            markDirty(sh, *c);
         }
     }
 }
+
+Client* Server::servedClient(Shard& sh, uint64_t token) {
+    int fd = static_cast<int>(token & 0xffffffffu);
+    if (!sh.serves(fd, token))
+        return 0;
+    return &_clients.at(fd);
+}
@@ -14,47 +14,258 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 
 #include "IRCParser.hpp"
 #include "Client.hpp"
+#include "ClientTable.hpp"
 #include "Channel.hpp"
+#include "ChannelSnapshot.hpp"
+#include "Logger.hpp"
+#include "MessageHistory.hpp"
+#include "MessageTags.hpp"
 #include "ModeResult.hpp"
+#include "Poller.hpp"
+#include "Reply.hpp"
+#include "ServerConfig.hpp"
+#include "Shard.hpp"
+
+class Server;
+class StateWriter;
+class StateReader;
+
+// A scrape of the metrics endpoint in progress
+struct MetricsConn {
+    std::string request; // bytes of the HTTP request so far
+    bool answered;       // response written, waiting for the peer to close
+
+    MetricsConn() : answered(false) {}
+};
+
+// Another server of the network: linked to us, or behind one of our links
+struct RemoteServer {
+    std::string name;
+    std::string uplink;   // the server that introduced it (us for a direct link)
+    std::string info;
+    int link;             // our connection toward it
+    unsigned long hops;   // 1: linked to us
+};
+
+// An IRCSERV_LINKS entry: connected by shard 0, reconnected while down
+struct LinkTarget {
+    std::string text;     // "host:port", for the log
+    sockaddr_in addr;
+    uint64_t token;       // ClientTable token of the connection, 0 if none
+    uint64_t retryAt;     // ms, next connect attempt
+};
+
+typedef void (Server::*CommandHandler)(int fd, const ParsedMessage& msg);
+// a line from a linked server; line is the raw one, to pass on unchanged
+typedef void (Server::*LinkHandler)(int link, const ParsedMessage& msg, const Payload& line);
+
+// One row of the command dispatch table
+struct CommandEntry {
+    const char* name;        // upper case
+    size_t nameLen;
+    CommandHandler handler;
+    bool needsRegistration;  // 451 before the handler runs
+    size_t minParams;        // 461 below this
+    size_t maxParams;        // params past this are not copied out of the line
+    unsigned int cost;       // flood control tokens charged
+    unsigned long hits;
+};
 
 class Server {
     public:
-        Server(int port, const std::string& password);
+        Server(int port, const std::string& password, const ServerConfig& config);
         ~Server();
         bool init();
         void run();
 
+        // hot restart (ServerUpgrade.cpp): SIGUSR2 execs argv[0] again, which
+        // calls resume() instead of init() when upgradeFd() is not -1
+        void setCommandLine(char** argv);
+        static int upgradeFd();
+        bool resume(int stateFd);
+
     private:
+        friend struct BenchAccess; // bench/ drives handlers without sockets
+
         Server(const Server&);
         Server& operator=(const Server&); 
 
         int _port;
-        int _listenFd;
         std::string _password;
         std::string _serverName;
-        std::vector<pollfd> _pollFDs; // poll list (index 0 = listen fd, index 1..N = clients)
-        std::map<int, Client> _clients;
-        std::map<int, std::string> _outbuf;
-        std::map<int, std::string> _inbuf; // _inbuf is a dict where key<fd where we take message> <string message>;
+        std::string _serverPrefix; // ":<server name> ", how every numeric starts
+        ServerConfig _config;
+
+        // Reactor threads. Each one polls its own listener and connections
+        // (poll, epoll or io_uring backend, events carry ClientTable tokens). Everything
+        // below _stateLock is shared IRC state and only touched while holding
+        // it; _current is the shard that holds it.
+        std::vector<Shard*> _shards;
+        pthread_mutex_t _stateLock;
+        Shard* _current;
+
+        ClientTable _clients; // fd -> connection record (client state + both buffers)
         std::map<std::string, int> _nickToFd; // nick -> fd (for uniqueness checks)
         std::map<std::string, Channel> _channels;
+        ParsedMessage _msg; // scratch for the line being dispatched, keeps its capacity
+
+        // command dispatch: _commandSlots is a collision-free (perfect) hash of
+        // the upper-cased command name into _commands, rebuilt on registration
+        std::vector<CommandEntry> _commands;
+        std::vector<int> _commandSlots;
+        unsigned long _unknownCommands;
+        unsigned int _fanoutEpoch; // stamp of the current fanOut() call
+
+        // Prometheus text endpoint on 127.0.0.1 (IRCSERV_METRICS_PORT), run by
+        // shard 0's loop: its listener and the scrapes in progress
+        int _metricsFd;
+        std::map<int, MetricsConn> _metricsConns;
+
+        // Server links (ServerLink.cpp): the spanning tree beyond us, our
+        // established links, the ones we keep connecting and the link protocol
+        std::map<std::string, RemoteServer> _servers;
+        std::vector<int> _links;
+        std::vector<LinkTarget> _linkTargets;
+        std::map<std::string, LinkHandler> _linkCommands;
+
+        // channel snapshots (ServerSnapshot.cpp): the file mapped at startup, the
+        // shells a JOIN took from it since, and the thread writing the next one
+        ChannelSnapshot _snapshot;
+        std::set<std::string> _shellsTaken;
+        uint64_t _nextSnapshotAt;      // ms
+        std::string _snapshotImage;    // the last one written (or being written)
+        pthread_t _snapshotThread;
+        bool _snapshotWriting;
+        volatile int _snapshotDone;    // set by the writer thread
+
+        // recent channel lines (ServerHistory.cpp), for CHATHISTORY and JOIN
+        MessageHistory _history;
+        unsigned long _lastBatch; // IRCv3 batch ids, unique for the process
 
-        bool setupListeningSocket();
+        // hot restart: the binary to exec and its arguments
+        std::string _exe;
+        char** _argv;
+
+        bool setupListeningSocket(Shard& sh, bool reusePort);
         void requestClose(int fd);
         bool setNonBlocking(int fd);
-        void acceptNewClients();
 
-        void handleClientRead(int pollFdInd);
-        void flushClientWrite(int pollIndex);
-        void disconnectClient(int pollFDInd);
-        void disconnectClientByFd(int fd);
+        // reactor side (the shard's own thread, state lock not held)
+        static void* shardMain(void* arg);
+        void runShards();
+        void runShard(Shard& sh);
+        void acceptNewClients(Shard& sh);
+        bool adoptClient(Shard& sh, int clientFd);
+        void handleClientRead(Shard& sh, int fd);
+        void handleClientData(Shard& sh, int fd, const char* data, int result);
+        size_t feedInput(Shard& sh, int fd, const char* data, size_t len, size_t& budget);
+        bool resumeHeldInput(Shard& sh, int fd);
+        bool runDeferred(Shard& sh, int fd, size_t& budget);
+        void serveBacklog(Shard& sh);
+        void scheduleTurn(Shard& sh, Client& c);
+        void flushClientWrite(Shard& sh, int fd);
+        void finishSend(Shard& sh, int fd, int result);
+        void flushDirtyClients(Shard& sh);
+        void runTimers(Shard& sh);
+        void onClientTimer(Shard& sh, int fd);
+        void drainInbox(Shard& sh);
+        void deliverIncoming(Shard& sh);
+        void deliverBatch(Shard& sh, const DeliveryBatch& batch);
+        Client* servedClient(Shard& sh, uint64_t token);
+        void deliver(Shard& sh, Client& c, const Payload& p);
+        size_t enqueue(Shard& sh, Client& c, const Payload& p);
+        void markDirty(Shard& sh, Client& c);
+        void setReading(Shard& sh, Client& c, bool on);
+        void holdForFlood(Shard& sh, Client& c, bool on);
+        bool setupMetricsSocket();
+        void acceptMetrics(Shard& sh);
+        void serveMetrics(Shard& sh, int fd);
+        void closeMetrics(Shard& sh, int fd);
+        bool setupLinks();
+        void loadSnapshot();
+        void snapshotChannels(Shard& sh);
+        void finishSnapshot();
+        static void* snapshotMain(void* arg);
+        void connectLinks(Shard& sh);
+        void lockState(Shard& sh);
+        void unlockState();
+        void settleForHandOff();
+        void writeState(StateWriter& w, std::vector<int>& fds);
+        bool restoreState(StateReader& r);
+        bool handOff();
+
+        // under the state lock
+        bool processInput(int fd, size_t& budget);
+        bool hasFloodCredit(Client& c);
+        void disconnectClient(int fd, const std::string& reason = "Client Quit");
+        void leaveNetwork(Client& c, const std::string& reason);
         void sendLine(int fd, const std::string& line);
-        void onMessage(int pollInd, int fd, const ParsedMessage& msg);
+        void sendReply(int fd, Reply& r);
+        void sendPayload(int fd, const Payload& p);
+        Reply& numeric(Reply& r, const char* code, const std::string& target);
+        void sendNumeric(int fd, const char* code, const std::string& target, const char* text);
+        void sendNumeric(int fd, const char* code, const std::string& target,
+                         const std::string& arg, const char* text);
+        void onMessage(int fd, const MessageView& view);
+        void onMessage(int fd, const ParsedMessage& msg);
+        void dispatch(int fd, CommandEntry* cmd, const ParsedMessage& msg);
+        void registerCommands();
+        void addCommand(const char* name, CommandHandler handler,
+                        bool needsRegistration, size_t minParams, size_t maxParams,
+                        unsigned int cost);
+        CommandEntry* findCommand(const char* name, size_t len);
         void ensureChannelHasOperator(Channel& ch);
+        void destroyChannel(std::map<std::string, Channel>::iterator it);
         void tryRegister(int fd);
+        void renderMetrics(std::string& out);
+        void reportMetrics(int fd, const std::string& me);
+
+        // server links, under the state lock
+        void registerLinkCommands();
+        bool acceptLink(int fd, const ParsedMessage& msg);
+        void establishLink(int fd, const std::string& name, const std::string& info);
+        void sendBurst(int link);
+        void onLinkLine(int fd, const char* line, size_t len);
+        void propagate(const Payload& p, int exceptLink);
+        void relayToChannelLinks(const Channel& ch, const Payload& p, int exceptLink);
+        Reply& userIntro(Reply& r, const Client& u);
+        int linkUser(int link, const std::string& prefix) const;
+        bool fromLinkSide(int link, const std::string& prefix) const;
+        void killUser(int id, const std::string& reason);
+        void killLocalUser(int fd, const std::string& reason);
+        void removeRemoteUser(int id, const Payload& quit, bool reop);
+        void removeServer(const std::string& name, const std::string& reason, bool reop);
+        void splitLink(int fd);
+        void loseChannelTs(Channel& ch);
+        Reply& channelModes(Reply& r, const Channel& ch);
+
+        // channel snapshots, under the state lock
+        bool findShell(const std::string& name, Channel& out) const;
+        size_t addShells(ChannelSnapshot::Builder& b, size_t s, const std::string* name) const;
+        void encodeSnapshot(std::string& image) const;
+
+        // channel history, under the state lock
+        void sendHistory(int fd, const std::string& target, const std::vector<HistoryEntry>& lines);
+
+        void linkSERVER(int link, const ParsedMessage& msg, const Payload& line);
+        void linkNICK(int link, const ParsedMessage& msg, const Payload& line);
+        void linkQUIT(int link, const ParsedMessage& msg, const Payload& line);
+        void linkKILL(int link, const ParsedMessage& msg, const Payload& line);
+        void linkSJOIN(int link, const ParsedMessage& msg, const Payload& line);
+        void linkMODE(int link, const ParsedMessage& msg, const Payload& line);
+        void linkTOPIC(int link, const ParsedMessage& msg, const Payload& line);
+        void linkTB(int link, const ParsedMessage& msg, const Payload& line);
+        void linkKICK(int link, const ParsedMessage& msg, const Payload& line);
+        void linkINVITE(int link, const ParsedMessage& msg, const Payload& line);
+        void linkPRIVMSG(int link, const ParsedMessage& msg, const Payload& line);
+        void linkSQUIT(int link, const ParsedMessage& msg, const Payload& line);
+        void linkPING(int link, const ParsedMessage& msg, const Payload& line);
+        void linkEOB(int link, const ParsedMessage& msg, const Payload& line);
+        void linkERROR(int link, const ParsedMessage& msg, const Payload& line);
 
         // Handlers
         void handleCAP(int fd, const ParsedMessage& msg);
@@ -62,14 +273,20 @@ class Server {
         void handleNICK(int fd, const ParsedMessage& msg);
         void handleUSER(int fd, const ParsedMessage& msg);
         void handlePING(int fd, const ParsedMessage& msg);
+        void handlePONG(int fd, const ParsedMessage& msg);
         void handleJOIN(int fd, const ParsedMessage& msg);
         void handlePRIVMSG(int fd, const ParsedMessage& msg);
         void handleMODE(int fd, const ParsedMessage& msg);
         void handleWHO(int fd, const ParsedMessage& msg);
-        void handleQUIT(int pollInd);
+        void handleQUIT(int fd, const ParsedMessage& msg);
         void handleTOPIC(int fd, const ParsedMessage& msg);
         void handleINVITE(int fd, const ParsedMessage& msg);
         void handleKICK(int fd, const ParsedMessage& msg);
+        void handleSTATS(int fd, const ParsedMessage& msg);
+        void handleOPER(int fd, const ParsedMessage& msg);
+        void handleSERVER(int fd, const ParsedMessage& msg);
+        void handleLINKS(int fd, const ParsedMessage& msg);
+        void handleCHATHISTORY(int fd, const ParsedMessage& msg);
 
 
         // work with modes
@@ -86,11 +303,13 @@ class Server {
 
         //helpers
         std::string toUpper(std::string s);
-        std::string userPrefix(const Client& c);
+        static const std::string& userPrefix(const Client& c);
+        static void refreshPrefix(Client& c);
         bool isChannelOperator(const Channel& ch, int fd) const;
-        void broadcastToChannel(const Channel& ch, const std::string& line, int exceptFd);
-        int findPollIndexByFd(int fd) const;
-        std::string nickOf(int fd) const;
+        void broadcastToChannel(const Channel& ch, const Payload& p, int exceptFd);
+        void broadcastToChannel(const Channel& ch, TaggedLine& line, int exceptFd);
+        void fanOut(const std::set<std::string>& channels, const Payload& p, int exceptFd);
+        const std::string& nickOf(int fd) const;
 };
 
 #endif
@@ -1,89 +1,199 @@
 #include "Server.hpp"
+#include <cstdio>
+#include <sstream>
+#include <ctime>
 
-// PING / CAP / NICK / USER / PASS / QUIT
+// PING / CAP / NICK / USER / PASS / QUIT / STATS
 
 void Server::handlePING(int fd, const ParsedMessage& msg) {
+    Reply r;
+    r << "PONG";
     if (!msg.params.empty())
-        sendLine(fd, "PONG :" + msg.params[0]);
-    else
-        sendLine(fd, "PONG");
+        r << " :" << msg.params[0];
+    sendReply(fd, r);
 }
 
-// capabilities
+// The answer to our keepalive PING: receiving it is what counts (lastInput)
+void Server::handlePONG(int fd, const ParsedMessage& msg) {
+    (void)fd;
+    (void)msg;
+}
+
+namespace {
+    const std::string kNoParam; // CAP REQ without its list
+
+    // IRCv3 capabilities we offer, in CAP LS order
+    struct CapName {
+        const char* name;
+        unsigned char bit;
+    };
+    const CapName kCaps[] = {
+        { "batch",        Client::CAP_BATCH },
+        { "echo-message", Client::CAP_ECHO_MESSAGE },
+        { "message-tags", Client::CAP_MESSAGE_TAGS },
+        { "server-time",  Client::CAP_SERVER_TIME }
+    };
+    const size_t kCapCount = sizeof(kCaps) / sizeof(kCaps[0]);
+
+    // the bit of one CAP REQ name, 0 if we don't offer it
+    unsigned char capBit(const std::string& name) {
+        for (size_t i = 0; i < kCapCount; i++) {
+            if (name == kCaps[i].name)
+                return kCaps[i].bit;
+        }
+        return 0;
+    }
+}
+
+// capabilities: "CAP LS 302", "CAP LIST", "CAP REQ :a -b", "CAP END".
+// LS or REQ before registering holds it until END, so the capabilities are
+// in place before 001. A REQ is taken whole or not at all.
 void Server::handleCAP(int fd, const ParsedMessage& msg) {
-    // "CAP LS 302", "CAP END"
-    if (msg.params.empty())
+    Client& c = _clients.at(fd);
+    std::string me = c.hasNick ? c.nick : "*";
+    if (msg.params.empty()) {
+        Reply e;
+        numeric(e, "410", me) << ":Invalid CAP command";
+        sendReply(fd, e);
         return;
-
+    }
     std::string sub = toUpper(msg.params[0]);
-    if (sub == "LS") {
-        sendLine(fd, ":" + _serverName + " CAP * LS :"); //empty capability list
+
+    Reply r;
+    r << _serverPrefix << "CAP " << me << ' ';
+    if (sub == "LS" || sub == "LIST") {
+        bool ls = (sub == "LS");
+        if (ls && !c.registered)
+            c.capNegotiating = true;
+        r << sub << " :";
+        bool first = true;
+        for (size_t i = 0; i < kCapCount; i++) {
+            if (!ls && !(c.caps & kCaps[i].bit))
+                continue;
+            if (!first)
+                r << ' ';
+            r << kCaps[i].name;
+            first = false;
+        }
+        sendReply(fd, r);
+    } else if (sub == "REQ") {
+        const std::string& want = msg.params.size() > 1 ? msg.params[1] : kNoParam;
+        if (want.find_first_not_of(' ') == std::string::npos) {
+            Reply e; // nothing to take or refuse
+            numeric(e, "410", me) << msg.params[0] << " :Invalid CAP command";
+            sendReply(fd, e);
+            return;
+        }
+        if (!c.registered)
+            c.capNegotiating = true;
+        unsigned char caps = c.caps;
+        bool ok = true;
+        std::istringstream names(want);
+        std::string name;
+        while (ok && names >> name) {
+            bool off = (name[0] == '-');
+            unsigned char bit = capBit(off ? name.substr(1) : name);
+            if (bit == 0)
+                ok = false;
+            else if (off)
+                caps &= static_cast<unsigned char>(~bit);
+            else
+                caps |= bit;
+        }
+        if (ok)
+            c.caps = caps;
+        r << (ok ? "ACK" : "NAK") << " :" << want;
+        sendReply(fd, r);
+    } else if (sub == "END") {
+        if (c.capNegotiating) {
+            c.capNegotiating = false;
+            tryRegister(fd);
+        }
+    } else {
+        Reply e;
+        numeric(e, "410", me) << msg.params[0] << " :Invalid CAP command";
+        sendReply(fd, e);
     }
-    // CAP END: no reply needed
 }
 
 void Server::handleNICK(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
+    Client& c = _clients.at(fd);
     c.fd = fd;
 
     if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 431 * :No nickname given");
+        sendNumeric(fd, "431", "*", "No nickname given");
         return;
     }
 
-    std::string newNick = msg.params[0];
+    const std::string& newNick = msg.params[0];
 
     std::map<std::string, int>::iterator it = _nickToFd.find(newNick);
     if (it != _nickToFd.end() && it->second != fd) {
-        sendLine(fd, ":" + _serverName + " 433 * " + newNick + " :Nickname is already in use");
+        sendNumeric(fd, "433", "*", newNick, "Nickname is already in use");
         return;
     }
 
+    // registered users announce the change to themselves and every peer once
+    bool announce = c.registered && newNick != c.nick;
+    Reply r;
+    if (announce)
+        r << ':' << c.prefix << " NICK :" << newNick;
+
     if (c.hasNick)
         _nickToFd.erase(c.nick);
 
     c.nick = newNick;
     c.hasNick = true;
     _nickToFd[newNick] = fd;
+    refreshPrefix(c);
+
+    if (announce) {
+        c.nickTs = static_cast<unsigned long>(std::time(0));
+        Payload nickLine = r.payload();
+        sendPayload(fd, nickLine);
+        fanOut(c.channels, nickLine, fd);
+        propagate(nickLine, -1);
+    }
 
     tryRegister(fd);
 }
 
 // USER <username> <mode> <unused> :<realname>
 void Server::handleUSER(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
+    Client& c = _clients.at(fd);
     c.fd = fd;
 
     if (c.registered)
         return;
 
     if (msg.params.size() < 4) {
-        sendLine(fd, ":" + _serverName + " 461 * USER :Not enough parameters");
+        sendNumeric(fd, "461", "*", "USER", "Not enough parameters");
         return;
     }
 
     c.user = msg.params[0];
     c.realname = msg.params[3];
     c.hasUser = true;
+    refreshPrefix(c);
 
     tryRegister(fd);
 }
 
 void Server::handlePASS(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
+    Client& c = _clients.at(fd);
     c.fd = fd;
 
     if (c.registered)
         return;
 
     if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 461 * PASS :Not enough parameters");
+        sendNumeric(fd, "461", "*", "PASS", "Not enough parameters");
         return;
     }
 
     if (msg.params[0] != _password) {
-        sendLine(fd, ":" + _serverName + " 464 * :Password incorrect");
-        requestClose(fd);   // <-- instead of disconnectClientByFd(fd)
+        sendNumeric(fd, "464", "*", "Password incorrect");
+        requestClose(fd);   // <-- instead of disconnectClient(fd)
         return;
     }
 
@@ -91,23 +201,149 @@ void Server::handlePASS(int fd, const ParsedMessage& msg) {
     tryRegister(fd);
 }
 
-void Server::handleQUIT(int pollInd) {
-    disconnectClient(pollInd);
+// OPER <name> <password>, against IRCSERV_OPER_NAME / IRCSERV_OPER_PASSWORD
+void Server::handleOPER(int fd, const ParsedMessage& msg) {
+    Client& c = _clients.at(fd);
+    if (_config.operPassword.empty()) {
+        sendNumeric(fd, "491", c.nick, "No O-lines for your host");
+        return;
+    }
+    if (msg.params[0] != _config.operName || msg.params[1] != _config.operPassword) {
+        sendNumeric(fd, "464", c.nick, "Password incorrect");
+        return;
+    }
+    c.oper = true;
+    sendNumeric(fd, "381", c.nick, "You are now an IRC operator");
+}
+
+void Server::handleQUIT(int fd, const ParsedMessage&) {
+    disconnectClient(fd);
+}
+
+// STATS q: SendQ limits, queued bytes and slow consumers (per reactor shard)
+void Server::handleSTATS(int fd, const ParsedMessage& msg) {
+    std::string query = msg.params.empty() ? "*" : msg.params[0];
+    std::string me = nickOf(fd);
+
+    if (query == "q") {
+        // the counters belong to the shards' threads, read them atomically
+        unsigned long queued = 0, paused = 0, softHits = 0, hardKills = 0;
+        std::vector<unsigned long> shardQueued, shardPaused; // one reading, for the totals and the lines
+        for (size_t i = 0; i < _shards.size(); i++) {
+            Shard& sh = *_shards[i];
+            shardQueued.push_back(Shard::load(sh.queuedBytes));
+            shardPaused.push_back(Shard::load(sh.pausedClients));
+            queued += shardQueued.back();
+            paused += shardPaused.back();
+            softHits += Shard::load(sh.sendqSoftHits);
+            hardKills += Shard::load(sh.sendqHardKills);
+        }
+
+        Reply limits, total, consumers;
+        numeric(limits, "249", me) << query << " :limits soft " << _config.sendqSoft
+                                   << " hard " << _config.sendqHard;
+        numeric(total, "249", me) << query << " :queued " << queued << " bytes for "
+                                  << _clients.count() << " clients";
+        numeric(consumers, "249", me) << query << " :slow " << paused << " paused, " << softHits
+                                      << " soft limit hits, " << hardKills << " max sendq disconnects";
+        sendReply(fd, limits);
+        sendReply(fd, total);
+        sendReply(fd, consumers);
+        for (size_t i = 0; _shards.size() > 1 && i < _shards.size(); i++) {
+            Reply r;
+            numeric(r, "249", me) << query << " :shard " << static_cast<unsigned long>(_shards[i]->id)
+                                  << " queued " << shardQueued[i] << " bytes, " << shardPaused[i] << " paused";
+            sendReply(fd, r);
+        }
+    } else if (query == "e") {
+        // event loop cost: every syscall of the reactors against the lines moved
+        unsigned long calls = 0, in = 0, out = 0;
+        for (size_t i = 0; i < _shards.size(); i++) {
+            Shard& sh = *_shards[i];
+            unsigned long c = Shard::load(sh.syscalls) + sh.poller->syscalls();
+            unsigned long li = Shard::load(sh.linesIn);
+            unsigned long lo = Shard::load(sh.linesOut);
+            calls += c;
+            in += li;
+            out += lo;
+
+            Reply r;
+            numeric(r, "249", me) << query << " :shard " << static_cast<unsigned long>(sh.id) << ' '
+                                  << sh.poller->name() << ": " << c << " syscalls, " << li << " lines in, "
+                                  << lo << " lines out";
+            sendReply(fd, r);
+        }
+
+        Reply total;
+        numeric(total, "249", me) << query << " :total " << calls << " syscalls for " << (in + out)
+                                  << " messages";
+        if (in + out != 0) {
+            char ratio[32];
+            std::snprintf(ratio, sizeof(ratio), "%.3g",
+                          static_cast<double>(calls) / static_cast<double>(in + out));
+            total << " (" << ratio << " per message)";
+        }
+        sendReply(fd, total);
+    } else if (query == "f") {
+        // flood control: who is being held back, and how much input waited
+        unsigned long throttled = 0, throttles = 0, deferred = 0, kills = 0;
+        for (size_t i = 0; i < _shards.size(); i++) {
+            Shard& sh = *_shards[i];
+            throttled += Shard::load(sh.throttledClients);
+            throttles += Shard::load(sh.floodThrottles);
+            deferred += Shard::load(sh.deferredLines);
+            kills += Shard::load(sh.excessFloodKills);
+        }
+
+        Reply limits, counters;
+        numeric(limits, "249", me) << query << " :limits ";
+        if (_config.floodRate == 0)
+            limits << "off, ";
+        else
+            limits << _config.floodRate << " per second, burst " << _config.floodBurst << ", ";
+        limits << _config.linesPerTurn << " lines per turn";
+        numeric(counters, "249", me) << query << " :throttled " << throttled << " clients, " << throttles
+                                     << " throttles, " << deferred << " deferred lines, " << kills
+                                     << " excess flood disconnects";
+        sendReply(fd, limits);
+        sendReply(fd, counters);
+    } else if (query == "m") {
+        // command counts, latencies and fan-out: operators only
+        if (!_clients.at(fd).oper) {
+            sendNumeric(fd, "481", me, "Permission Denied- You're not an IRC operator");
+            return;
+        }
+        reportMetrics(fd, me);
+    }
+    sendNumeric(fd, "219", me, query, "End of /STATS report");
 }
 
 void Server::tryRegister(int fd) {
-    Client& c = _clients[fd];
+    Client& c = _clients.at(fd);
 
     if (c.registered) return;
     if (!c.passOk) return;
     if (!c.hasNick) return;
     if (!c.hasUser) return;
+    if (c.capNegotiating) return; // until CAP END
 
     c.registered = true;
+    c.nickTs = static_cast<unsigned long>(std::time(0));
+    Metrics::bump(_current->metrics.registrations);
+    // the registration deadline gives way to the keepalive / idle ones
+    _current->timers.schedule(c.timer, _current->now);
 
-    sendLine(fd, ":" + _serverName + " 001 " + c.nick + " :Welcome to the IRC server");
-    sendLine(fd, ":" + _serverName + " 002 " + c.nick + " :Your host is " + _serverName);
-    sendLine(fd, ":" + _serverName + " 003 " + c.nick + " :This server was created today");
+    sendNumeric(fd, "001", c.nick, "Welcome to the IRC server");
+    Reply host;
+    numeric(host, "002", c.nick) << ":Your host is " << _serverName;
+    sendReply(fd, host);
+    sendNumeric(fd, "003", c.nick, "This server was created today");
     // include user modes/channel modes for compatibility
-    sendLine(fd, ":" + _serverName + " 004 " + c.nick + " " + _serverName + " 0.1");
+    Reply info;
+    numeric(info, "004", c.nick) << _serverName << " 0.1";
+    sendReply(fd, info);
+
+    // the rest of the network learns the nick
+    Reply intro;
+    propagate(userIntro(intro, c).payload(), -1);
 }
\ No newline at end of file
@@ -1,42 +1,53 @@
 #include "Server.hpp"
 
-// JOIN / PRVMSG / WHO
+#include <ctime>
 
-void Server::handleJOIN(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
+// JOIN / PRVMSG / WHO
 
-    if (!c.registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered");
-        return;
-    }
+namespace {
+    const std::string kAnyMask("*"); // WHO without a mask
+    const std::string kNoKey;         // JOIN without a key
+}
 
-    if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 461 " + c.nick + " JOIN :Not enough parameters");
-        return;
-    }
+void Server::handleJOIN(int fd, const ParsedMessage& msg) {
+    // registration and param count are checked by the dispatcher
+    Client& c = _clients.at(fd);
 
-    std::string chanName = msg.params[0];
-    std::string providedKey = (msg.params.size() >= 2) ? msg.params[1] : "";
+    const std::string& chanName = msg.params[0];
+    const std::string& providedKey = (msg.params.size() >= 2) ? msg.params[1] : kNoKey;
 
     if (chanName.size() < 2 || chanName[0] != '#') {
-        sendLine(fd, ":" + _serverName + " 479 " + c.nick + " " + chanName + " :Illegal channel name");
+        sendNumeric(fd, "479", c.nick, chanName, "Illegal channel name");
         return;
     }
 
     // check if channel is new
     bool isNew = (_channels.find(chanName) == _channels.end());
 
+    // a channel of the last snapshot comes back with its topic and modes;
+    // the key still holds (+i and +l can't: nobody is there to invite)
+    Channel shell;
+    bool restored = isNew && findShell(chanName, shell);
+    if (restored && shell.hasKey && providedKey != shell.key) {
+        sendNumeric(fd, "475", c.nick, chanName, "Cannot join channel (+k)");
+        return;
+    }
+
     Channel& ch = _channels[chanName];
+    if (restored) {
+        ch = shell;
+        _shellsTaken.insert(chanName);
+    }
     ch.name = chanName;
 
     // If already in channel, do nothing
-    if (ch.members.find(fd) != ch.members.end())
+    if (ch.isMember(fd))
         return;
 
     // Enforce +i (invite-only) for existing channels
     if (!isNew && ch.inviteOnly) {
-        if (ch.invited.find(fd) == ch.invited.end()) {
-            sendLine(fd, ":" + _serverName + " 473 " + c.nick + " " + chanName + " :Cannot join channel (+i)");
+        if (!ch.isInvited(fd)) {
+            sendNumeric(fd, "473", c.nick, chanName, "Cannot join channel (+i)");
             return;
         }
     }
@@ -44,115 +55,150 @@ void Server::handleJOIN(int fd, const ParsedMessage& msg) {
     // Enforce +k (key) for existing channels
     if (!isNew && ch.hasKey) {
         if (providedKey != ch.key) {
-            sendLine(fd, ":" + _serverName + " 475 " + c.nick + " " + chanName + " :Cannot join channel (+k)");
+            sendNumeric(fd, "475", c.nick, chanName, "Cannot join channel (+k)");
             return;
         }
     }
 
     // Enforce +l (limit) for existing channels
     if (!isNew && ch.hasLimit) {
-        if (ch.members.size() >= ch.userLimit) {
-            sendLine(fd, ":" + _serverName + " 471 " + c.nick + " " + chanName + " :Cannot join channel (+l)");
+        if (ch.memberCount >= ch.userLimit) {
+            sendNumeric(fd, "471", c.nick, chanName, "Cannot join channel (+l)");
             return;
         }
     }
 
-    ch.members.insert(fd);
-    ch.invited.erase(fd); // consume invite if any
+    ch.addMember(fd);
+    ch.setInvited(fd, false); // consume invite if any
+    c.channels.insert(chanName);
+    c.invitedTo.erase(chanName);
 
     // First member becomes operator
-    if (isNew)
-        ch.operators.insert(fd);
+    if (isNew) {
+        ch.setOperator(fd, true);
+        if (!restored)
+            ch.ts = static_cast<unsigned long>(std::time(0));
+    }
 
-    std::string joinLine = ":" + userPrefix(c) + " JOIN " + chanName;
-    sendLine(fd, joinLine);
+    Reply join;
+    join << ':' << c.prefix << " JOIN " << chanName;
+    Payload joinLine = join.payload();
+    sendPayload(fd, joinLine);
 
     // Broadcast join to others
-    for (std::set<int>::iterator it = ch.members.begin(); it != ch.members.end(); it++) {
-        int toFd = *it;
-        if (toFd == fd) continue; //skip joining user to send everyone else but them
-        sendLine(toFd, joinLine);
+    for (std::vector<ChannelMember>::iterator it = ch.roster.begin(); it != ch.roster.end(); it++) {
+        int toFd = it->fd;
+        if (!it->joined() || (it->flags & ChannelMember::REMOTE) || toFd == fd) continue; //skip joining user to send everyone else but them
+        sendPayload(toFd, joinLine);
+    }
+
+    // linked servers get the channel's age with it: a channel made on two
+    // sides at once keeps the older one's operators (see linkSJOIN)
+    Reply sjoin;
+    sjoin << _serverPrefix << "SJOIN " << ch.ts << ' ' << chanName << ' ';
+    if (restored)
+        channelModes(sjoin, ch); // and its topic, after
+    else
+        sjoin << '+';
+    sjoin << " :" << (isNew ? "@" : "") << c.nick;
+    propagate(sjoin.payload(), -1);
+    if (restored && !ch.topic.empty()) {
+        Reply tb;
+        tb << _serverPrefix << "TB " << chanName << ' ' << ch.topicTs << " :" << ch.topic;
+        propagate(tb.payload(), -1);
     }
 
     // Topic replies (helps real clients)
     if (ch.topic.empty())
-        sendLine(fd, ":" + _serverName + " 331 " + c.nick + " " + chanName + " :No topic is set");
+        sendNumeric(fd, "331", c.nick, chanName, "No topic is set");
     else
-        sendLine(fd, ":" + _serverName + " 332 " + c.nick + " " + chanName + " :" + ch.topic);
-
-
-    // NAMES list
-    std::string names;
-    for (std::set<int>::iterator it = ch.members.begin(); it != ch.members.end(); it++) {
-        Client& m = _clients[*it];
-        if (!names.empty())
-            names += " ";
-        if (ch.operators.find(*it) != ch.operators.end())
-            names += "@";
-        names += m.nick;
+        sendNumeric(fd, "332", c.nick, chanName, ch.topic.c_str());
+
+
+    // NAMES list, as many 353 lines as the line limit takes; '@' is the only
+    // member prefix
+    Reply names;
+    numeric(names, "353", c.nick) << "= " << chanName << " :";
+    size_t head = names.size();
+    for (std::vector<ChannelMember>::iterator it = ch.roster.begin(); it != ch.roster.end(); it++) {
+        if (!it->joined())
+            continue;
+        Client& m = _clients.at(it->fd);
+        bool op = (it->flags & ChannelMember::OP) != 0;
+        size_t need = (names.size() > head ? 1 : 0) + (op ? 1 : 0) + m.nick.size();
+        if (names.size() > head && need > names.room()) {
+            sendReply(fd, names);
+            names.rewind(head);
+        }
+        if (names.size() > head)
+            names << ' ';
+        if (op)
+            names << '@';
+        names << m.nick;
+    }
+    sendReply(fd, names);
+    sendNumeric(fd, "366", c.nick, chanName, "End of /NAMES list.");
+
+    if (_config.historyOnJoin != 0) {
+        std::vector<HistoryEntry> lines;
+        _history.latest(chanName, _config.historyOnJoin, lines);
+        if (!lines.empty())
+            sendHistory(fd, chanName, lines);
     }
-
-    sendLine(fd, ":" + _serverName + " 353 " + c.nick + " = " + chanName + " :" + names);
-    sendLine(fd, ":" + _serverName + " 366 " + c.nick + " " + chanName + " :End of /NAMES list.");
 }
 
 
 void Server::handlePRIVMSG(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
-
-    if (!c.registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered");
-        return;
-    }
-
-    if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 461 " + c.nick + " PRIVMSG :Not enough parameters");
-        return;
-    }
+    Client& c = _clients.at(fd);
 
     // One param -> we have something (often trailing text) but no target
     if (msg.params.size() == 1) {
-        sendLine(fd, ":" + _serverName + " 411 " + c.nick + " :No recipient given (PRIVMSG)");
+        sendNumeric(fd, "411", c.nick, "No recipient given (PRIVMSG)");
         return;
     }
 
-    std::string target = msg.params[0];
-    std::string text = msg.params[1];
+    const std::string& target = msg.params[0];
+    const std::string& text = msg.params[1];
 
     if (target.empty()) {
-        sendLine(fd, ":" + _serverName + " 411 " + c.nick + " :No recipient given (PRIVMSG)");
+        sendNumeric(fd, "411", c.nick, "No recipient given (PRIVMSG)");
         return;
     }
 
     if (text.empty()) {
-        sendLine(fd, ":" + _serverName + " 412 " + c.nick + " :No text to send");
+        sendNumeric(fd, "412", c.nick, "No text to send");
         return;
     }
 
+    // the sender's client-only tags go on to message-tags recipients
+    std::string tags;
+    clientOnlyTags(msg.tags, tags);
+    uint64_t now = MessageHistory::nowMs();
+
     // Channel message
     if (target[0] == '#') {
         std::map<std::string, Channel>::iterator chit = _channels.find(target);
 
         // a channel with that name doesnt exist
         if (chit == _channels.end()) {
-            sendLine(fd, ":" + _serverName + " 403 " + c.nick + " " + target + " :No such channel");
+            sendNumeric(fd, "403", c.nick, target, "No such channel");
             return;
         }
 
         // a user isn't a memeber of that channel
         Channel& ch = chit->second;
-        if (ch.members.find(fd) == ch.members.end()) {
-            sendLine(fd, ":" + _serverName + " 404 " + c.nick + " " + target + " :Cannot send to channel");
+        if (!ch.isMember(fd)) {
+            sendNumeric(fd, "404", c.nick, target, "Cannot send to channel");
             return;
         }
 
-        std::string line = ":" + userPrefix(c) + " PRIVMSG " + target + " :" + text;
-
-        for (std::set<int>::iterator it = ch.members.begin(); it != ch.members.end(); it++) {
-            int toFd = *it;
-            if (toFd == fd) continue; // Halloy shows own message locally
-            sendLine(toFd, line);
-        }
+        Reply line;
+        line << ':' << c.prefix << " PRIVMSG " << target << " :" << text;
+        TaggedLine tagged(line.payload(), now, tags);
+        // Halloy shows own message locally; echo-message clients get it back
+        broadcastToChannel(ch, tagged, (c.caps & Client::CAP_ECHO_MESSAGE) ? -1 : fd);
+        relayToChannelLinks(ch, tagged.plain(), -1);
+        _history.record(ch.name, tagged.plain(), now);
         return;
     }
 
@@ -160,33 +206,52 @@ void Server::handlePRIVMSG(int fd, const ParsedMessage& msg) {
     std::map<std::string, int>::iterator it = _nickToFd.find(target);
     if (it == _nickToFd.end()) {
         // a user with that nick doesnt exist
-        sendLine(fd, ":" + _serverName + " 401 " + c.nick + " " + target + " :No such nick");
+        sendNumeric(fd, "401", c.nick, target, "No such nick");
         return;
     }
 
-    int toFd = it->second;
-    sendLine(toFd, ":" + userPrefix(c) + " PRIVMSG " + target + " :" + text);
+    Reply line;
+    line << ':' << c.prefix << " PRIVMSG " << target << " :" << text;
+    TaggedLine tagged(line.payload(), now, tags);
+    sendPayload(it->second, tagged.forCaps(_clients.at(it->second).caps));
+    if (c.caps & Client::CAP_ECHO_MESSAGE)
+        sendPayload(fd, tagged.forCaps(c.caps));
 }
 
 void Server::handleWHO(int fd, const ParsedMessage& msg) {
-    Client& c = _clients[fd];
-    std::string mask = msg.params.empty() ? "*" : msg.params[0];
+    Client& c = _clients.at(fd);
+    const std::string& mask = msg.params.empty() ? kAnyMask : msg.params[0];
 
     // If WHO is for a channel, send 352 for each member (useful for clients)
     if (!mask.empty() && mask[0] == '#') {
         std::map<std::string, Channel>::iterator chit = _channels.find(mask);
         if (chit != _channels.end()) {
             Channel& ch = chit->second;
-            for (std::set<int>::iterator it = ch.members.begin(); it != ch.members.end(); ++it) {
-                Client& m = _clients[*it];
-                std::string mu = m.user.empty() ? "user" : m.user;
-                std::string rn = m.realname.empty() ? m.nick : m.realname;
+            for (std::vector<ChannelMember>::iterator it = ch.roster.begin(); it != ch.roster.end(); ++it) {
+                if (!it->joined())
+                    continue;
+                Client& m = _clients.at(it->fd);
 
                 // 352 <me> <channel> <user> <host> <server> <nick> <flags> :<hopcount> <realname>
-                sendLine(fd, ":" + _serverName + " 352 " + c.nick + " " + mask + " " + mu + " localhost " + _serverName + " " + m.nick + " H :0 " + rn);
+                Reply r;
+                numeric(r, "352", c.nick) << mask << ' ';
+                if (m.user.empty())
+                    r << "user";
+                else
+                    r << m.user;
+                r << " localhost ";
+                if (m.link >= 0) {
+                    // a server the link has not introduced (yet) is at least one hop away
+                    std::map<std::string, RemoteServer>::const_iterator sit = _servers.find(m.server);
+                    r << m.server << ' ' << m.nick << " H :" << (sit != _servers.end() ? sit->second.hops : 1UL)
+                      << ' ';
+                } else
+                    r << _serverName << ' ' << m.nick << " H :0 ";
+                r << (m.realname.empty() ? m.nick : m.realname);
+                sendReply(fd, r);
             }
         }
     }
     // End of WHO
-    sendLine(fd, ":" + _serverName + " 315 " + c.nick + " " + mask + " :End of /WHO list.");
+    sendNumeric(fd, "315", c.nick, mask, "End of /WHO list.");
 }
\ No newline at end of file
@@ -1,32 +1,32 @@
 #include "Server.hpp"
 #include "ModeResult.hpp"
-#include <sstream>
+
+#include <ctime>
 
 // MODE / INVITE / KICK / TOPIC
 
+namespace {
+    const std::string kDefaultKickReason("Kicked");
+}
+
 // i, t, k, o, l
 // MODE <target> [modestring] [params...]
 // e.g.: MODE #general +i
 void Server::handleMODE(int fd, const ParsedMessage& msg) {
-    // we get just MODE, we still need to reply
-    if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 461 " + nickOf(fd) + " MODE :Not enough parameters");
-        return;
-    }
-
+    // a bare MODE is answered with 461 by the dispatcher
     const std::string& target = msg.params[0];
 
     // MODE #channel
     // check we work with channel, it should start with #
     if (target.empty() || target[0] != '#') {
-        sendLine(fd, ":" + _serverName + " 403 " + nickOf(fd) + " " + target + " :No such channel");
+        sendNumeric(fd, "403", nickOf(fd), target, "No such channel");
         return;
     }
 
     // Find channel if it exists
     std::map<std::string, Channel>::iterator chit = _channels.find(target);
     if (chit == _channels.end()) {
-        sendLine(fd, ":" + _serverName + " 403 " + nickOf(fd) + " " + target + " :No such channel");
+        sendNumeric(fd, "403", nickOf(fd), target, "No such channel");
         return;
     }
 
@@ -34,34 +34,24 @@ void Server::handleMODE(int fd, const ParsedMessage& msg) {
 
     // get current modes for a specific channel
     if (msg.params.size() == 1) { // MODE #channel - no modes
-        std::string nick = nickOf(fd);
         // build mode string, it should start with +
-        std::string modes = "+";
-        std::vector<std::string> modeParams;
+        Reply line;
+        numeric(line, "324", nickOf(fd)) << ch.name << " +";
 
         if (ch.inviteOnly)
-            modes += "i";
+            line << 'i';
         if (ch.topicOpsOnly)
-            modes += "t";
-        if (ch.hasLimit) {
-            modes += "l"; 
-            std::ostringstream stringStream; // safely convert integer to string
-            stringStream << ch.userLimit;
-            modeParams.push_back(stringStream.str());
-        }
-
-        std::string line = ":" + _serverName + " 324 " + nick + " " + ch.name + " " + modes;
-        for (size_t i = 0; i < modeParams.size(); i++)
-            line += " " + modeParams[i];
-
-        sendLine(fd, line);
+            line << 't';
+        if (ch.hasLimit)
+            line << "l " << static_cast<unsigned long>(ch.userLimit);
+
+        sendReply(fd, line);
         return;
     }
 
     // Must be operator to change modes
-    if (ch.operators.count(fd) == 0) {
-        std::string nick = nickOf(fd);
-        sendLine(fd, ":" + _serverName + " 482 " + nick + " " + ch.name + " :You're not channel operator");
+    if (!ch.isOperator(fd)) {
+        sendNumeric(fd, "482", nickOf(fd), ch.name, "You're not channel operator");
         return;
     }
 
@@ -69,201 +59,198 @@ void Server::handleMODE(int fd, const ParsedMessage& msg) {
     ModeResult r = applyChannelModeChanges(fd, ch, msg);
 
     if (r.anyChange) {
-        broadcastToChannel(ch, r.broadcastLine, -1);
+        Reply line;
+        line << r.broadcastLine;
+        broadcastToChannel(ch, line.payload(), -1);
+
+        // linked servers need the key too
+        Reply toLinks;
+        toLinks << ':' << _clients.at(fd).prefix << " MODE " << ch.name << ' ' << r.appliedModes;
+        for (size_t i = 0; i < r.linkParams.size(); i++)
+            toLinks << ' ' << r.linkParams[i];
+        propagate(toLinks.payload(), -1);
     }
 }
 
 
 void Server::handleTOPIC(int fd, const ParsedMessage& msg) {
-    std::map<int, Client>::iterator cit = _clients.find(fd);
-    if (cit == _clients.end())
+    Client* self = _clients.find(fd);
+    if (!self)
         return;
-    Client& c = cit->second;
+    Client& c = *self;
 
-    if (!c.registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered");
-        return;
-    }
-    if (msg.params.empty()) {
-        sendLine(fd, ":" + _serverName + " 461 " + c.nick + " TOPIC :Not enough parameters");
-        return;
-    }
-
-    std::string chanName = msg.params[0];
+    const std::string& chanName = msg.params[0];
     std::map<std::string, Channel>::iterator it = _channels.find(chanName);
     if (it == _channels.end()) {
-        sendLine(fd, ":" + _serverName + " 403 " + c.nick + " " + chanName + " :No such channel");
+        sendNumeric(fd, "403", c.nick, chanName, "No such channel");
         return;
     }
     Channel& ch = it->second;
 
-    if (ch.members.find(fd) == ch.members.end()) {
-        sendLine(fd, ":" + _serverName + " 442 " + c.nick + " " + chanName + " :You're not on that channel");
+    if (!ch.isMember(fd)) {
+        sendNumeric(fd, "442", c.nick, chanName, "You're not on that channel");
         return;
     }
 
     // Query topic
     if (msg.params.size() == 1) {
         if (ch.topic.empty())
-            sendLine(fd, ":" + _serverName + " 331 " + c.nick + " " + chanName + " :No topic is set");
+            sendNumeric(fd, "331", c.nick, chanName, "No topic is set");
         else
-            sendLine(fd, ":" + _serverName + " 332 " + c.nick + " " + chanName + " :" + ch.topic);
+            sendNumeric(fd, "332", c.nick, chanName, ch.topic.c_str());
         return;
     }
 
     // Set topic
     if (ch.topicOpsOnly && !isChannelOperator(ch, fd)) {
-        sendLine(fd, ":" + _serverName + " 482 " + c.nick + " " + chanName + " :You're not channel operator");
+        sendNumeric(fd, "482", c.nick, chanName, "You're not channel operator");
         return;
     }
 
     ch.topic = msg.params[1];
-    std::string line = ":" + userPrefix(c) + " TOPIC " + chanName + " :" + ch.topic;
-    broadcastToChannel(ch, line, -1);
+    ch.topicTs = static_cast<unsigned long>(std::time(0));
+    Reply line;
+    line << ':' << c.prefix << " TOPIC " << chanName << " :" << ch.topic;
+    Payload topicLine = line.payload();
+    broadcastToChannel(ch, topicLine, -1);
+    propagate(topicLine, -1);
 }
 
 
 void Server::handleINVITE(int fd, const ParsedMessage& msg)
 {
-    std::map<int, Client>::iterator cit = _clients.find(fd);
-    if (cit == _clients.end())
+    Client* self = _clients.find(fd);
+    if (!self)
         return;
-    Client& inviter = cit->second;
-
-    if (!inviter.registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered");
-        return;
-    }
+    Client& inviter = *self;
 
     // INVITE <nick> <#channel>
-    if (msg.params.size() < 2) {
-        sendLine(fd, ":" + _serverName + " 461 " + inviter.nick + " INVITE :Not enough parameters");
-        return;
-    }
-
-    std::string targetNick = msg.params[0];
-    std::string chanName = msg.params[1];
+    const std::string& targetNick = msg.params[0];
+    const std::string& chanName = msg.params[1];
 
     // channel exists?
     std::map<std::string, Channel>::iterator chit = _channels.find(chanName);
     if (chit == _channels.end()) {
-        sendLine(fd, ":" + _serverName + " 403 " + inviter.nick + " " + chanName + " :No such channel");
+        sendNumeric(fd, "403", inviter.nick, chanName, "No such channel");
         return;
     }
 
     Channel& ch = chit->second;
 
     // inviter is on channel?
-    if (ch.members.count(fd) == 0) {
-        sendLine(fd, ":" + _serverName + " 442 " + inviter.nick + " " + chanName + " :You're not on that channel");
+    if (!ch.isMember(fd)) {
+        sendNumeric(fd, "442", inviter.nick, chanName, "You're not on that channel");
         return;
     }
 
     // in this project INVITE is operator command => require operator
-    if (ch.operators.count(fd) == 0) {
-        sendLine(fd, ":" + _serverName + " 482 " + inviter.nick + " " + chanName + " :You're not channel operator");
+    if (!ch.isOperator(fd)) {
+        sendNumeric(fd, "482", inviter.nick, chanName, "You're not channel operator");
         return;
     }
 
     // target exists?
     int targetFd = findFdByNick(targetNick);
     if (targetFd == -1) {
-        sendLine(fd, ":" + _serverName + " 401 " + inviter.nick + " " + targetNick + " :No such nick");
+        sendNumeric(fd, "401", inviter.nick, targetNick, "No such nick");
         return;
     }
 
     // target already in channel?
-    if (ch.members.count(targetFd) != 0) {
-        sendLine(fd, ":" + _serverName + " 443 " + inviter.nick + " " + targetNick + " " + chanName + " :is already on channel");
+    if (ch.isMember(targetFd)) {
+        Reply r;
+        numeric(r, "443", inviter.nick) << targetNick << ' ' << chanName << " :is already on channel";
+        sendReply(fd, r);
         return;
     }
 
-    // store invite (by fd)
-    ch.invited.insert(targetFd);
+    // store invite (by fd), and on the target for cleanup; a remote
+    // target's server stores it (linkINVITE)
+    Client& target = _clients.at(targetFd);
+    if (target.link < 0) {
+        ch.setInvited(targetFd, true);
+        target.invitedTo.insert(chanName);
+    }
 
-    // notify target
-    sendLine(targetFd, ":" + userPrefix(inviter) + " INVITE " + targetNick + " " + chanName);
+    // notify target (through its link if remote)
+    Reply invite;
+    invite << ':' << inviter.prefix << " INVITE " << targetNick << ' ' << chanName;
+    sendReply(targetFd, invite);
 
     // notify inviter (341)
-    sendLine(fd, ":" + _serverName + " 341 " + inviter.nick + " " + targetNick + " " + chanName);
+    Reply r;
+    numeric(r, "341", inviter.nick) << targetNick << ' ' << chanName;
+    sendReply(fd, r);
 }
 
 void Server::handleKICK(int fd, const ParsedMessage& msg)
 {
-    std::map<int, Client>::iterator cit = _clients.find(fd);
-    if (cit == _clients.end())
-        return;
-    Client& kicker = cit->second;
-
-    if (!kicker.registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered");
+    Client* self = _clients.find(fd);
+    if (!self)
         return;
-    }
+    Client& kicker = *self;
 
     // KICK <#channel> <nick> [reason]
-    if (msg.params.size() < 2) {
-        sendLine(fd, ":" + _serverName + " 461 " + kicker.nick + " KICK :Not enough parameters");
-        return;
-    }
-
+    // copies: the target's record and the channel may go away below
     std::string chanName = msg.params[0];
-    std::string targetNick = msg.params[1];
-
-    std::string reason = "Kicked";
-    if (msg.params.size() >= 3)
-        reason = msg.params[2];
+    const std::string& targetNick = msg.params[1];
+    const std::string& reason = (msg.params.size() >= 3) ? msg.params[2] : kDefaultKickReason;
 
     // channel exists?
     std::map<std::string, Channel>::iterator chit = _channels.find(chanName);
     if (chit == _channels.end()) {
-        sendLine(fd, ":" + _serverName + " 403 " + kicker.nick + " " + chanName + " :No such channel");
+        sendNumeric(fd, "403", kicker.nick, chanName, "No such channel");
         return;
     }
 
     Channel& ch = chit->second;
 
     // kicker is on channel?
-    if (ch.members.count(fd) == 0) {
-        sendLine(fd, ":" + _serverName + " 442 " + kicker.nick + " " + chanName + " :You're not on that channel");
+    if (!ch.isMember(fd)) {
+        sendNumeric(fd, "442", kicker.nick, chanName, "You're not on that channel");
         return;
     }
 
     // operator only
-    if (ch.operators.count(fd) == 0) {
-        sendLine(fd, ":" + _serverName + " 482 " + kicker.nick + " " + chanName + " :You're not channel operator");
+    if (!ch.isOperator(fd)) {
+        sendNumeric(fd, "482", kicker.nick, chanName, "You're not channel operator");
         return;
     }
 
     // target exists?
     int targetFd = findFdByNick(targetNick);
     if (targetFd == -1) {
-        sendLine(fd, ":" + _serverName + " 401 " + kicker.nick + " " + targetNick + " :No such nick");
+        sendNumeric(fd, "401", kicker.nick, targetNick, "No such nick");
         return;
     }
 
     // target is on channel?
-    if (ch.members.count(targetFd) == 0) {
-        sendLine(fd, ":" + _serverName + " 441 " + kicker.nick + " " + targetNick + " " + chanName + " :They aren't on that channel");
+    if (!ch.isMember(targetFd)) {
+        Reply r;
+        numeric(r, "441", kicker.nick) << targetNick << ' ' << chanName << " :They aren't on that channel";
+        sendReply(fd, r);
         return;
     }
 
     // build KICK message
-    std::string kickLine = ":" + userPrefix(kicker) + " KICK " + chanName + " " + targetNick + " :" + reason;
+    Reply kickLine;
+    kickLine << ':' << kicker.prefix << " KICK " << chanName << ' ' << targetNick << " :" << reason;
 
-    // broadcast to channel (including target)
-    std::set<int>::iterator it = ch.members.begin();
-    while (it != ch.members.end()) {
-        sendLine(*it, kickLine);
-        ++it;
-    }
+    // broadcast to channel (including target), and to the links
+    Payload kick = kickLine.payload();
+    broadcastToChannel(ch, kick, -1);
+    propagate(kick, -1);
 
     // remove target from channel
-    ch.members.erase(targetFd);
-    ch.operators.erase(targetFd);
-    ch.invited.erase(targetFd);
-
-    if (ch.members.empty()) {
-        _channels.erase(chit);
+    Client& target = _clients.at(targetFd);
+    if (target.link >= 0)
+        ch.removeLinkMember(target.link);
+    ch.removeClient(targetFd);
+    target.channels.erase(chanName);
+    target.invitedTo.erase(chanName);
+
+    if (ch.empty()) {
+        destroyChannel(chit);
         return;
     }
 
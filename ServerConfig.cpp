@@ -0,0 +1,104 @@
+#include "ServerConfig.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+namespace {
+    // number from the environment, out untouched if unset or invalid
+    void readSize(const char* name, size_t& out, bool allowZero = false) {
+        const char* s = std::getenv(name);
+        if (!s || !*s)
+            return;
+        char* end = 0;
+        unsigned long v = std::strtoul(s, &end, 10);
+        if (*end != '\0' || (v == 0 && !allowZero)) {
+            std::cerr << "ignoring " << name << "='" << s << "'\n";
+            return;
+        }
+        out = static_cast<size_t>(v);
+    }
+}
+
+ServerConfig ServerConfig::fromEnv() {
+    ServerConfig cfg;
+
+    const char* backend = std::getenv("IRCSERV_BACKEND");
+    if (backend && *backend)
+        cfg.backend = backend;
+
+    readSize("IRCSERV_THREADS", cfg.threads, true);
+    if (cfg.threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg.threads = cpus > 0 ? static_cast<size_t>(cpus) : 1;
+    }
+
+    readSize("IRCSERV_SENDQ_SOFT", cfg.sendqSoft);
+    readSize("IRCSERV_SENDQ_HARD", cfg.sendqHard);
+    if (cfg.sendqSoft > cfg.sendqHard)
+        cfg.sendqSoft = cfg.sendqHard;
+
+    readSize("IRCSERV_PING_INTERVAL", cfg.pingInterval);
+    readSize("IRCSERV_PING_TIMEOUT", cfg.pingTimeout);
+    readSize("IRCSERV_REGISTER_TIMEOUT", cfg.registerTimeout);
+    readSize("IRCSERV_IDLE_TIMEOUT", cfg.idleTimeout, true);
+
+    readSize("IRCSERV_FLOOD_RATE", cfg.floodRate, true);
+    readSize("IRCSERV_FLOOD_BURST", cfg.floodBurst);
+    readSize("IRCSERV_LINES_PER_TURN", cfg.linesPerTurn);
+
+    const char* operName = std::getenv("IRCSERV_OPER_NAME");
+    if (operName && *operName)
+        cfg.operName = operName;
+    const char* operPassword = std::getenv("IRCSERV_OPER_PASSWORD");
+    if (operPassword)
+        cfg.operPassword = operPassword;
+
+    readSize("IRCSERV_METRICS_PORT", cfg.metricsPort, true);
+    if (cfg.metricsPort > 65535) {
+        std::cerr << "ignoring IRCSERV_METRICS_PORT=" << cfg.metricsPort << "\n";
+        cfg.metricsPort = 0;
+    }
+
+    const char* logLevel = std::getenv("IRCSERV_LOG_LEVEL");
+    if (logLevel && *logLevel && !Logger::parseLevel(logLevel, cfg.logLevel))
+        std::cerr << "ignoring IRCSERV_LOG_LEVEL='" << logLevel << "'\n";
+
+    const char* serverName = std::getenv("IRCSERV_SERVER_NAME");
+    if (serverName && *serverName) {
+        // one word, it goes into prefixes and SERVER lines
+        if (std::string(serverName).find_first_of(" :!@*,") == std::string::npos)
+            cfg.serverName = serverName;
+        else
+            std::cerr << "ignoring IRCSERV_SERVER_NAME='" << serverName << "'\n";
+    }
+    const char* linkPassword = std::getenv("IRCSERV_LINK_PASSWORD");
+    if (linkPassword)
+        cfg.linkPassword = linkPassword;
+    const char* links = std::getenv("IRCSERV_LINKS");
+    for (const char* s = links; s && *s; ) {
+        const char* end = std::strchr(s, ',');
+        std::string target = end ? std::string(s, end) : std::string(s);
+        if (!target.empty())
+            cfg.links.push_back(target);
+        s = end ? end + 1 : 0;
+    }
+    if (!cfg.links.empty() && cfg.linkPassword.empty()) {
+        std::cerr << "ignoring IRCSERV_LINKS without IRCSERV_LINK_PASSWORD\n";
+        cfg.links.clear();
+    }
+    readSize("IRCSERV_LINK_SENDQ", cfg.linkSendq);
+
+    const char* stateFile = std::getenv("IRCSERV_STATE_FILE");
+    if (stateFile)
+        cfg.stateFile = stateFile;
+    readSize("IRCSERV_SNAPSHOT_INTERVAL", cfg.snapshotInterval);
+
+    readSize("IRCSERV_HISTORY_LINES", cfg.historyLines, true);
+    readSize("IRCSERV_HISTORY_BYTES", cfg.historyBytes);
+    readSize("IRCSERV_HISTORY_BUDGET", cfg.historyBudget);
+    readSize("IRCSERV_HISTORY_ON_JOIN", cfg.historyOnJoin, true);
+
+    return cfg;
+}
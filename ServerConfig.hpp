@@ -0,0 +1,70 @@
+#ifndef SERVERCONFIG_HPP
+#define SERVERCONFIG_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "Logger.hpp"
+
+// Runtime knobs that are not part of the "./ircserv <port> <password>" contract.
+// Read from the environment so the command line stays the one the subject requires.
+struct ServerConfig {
+    std::string backend; // IRCSERV_BACKEND: "epoll" (default), "poll" or "uring" (falls back to epoll)
+    // IRCSERV_THREADS: reactor threads, each with its own SO_REUSEPORT listener.
+    // 1 (default) runs everything on the main thread; 0 means one per CPU.
+    size_t threads;
+
+    // SendQ watermarks (bytes queued for one client, not yet written)
+    size_t sendqSoft; // IRCSERV_SENDQ_SOFT: stop reading from the client until it drains
+    size_t sendqHard; // IRCSERV_SENDQ_HARD: disconnect with "Max SendQ exceeded"
+
+    // Connection deadlines, in seconds
+    size_t pingInterval;    // IRCSERV_PING_INTERVAL: silence before the server sends PING
+    size_t pingTimeout;     // IRCSERV_PING_TIMEOUT: then this long to get anything back
+    size_t registerTimeout; // IRCSERV_REGISTER_TIMEOUT: to complete PASS / NICK / USER
+    size_t idleTimeout;     // IRCSERV_IDLE_TIMEOUT: without a command besides PING / PONG, 0 = never
+
+    // Flood control: a token bucket per client, a command costs 1 token (JOIN, WHO, MODE more)
+    size_t floodRate;    // IRCSERV_FLOOD_RATE: tokens gained a second, 0 = no flood control
+    size_t floodBurst;   // IRCSERV_FLOOD_BURST: bucket size, the burst allowed after a pause
+    size_t linesPerTurn; // IRCSERV_LINES_PER_TURN: lines of one client per loop iteration
+
+    // Operators: "OPER <name> <password>" unlocks STATS m; no password, no operators
+    std::string operName;     // IRCSERV_OPER_NAME
+    std::string operPassword; // IRCSERV_OPER_PASSWORD
+    // IRCSERV_METRICS_PORT: Prometheus text on 127.0.0.1:<port>, 0 = off
+    size_t metricsPort;
+
+    // IRCSERV_LOG_LEVEL: error, warn, info (default), debug or raw (every line
+    // received); SIGUSR1 turns raw on and off at runtime
+    Logger::Level logLevel;
+
+    // Server links: servers connect into a spanning tree and share users and channels
+    std::string serverName;          // IRCSERV_SERVER_NAME, unique in the network (default "ircserv")
+    std::string linkPassword;        // IRCSERV_LINK_PASSWORD: both ends of a link; empty = no links
+    std::vector<std::string> links;  // IRCSERV_LINKS: "host:port,..." to connect to (and reconnect)
+    size_t linkSendq;                // IRCSERV_LINK_SENDQ: hard SendQ of a link, bytes
+
+    // Channel snapshots: topics and modes survive a restart (members don't)
+    std::string stateFile;   // IRCSERV_STATE_FILE: where, empty = none
+    size_t snapshotInterval; // IRCSERV_SNAPSHOT_INTERVAL: seconds between two
+
+    // Channel history: CHATHISTORY and the replay on JOIN
+    size_t historyLines;  // IRCSERV_HISTORY_LINES: per channel, 0 = no history
+    size_t historyBytes;  // IRCSERV_HISTORY_BYTES: per channel
+    size_t historyBudget; // IRCSERV_HISTORY_BUDGET: all channels together, bytes
+    size_t historyOnJoin; // IRCSERV_HISTORY_ON_JOIN: lines replayed to who joins, 0 = none
+
+    ServerConfig() : backend("epoll"), threads(1), sendqSoft(64 * 1024), sendqHard(1024 * 1024),
+                     pingInterval(120), pingTimeout(60), registerTimeout(60), idleTimeout(0),
+                     floodRate(10), floodBurst(20), linesPerTurn(64),
+                     operName("oper"), metricsPort(0), logLevel(Logger::INFO),
+                     serverName("ircserv"), linkSendq(16 * 1024 * 1024),
+                     snapshotInterval(60), historyLines(100), historyBytes(64 * 1024),
+                     historyBudget(64 * 1024 * 1024), historyOnJoin(0) {}
+
+    static ServerConfig fromEnv();
+};
+
+#endif
@@ -8,97 +8,341 @@ std::string Server::toUpper(std::string s) {
     return s;
 }
 
-// Build a user prefix like ":nick!user@localhost"
-// It’s mandated by the IRC protocol
-std::string Server::userPrefix(const Client& c) {
-    std::string u = c.user.empty() ? "user" : c.user;
-    return c.nick + "!" + u + "@localhost";
+// The user prefix "nick!user@localhost" (mandated by the IRC protocol),
+// cached on the client: most lines a client causes start with it
+const std::string& Server::userPrefix(const Client& c) {
+    return c.prefix;
+}
+
+// After NICK or USER changed what the prefix is made of
+void Server::refreshPrefix(Client& c) {
+    c.prefix = c.nick;
+    c.prefix += '!';
+    if (c.user.empty())
+        c.prefix += "user";
+    else
+        c.prefix += c.user;
+    c.prefix += "@localhost";
 }
 
 void Server::sendLine(int fd, const std::string& line) {
-    int idx = findPollIndexByFd(fd);
-    if (idx == -1)
-        return; // fd already gone
+    Reply r;
+    r << line; // cut to the line limit like any reply
+    sendReply(fd, r);
+}
+
+void Server::sendReply(int fd, Reply& r) {
+    sendPayload(fd, r.payload());
+}
+
+// ":<server> <code> <target> ", the start of a numeric reply
+Reply& Server::numeric(Reply& r, const char* code, const std::string& target) {
+    return r << _serverPrefix << code << ' ' << target << ' ';
+}
 
-    std::string out = line;
-    if (out.size() < 2 || out.substr(out.size() - 2) != "\r\n")
-        out += "\r\n";
+// ":<server> <code> <target> :<text>"
+void Server::sendNumeric(int fd, const char* code, const std::string& target, const char* text) {
+    Reply r;
+    numeric(r, code, target) << ':' << text;
+    sendReply(fd, r);
+}
 
-    _outbuf[fd] += out;
-    _pollFDs[idx].events |= POLLOUT;
+// ":<server> <code> <target> <arg> :<text>"
+void Server::sendNumeric(int fd, const char* code, const std::string& target,
+                         const std::string& arg, const char* text) {
+    Reply r;
+    numeric(r, code, target) << arg << " :" << text;
+    sendReply(fd, r);
 }
 
-void Server::disconnectClientByFd(int fd) {
-    for (size_t i = 1; i < _pollFDs.size(); i++) {
-        if (_pollFDs[i].fd == fd) {
-            disconnectClient(static_cast<int>(i));
+// Under the state lock: p goes into the batch for c's shard, delivered by
+// that shard once the lock is released (unlockState()), ours included, so
+// every client gets its lines in lock order.
+void Server::sendPayload(int fd, const Payload& p) {
+    Client* c = _clients.find(fd);
+    if (!c)
+        return; // fd already gone
+    if (c->link >= 0) {
+        c = _clients.find(c->link); // a remote user: its server gets it
+        if (!c)
             return;
-        }
     }
+    _current->outbound[c->shard].send(ClientTable::tokenOf(*c), p);
 }
 
-bool Server::isChannelOperator(const Channel& ch, int fd) const {
-    return ch.operators.find(fd) != ch.operators.end();
+// On c's own shard: queue p, enforcing the SendQ limits
+void Server::deliver(Shard& sh, Client& c, const Payload& p) {
+    Shard::add(sh.queuedBytes, static_cast<long>(enqueue(sh, c, p)));
 }
 
-void Server::broadcastToChannel(const Channel& ch, const std::string& line, int exceptFd) {
-    for (std::set<int>::iterator it = ch.members.begin(); it != ch.members.end(); ++it) {
-        int toFd = *it;
-        if (toFd == exceptFd) continue;
-        sendLine(toFd, line);
+// deliver() without the queuedBytes update, which a multicast makes once:
+// the bytes queued for c
+size_t Server::enqueue(Shard& sh, Client& c, const Payload& p) {
+    if (c.sendqExceeded)
+        return 0; // about to be disconnected
+
+    size_t queued = c.out.bytes();
+    size_t hard = c.isLink ? _config.linkSendq : _config.sendqHard;
+    if (queued + p.size() > hard) {
+        // disconnecting here could pull the client out of a roster a lock
+        // holder is iterating, so drop the queue now and disconnect at the flush
+        c.sendqExceeded = true;
+        if (!c.sending) { // otherwise the kernel is still reading it
+            Shard::add(sh.queuedBytes, -static_cast<long>(queued));
+            c.out.clear();
+        }
+        Shard::add(sh.sendqHardKills, 1);
+        if (!c.dirty) {
+            c.dirty = true;
+            sh.dirty.push_back(ClientTable::tokenOf(c));
+        }
+        return 0;
     }
+    if (queued < _config.sendqSoft && queued + p.size() >= _config.sendqSoft)
+        Shard::add(sh.sendqSoftHits, 1);
+
+    c.out.push(p);
+    markDirty(sh, c);
+    return p.size();
 }
 
-// DISPATCH MESSAGES
+// Queues c for the flush at the end of the loop iteration, so every line
+// produced while handling this batch of events goes out in one writev.
+// A client already waiting for POLLOUT is flushed by that event instead.
+void Server::markDirty(Shard& sh, Client& c) {
+    if (c.dirty || c.wantWrite)
+        return;
+    c.dirty = true;
+    sh.dirty.push_back(ClientTable::tokenOf(c));
+}
 
-void Server::onMessage(int pollInd, int fd, const ParsedMessage& msg) {
-    std::string cmd = toUpper(msg.command);
-    if (cmd == "PING") { 
-        handlePING(fd, msg); return;
-    }
-    if (cmd == "CAP") {
-        handleCAP(fd, msg); return;
+bool Server::isChannelOperator(const Channel& ch, int fd) const {
+    return ch.isOperator(fd);
+}
+
+// The line is formatted once, every member gets a reference to the same payload.
+// Our members only: the links are the caller's (relayToChannelLinks, propagate).
+// Under the lock the roster only yields tokens, one list per member shard;
+// each shard queues the line for its members after the unlock.
+void Server::broadcastToChannel(const Channel& ch, const Payload& p, int exceptFd) {
+    Shard& sh = *_current;
+    size_t recipients = 0;
+    for (std::vector<ChannelMember>::const_iterator it = ch.roster.begin(); it != ch.roster.end(); ++it) {
+        int toFd = it->fd;
+        if (!it->joined() || (it->flags & ChannelMember::REMOTE) || toFd == exceptFd) continue;
+        const Client& m = _clients.at(toFd);
+        sh.outbound[m.shard].recipients.push_back(ClientTable::tokenOf(m));
+        ++recipients;
     }
-    if (cmd == "PASS") {
-        handlePASS(fd, msg); return;
+    for (size_t i = 0; i < sh.outbound.size(); i++)
+        sh.outbound[i].multicast(p);
+    sh.metrics.fanout.record(recipients);
+}
+
+// Same, each member getting the variant its capabilities ask for (IRCv3
+// tags): one rendering per variant, not per member
+void Server::broadcastToChannel(const Channel& ch, TaggedLine& line, int exceptFd) {
+    Shard& sh = *_current;
+    size_t recipients = 0;
+    for (std::vector<ChannelMember>::const_iterator it = ch.roster.begin(); it != ch.roster.end(); ++it) {
+        int toFd = it->fd;
+        if (!it->joined() || (it->flags & ChannelMember::REMOTE) || toFd == exceptFd) continue;
+        const Client& m = _clients.at(toFd);
+        int v = line.variantFor(m.caps);
+        sh.byVariant[m.shard * TaggedLine::kVariants + v].push_back(ClientTable::tokenOf(m));
+        ++recipients;
     }
-    if (cmd == "NICK") {
-        handleNICK(fd, msg); return;
+    for (size_t i = 0; i < sh.outbound.size(); i++) {
+        DeliveryBatch& b = sh.outbound[i];
+        for (int v = 0; v < TaggedLine::kVariants; v++) {
+            std::vector<uint64_t>& tokens = sh.byVariant[i * TaggedLine::kVariants + v];
+            if (tokens.empty())
+                continue;
+            b.recipients.insert(b.recipients.end(), tokens.begin(), tokens.end());
+            b.multicast(line.variant(v));
+            tokens.clear();
+        }
     }
-    if (cmd == "USER") {
-        handleUSER(fd, msg); return;
+    sh.metrics.fanout.record(recipients);
+}
+
+// Sends p once to every member of the given channels, however many of them
+// a member is in (our members: remote ones are reached through the links).
+// Members are stamped with the call's epoch instead of being collected in a
+// set, so the cost is one pass over the members.
+void Server::fanOut(const std::set<std::string>& channels, const Payload& p, int exceptFd) {
+    if (++_fanoutEpoch == 0) {
+        // wrapped around: old stamps could collide with the new epochs
+        for (int i = 0; i < _clients.limit(); i++)
+            _clients.at(i).fanoutEpoch = 0;
+        _fanoutEpoch = 1;
     }
-    if (cmd == "QUIT") {
-        handleQUIT(pollInd); return;
+
+    Client* except = _clients.find(exceptFd);
+    if (except)
+        except->fanoutEpoch = _fanoutEpoch;
+
+    Shard& sh = *_current;
+    size_t recipients = 0;
+
+    for (std::set<std::string>::const_iterator nit = channels.begin(); nit != channels.end(); ++nit) {
+        std::map<std::string, Channel>::const_iterator chit = _channels.find(*nit);
+        if (chit == _channels.end())
+            continue;
+
+        const std::vector<ChannelMember>& roster = chit->second.roster;
+        for (std::vector<ChannelMember>::const_iterator it = roster.begin(); it != roster.end(); ++it) {
+            if (!it->joined() || (it->flags & ChannelMember::REMOTE))
+                continue;
+            Client& m = _clients.at(it->fd);
+            if (m.fanoutEpoch == _fanoutEpoch)
+                continue; // already reached through another channel
+            m.fanoutEpoch = _fanoutEpoch;
+            sh.outbound[m.shard].recipients.push_back(ClientTable::tokenOf(m));
+            ++recipients;
+        }
     }
+    for (size_t i = 0; i < sh.outbound.size(); i++)
+        sh.outbound[i].multicast(p);
+    sh.metrics.fanout.record(recipients);
+}
+
+// DISPATCH MESSAGES
 
-    if ((cmd == "JOIN" || cmd == "PRIVMSG" || cmd == "MODE" || cmd == "WHO" ) && !_clients[fd].registered) {
-        sendLine(fd, ":" + _serverName + " 451 * :You have not registered"); return;
+namespace {
+    inline unsigned char upperAscii(unsigned char c) {
+        return (c >= 'a' && c <= 'z') ? static_cast<unsigned char>(c - 'a' + 'A') : c;
     }
 
-    if (cmd == "JOIN") {
-        handleJOIN(fd, msg); return;
+    // FNV-1a over the upper-cased bytes: case-insensitive without a copy
+    unsigned int commandHash(const char* s, size_t len) {
+        unsigned int h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+            h ^= upperAscii(static_cast<unsigned char>(s[i]));
+            h *= 16777619u;
+        }
+        return h;
     }
-    if (cmd == "PRIVMSG") {
-        handlePRIVMSG(fd, msg); return;
+}
+
+// New commands are added here: name, handler, registration required, min/max params,
+// flood cost (the heavier ones walk channels or rosters)
+void Server::registerCommands() {
+    addCommand("PING",    &Server::handlePING,    false, 0, 1, 1);
+    addCommand("PONG",    &Server::handlePONG,    false, 0, 1, 1);
+    addCommand("CAP",     &Server::handleCAP,     false, 0, 2, 1);
+    addCommand("PASS",    &Server::handlePASS,    false, 0, 1, 1);
+    addCommand("NICK",    &Server::handleNICK,    false, 0, 1, 1);
+    addCommand("USER",    &Server::handleUSER,    false, 0, 4, 1);
+    addCommand("QUIT",    &Server::handleQUIT,    false, 0, 1, 1);
+    addCommand("JOIN",    &Server::handleJOIN,    true,  1, 2, 3);
+    addCommand("PRIVMSG", &Server::handlePRIVMSG, true,  1, 2, 1);
+    addCommand("MODE",    &Server::handleMODE,    true,  1, MessageView::MAX_PARAMS, 2);
+    addCommand("TOPIC",   &Server::handleTOPIC,   true,  1, 2, 1);
+    addCommand("INVITE",  &Server::handleINVITE,  true,  2, 2, 1);
+    addCommand("KICK",    &Server::handleKICK,    true,  2, 3, 1);
+    addCommand("STATS",   &Server::handleSTATS,   true,  0, 1, 1);
+    addCommand("WHO",     &Server::handleWHO,     true,  0, 1, 3);
+    addCommand("OPER",    &Server::handleOPER,    true,  2, 2, 1);
+    addCommand("SERVER",  &Server::handleSERVER,  false, 3, 3, 1);
+    addCommand("LINKS",   &Server::handleLINKS,   true,  0, 0, 1);
+    addCommand("CHATHISTORY", &Server::handleCHATHISTORY, true, 4, 5, 3);
+}
+
+void Server::addCommand(const char* name, CommandHandler handler,
+                        bool needsRegistration, size_t minParams, size_t maxParams,
+                        unsigned int cost) {
+    CommandEntry e;
+    e.name = name;
+    e.nameLen = std::strlen(name);
+    e.handler = handler;
+    e.needsRegistration = needsRegistration;
+    e.minParams = minParams;
+    e.maxParams = maxParams;
+    e.cost = cost;
+    e.hits = 0;
+    _commands.push_back(e);
+
+    // grow the slot array until every command lands in its own slot,
+    // so a lookup is one hash, one slot and one compare
+    size_t size = 16;
+    while (true) {
+        _commandSlots.assign(size, -1);
+        bool collision = false;
+        for (size_t i = 0; i < _commands.size() && !collision; i++) {
+            size_t slot = commandHash(_commands[i].name, _commands[i].nameLen) & (size - 1);
+            if (_commandSlots[slot] != -1)
+                collision = true;
+            else
+                _commandSlots[slot] = static_cast<int>(i);
+        }
+        if (!collision)
+            break;
+        size *= 2;
     }
-    if (cmd == "MODE") {
-        handleMODE(fd, msg); return;
+}
+
+CommandEntry* Server::findCommand(const char* name, size_t len) {
+    size_t slot = commandHash(name, len) & (_commandSlots.size() - 1);
+    int idx = _commandSlots[slot];
+    if (idx < 0)
+        return 0;
+
+    CommandEntry& e = _commands[idx];
+    if (e.nameLen != len)
+        return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (upperAscii(static_cast<unsigned char>(name[i])) != static_cast<unsigned char>(e.name[i]))
+            return 0;
     }
-    if (msg.command == "TOPIC") { 
-        handleTOPIC(fd, msg); return;
+    return &e;
+}
+
+void Server::onMessage(int fd, const MessageView& view) {
+    CommandEntry* cmd = findCommand(view.command.ptr, view.command.len);
+
+    // only the params the handler can use are copied, into reused storage
+    size_t maxParams = MessageView::MAX_PARAMS;
+    if (cmd)
+        maxParams = cmd->maxParams;
+    assignMessage(view, _msg, maxParams);
+    dispatch(fd, cmd, _msg);
+}
+
+void Server::onMessage(int fd, const ParsedMessage& msg) {
+    dispatch(fd, findCommand(msg.command.data(), msg.command.size()), msg);
+}
+
+void Server::dispatch(int fd, CommandEntry* cmd, const ParsedMessage& msg) {
+    Client* c = _clients.find(fd);
+    if (c) {
+        // flood control charges after the fact: processInput only runs a line while credit is left
+        c->floodTokens -= static_cast<long>(cmd ? cmd->cost : 1) * 1000;
+        // keepalive traffic doesn't count against the idle limit
+        if (cmd && cmd->handler != &Server::handlePING && cmd->handler != &Server::handlePONG)
+            c->lastCommand = _current->now;
     }
-    if (cmd == "INVITE") {
-        handleINVITE(fd, msg); return;
+
+    if (!cmd) {
+        ++_unknownCommands;
+        sendNumeric(fd, "421", nickOf(fd), msg.command, "Unknown command");
+        return;
     }
-    if (cmd == "KICK") {
-        handleKICK(fd, msg); return;
+    ++cmd->hits;
+
+    if (cmd->needsRegistration && (!c || !c->registered)) {
+        sendNumeric(fd, "451", "*", "You have not registered");
+        return;
     }
-    if (cmd == "WHO") {
-        handleWHO(fd, msg); return;
+
+    if (msg.params.size() < cmd->minParams) {
+        Reply r;
+        numeric(r, "461", nickOf(fd)) << cmd->name << " :Not enough parameters";
+        sendReply(fd, r);
+        return;
     }
 
-    Client& c = _clients[fd];
-    std::string target = (c.hasNick ? c.nick : "*");
-    sendLine(fd, ":" + _serverName + " 421 " + target + " " + msg.command + " :Unknown command");
-}
\ No newline at end of file
+    uint64_t started = Metrics::nowNs();
+    (this->*(cmd->handler))(fd, msg);
+    _current->metrics.handlerNs.record(Metrics::nowNs() - started);
+}
@@ -0,0 +1,151 @@
+///
+// IS part of Server.cpp file
+///
+
+#include "Server.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+// Channel history (IRCSERV_HISTORY_*). Every channel PRIVMSG, ours or from a
+// link, is recorded as the payload its members got; CHATHISTORY (IRCv3 draft)
+// plays it back to a member of the channel, and a JOIN can replay the last
+// IRCSERV_HISTORY_ON_JOIN lines. References are timestamps only, msgid= is
+// not supported: lines carry no ids. Lines are stored untagged, the batch
+// and server-time tags are added per request, queued in front of the stored
+// payload rather than copied into a new line with it.
+
+namespace {
+    const uint64_t kNoBound = ~static_cast<uint64_t>(0);
+
+    // "timestamp=YYYY-MM-DDThh:mm:ss.sssZ" (fraction optional) -> ms since the epoch
+    bool parseTimestamp(const std::string& ref, uint64_t& ms) {
+        static const char kPrefix[] = "timestamp=";
+        const size_t prefixLen = sizeof(kPrefix) - 1;
+        if (ref.compare(0, prefixLen, kPrefix) != 0)
+            return false;
+        struct tm tm;
+        std::memset(&tm, 0, sizeof(tm));
+        unsigned int frac = 0;
+        int used = 0;
+        const char* s = ref.c_str() + prefixLen;
+        if (std::sscanf(s, "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &used) != 6)
+            return false;
+        s += used;
+        if (*s == '.') {
+            int digits = 0;
+            for (++s; *s >= '0' && *s <= '9'; ++s, ++digits) {
+                if (digits < 3)
+                    frac = frac * 10 + (*s - '0');
+            }
+            for (; digits < 3; digits++)
+                frac *= 10;
+        }
+        if (std::strcmp(s, "Z") != 0 || tm.tm_year < 1970)
+            return false;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        time_t t = timegm(&tm);
+        if (t == static_cast<time_t>(-1))
+            return false;
+        ms = static_cast<uint64_t>(t) * 1000 + frac;
+        return true;
+    }
+}
+
+// The lines as stored. A client with batch gets them as one chathistory
+// batch, with server-time each one carries the time it was first sent; those
+// tags are the client's own, so only then is a line rendered again.
+void Server::sendHistory(int fd, const std::string& target, const std::vector<HistoryEntry>& lines) {
+    unsigned char caps = _clients.at(fd).caps;
+    bool batch = (caps & Client::CAP_BATCH) != 0;
+    bool time = (caps & Client::CAP_SERVER_TIME) != 0;
+    if (!batch && !time) {
+        for (size_t i = 0; i < lines.size(); i++)
+            sendPayload(fd, lines[i].line);
+        return;
+    }
+
+    char id[24];
+    std::snprintf(id, sizeof(id), "h%lu", ++_lastBatch);
+    if (batch) {
+        Reply r;
+        r << _serverPrefix << "BATCH +" << id << " chathistory " << target;
+        sendReply(fd, r);
+    }
+    std::string tags;
+    for (size_t i = 0; i < lines.size(); i++) {
+        tags = '@';
+        if (batch) {
+            tags += "batch=";
+            tags += id;
+        }
+        if (time) {
+            char stamp[25];
+            formatServerTime(lines[i].time, stamp);
+            tags += batch ? ";time=" : "time=";
+            tags += stamp;
+        }
+        tags += ' ';
+        // two entries of the client's queue, written by the same writev
+        sendPayload(fd, Payload::prefix(tags));
+        sendPayload(fd, lines[i].line);
+    }
+    if (batch) {
+        Reply r;
+        r << _serverPrefix << "BATCH -" << id;
+        sendReply(fd, r);
+    }
+}
+
+// CHATHISTORY LATEST <channel> <* | timestamp=...> <limit>
+// CHATHISTORY BEFORE | AFTER | AROUND <channel> <timestamp=...> <limit>
+// CHATHISTORY BETWEEN <channel> <timestamp=...> <timestamp=...> <limit>
+void Server::handleCHATHISTORY(int fd, const ParsedMessage& msg) {
+    std::string sub = toUpper(msg.params[0]);
+    const std::string& target = msg.params[1];
+    bool between = (sub == "BETWEEN");
+
+    size_t limit = 0;
+    uint64_t from = 0;
+    uint64_t to = 0;
+    bool latestAll = (sub == "LATEST" && msg.params[2] == "*");
+    bool known = between || sub == "LATEST" || sub == "BEFORE" || sub == "AFTER" || sub == "AROUND";
+    if (!known || msg.params.size() != (between ? 5u : 4u)
+            || !parsePositiveSizeT(msg.params.back(), limit) || limit == 0
+            || (!latestAll && !parseTimestamp(msg.params[2], from))
+            || (between && !parseTimestamp(msg.params[3], to))) {
+        Reply r;
+        r << _serverPrefix << "FAIL CHATHISTORY INVALID_PARAMS " << msg.params[0] << " :Invalid parameters";
+        sendReply(fd, r);
+        return;
+    }
+
+    std::map<std::string, Channel>::iterator chit = _channels.find(target);
+    if (chit == _channels.end() || !chit->second.isMember(fd)) {
+        Reply r;
+        r << _serverPrefix << "FAIL CHATHISTORY INVALID_TARGET " << sub << ' ' << target
+          << " :Messages could not be retrieved";
+        sendReply(fd, r);
+        return;
+    }
+
+    if (limit > _config.historyLines)
+        limit = _config.historyLines;
+    std::vector<HistoryEntry> lines;
+    if (latestAll)
+        _history.latest(target, limit, lines);
+    else if (sub == "LATEST")
+        _history.between(target, kNoBound, from, limit, lines); // the newest ones after it
+    else if (sub == "BEFORE")
+        _history.before(target, from, limit, lines);
+    else if (sub == "AFTER")
+        _history.after(target, from, limit, lines);
+    else if (sub == "AROUND")
+        _history.around(target, from, limit, lines);
+    else
+        _history.between(target, from, to, limit, lines);
+    sendHistory(fd, target, lines);
+}
@@ -0,0 +1,877 @@
+///
+// IS part of Server.cpp file
+///
+
+#include "Server.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <netdb.h>
+#include <set>
+
+// Server links: a TS6-like text protocol on RFC 2813 commands. Servers form
+// a spanning tree; a link is a connection record like a client's, whose
+// lines go to onLinkLine() instead of the command table.
+//
+//   SERVER <name> <password> :<info>                 handshake, both ways
+//   :<uplink> SERVER <name> <hops> :<info>           a server behind the sender
+//   :<server> NICK <nick> <ts> <user> :<realname>    a user of the network
+//   :<server> SJOIN <ts> <#chan> <+modes> [args] :<[@]nick ...>
+//   :<server> TB <#chan> <ts> :<topic>               a topic in a burst
+//   :<server> EOB                                    end of burst
+//   :<server> SQUIT <name> :<reason>                 a server and all behind it left
+//   :<server> KILL <nick> :<reason>
+// and the user lines clients see (PRIVMSG, NICK, QUIT, MODE, TOPIC, KICK,
+// INVITE). A line goes on to every other link, except channel messages: they
+// go to the links with members of the channel behind them, once per link.
+
+namespace {
+    const uint64_t kLinkRetryMs = 5000;
+    const char* const kServerInfo = "ft_irc server";
+
+    // "nick" of "nick!user@host"
+    std::string nickPart(const std::string& prefix) {
+        return prefix.substr(0, prefix.find('!'));
+    }
+
+    unsigned long toUnsigned(const std::string& s) {
+        return std::strtoul(s.c_str(), 0, 10);
+    }
+
+    bool nearer(const RemoteServer* a, const RemoteServer* b) {
+        return a->hops < b->hops;
+    }
+}
+
+void Server::registerLinkCommands() {
+    _linkCommands["PRIVMSG"] = &Server::linkPRIVMSG;
+    _linkCommands["SERVER"]  = &Server::linkSERVER;
+    _linkCommands["NICK"]    = &Server::linkNICK;
+    _linkCommands["QUIT"]    = &Server::linkQUIT;
+    _linkCommands["KILL"]    = &Server::linkKILL;
+    _linkCommands["SJOIN"]   = &Server::linkSJOIN;
+    _linkCommands["MODE"]    = &Server::linkMODE;
+    _linkCommands["TOPIC"]   = &Server::linkTOPIC;
+    _linkCommands["TB"]      = &Server::linkTB;
+    _linkCommands["KICK"]    = &Server::linkKICK;
+    _linkCommands["INVITE"]  = &Server::linkINVITE;
+    _linkCommands["SQUIT"]   = &Server::linkSQUIT;
+    _linkCommands["PING"]    = &Server::linkPING;
+    _linkCommands["EOB"]     = &Server::linkEOB;
+    _linkCommands["ERROR"]   = &Server::linkERROR;
+}
+
+// Resolves IRCSERV_LINKS once, at startup: shard 0 never waits on DNS later
+bool Server::setupLinks() {
+    for (size_t i = 0; i < _config.links.size(); i++) {
+        const std::string& text = _config.links[i];
+        size_t colon = text.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == text.size()) {
+            std::cerr << "IRCSERV_LINKS: expected host:port, got '" << text << "'\n";
+            return false;
+        }
+        std::string host = text.substr(0, colon);
+        std::string port = text.substr(colon + 1);
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = 0;
+        int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (err != 0) {
+            std::cerr << "IRCSERV_LINKS: " << text << ": " << gai_strerror(err) << "\n";
+            return false;
+        }
+        LinkTarget t;
+        t.text = text;
+        std::memcpy(&t.addr, res->ai_addr, sizeof(t.addr));
+        t.token = 0;
+        t.retryAt = 0;
+        freeaddrinfo(res);
+        _linkTargets.push_back(t);
+    }
+    return true;
+}
+
+// Shard 0, every loop iteration: connects the configured links that are
+// down, one attempt per kLinkRetryMs. Our SERVER line is queued at once;
+// until the peer answers with its own, the connection waits like an
+// unregistered client (and times out like one).
+void Server::connectLinks(Shard& sh) {
+    for (size_t i = 0; i < _linkTargets.size(); i++) {
+        LinkTarget& t = _linkTargets[i];
+        if (t.token && sh.serves(static_cast<int>(t.token & 0xffffffffu), t.token))
+            continue; // up, or on its way
+        t.token = 0;
+        if (sh.now < t.retryAt)
+            continue;
+        t.retryAt = sh.now + kLinkRetryMs;
+
+        Shard::add(sh.syscalls, 1);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            Logger::error("socket() failed", -1, errno);
+            continue;
+        }
+        if (!setNonBlocking(fd)) {
+            close(fd);
+            continue;
+        }
+        Shard::add(sh.syscalls, 1);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&t.addr), sizeof(t.addr)) < 0 && errno != EINPROGRESS) {
+            Logger::log(Logger::WARN, "link connect failed", fd, errno, "target", t.text.data(), t.text.size());
+            close(fd);
+            continue;
+        }
+        // like an accepted socket: blocking for a completion backend
+        if (sh.poller->completesIo())
+            fcntl(fd, F_SETFL, 0);
+        if (!adoptClient(sh, fd))
+            continue;
+
+        lockState(sh);
+        Client& c = _clients.at(fd);
+        c.isLink = true;
+        t.token = ClientTable::tokenOf(c);
+        Reply r;
+        r << "SERVER " << _serverName << ' ' << _config.linkPassword << " :" << kServerInfo;
+        sendReply(fd, r);
+        unlockState();
+        Logger::log(Logger::INFO, "link connecting", fd, 0, "target", t.text.data(), t.text.size());
+    }
+}
+
+// SERVER <name> <password> :<info>, from a server connecting to us: the
+// connection becomes a link, the peer gets our SERVER line and the burst
+void Server::handleSERVER(int fd, const ParsedMessage& msg) {
+    Client& c = _clients.at(fd);
+    if (c.registered || c.hasNick || c.hasUser) {
+        sendNumeric(fd, "462", nickOf(fd), "You may not reregister");
+        return;
+    }
+    if (!acceptLink(fd, msg))
+        return;
+
+    Reply r;
+    r << "SERVER " << _serverName << ' ' << _config.linkPassword << " :" << kServerInfo;
+    sendReply(fd, r);
+    establishLink(fd, msg.params[0], msg.params[2]);
+}
+
+// LINKS: us, then every server of the network
+void Server::handleLINKS(int fd, const ParsedMessage&) {
+    Client& c = _clients.at(fd);
+    Reply me;
+    numeric(me, "364", c.nick) << _serverName << ' ' << _serverName << " :0 " << kServerInfo;
+    sendReply(fd, me);
+    for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); ++it) {
+        const RemoteServer& s = it->second;
+        Reply r;
+        numeric(r, "364", c.nick) << s.name << ' ' << s.uplink << " :" << s.hops << ' ' << s.info;
+        sendReply(fd, r);
+    }
+    sendNumeric(fd, "365", c.nick, "*", "End of /LINKS list.");
+}
+
+// Checks a SERVER handshake. A refused peer gets ERROR and is closed.
+bool Server::acceptLink(int fd, const ParsedMessage& msg) {
+    const char* why = 0;
+    if (msg.params.size() < 3)
+        why = "Not enough parameters";
+    else if (_config.linkPassword.empty() || msg.params[1] != _config.linkPassword)
+        why = "Bad link password";
+    else if (msg.params[0].find_first_of("!@#*,") != std::string::npos)
+        why = "Bad server name";
+    else if (msg.params[0] == _serverName || _servers.count(msg.params[0]))
+        why = "Server exists";
+    if (!why)
+        return true;
+
+    Logger::log(Logger::WARN, "link refused", fd, 0, "reason", why, std::strlen(why));
+    Reply r;
+    r << "ERROR :Closing link: " << why;
+    sendReply(fd, r);
+    requestClose(fd);
+    return false;
+}
+
+void Server::establishLink(int fd, const std::string& name, const std::string& info) {
+    Client& c = _clients.at(fd);
+    c.isLink = true;
+    c.server = name;
+    c.registered = true;
+    // the handshake deadline gives way to the keepalive one
+    _current->timers.schedule(c.timer, _current->now);
+
+    RemoteServer s;
+    s.name = name;
+    s.uplink = _serverName;
+    s.info = info;
+    s.link = fd;
+    s.hops = 1;
+
+    // the rest of the network learns about it, then it learns about the network
+    Reply intro;
+    intro << _serverPrefix << "SERVER " << name << " 2 :" << info;
+    propagate(intro.payload(), -1);
+    _servers[name] = s;
+    _links.push_back(fd);
+    sendBurst(fd);
+    Logger::log(Logger::INFO, "link established", fd, 0, "server", name.data(), name.size());
+}
+
+// What the new link's side has to learn about ours: servers (nearest first,
+// so an uplink is known before what it introduces), users, then channels
+// with their members, modes and topics
+void Server::sendBurst(int link) {
+    std::vector<const RemoteServer*> servers;
+    for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); ++it) {
+        if (it->second.link != link)
+            servers.push_back(&it->second);
+    }
+    std::stable_sort(servers.begin(), servers.end(), nearer);
+    for (size_t i = 0; i < servers.size(); i++) {
+        Reply r;
+        r << ':' << servers[i]->uplink << " SERVER " << servers[i]->name << ' '
+          << (servers[i]->hops + 1) << " :" << servers[i]->info;
+        sendReply(link, r);
+    }
+
+    for (std::map<std::string, int>::iterator it = _nickToFd.begin(); it != _nickToFd.end(); ++it) {
+        const Client& u = _clients.at(it->second);
+        if (!u.registered || u.link == link)
+            continue;
+        Reply r;
+        sendReply(link, userIntro(r, u));
+    }
+
+    for (std::map<std::string, Channel>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        const Channel& ch = it->second;
+        Reply r;
+        r << _serverPrefix << "SJOIN " << ch.ts << ' ' << ch.name << ' ';
+        channelModes(r, ch) << " :";
+
+        // as many lines as the member list takes, like NAMES
+        size_t head = r.size();
+        bool sent = false;
+        for (std::vector<ChannelMember>::const_iterator mit = ch.roster.begin(); mit != ch.roster.end(); ++mit) {
+            if (!mit->joined())
+                continue;
+            const Client& m = _clients.at(mit->fd);
+            if (m.link == link)
+                continue; // the other side has them
+            bool op = (mit->flags & ChannelMember::OP) != 0;
+            size_t need = (r.size() > head ? 1 : 0) + (op ? 1 : 0) + m.nick.size();
+            if (r.size() > head && need > r.room()) {
+                sendReply(link, r);
+                r.rewind(head);
+            }
+            if (r.size() > head)
+                r << ' ';
+            if (op)
+                r << '@';
+            r << m.nick;
+            sent = true;
+        }
+        if (!sent)
+            continue;
+        if (r.size() > head)
+            sendReply(link, r);
+
+        if (!ch.topic.empty()) {
+            Reply t;
+            t << _serverPrefix << "TB " << ch.name << ' ' << ch.topicTs << " :" << ch.topic;
+            sendReply(link, t);
+        }
+    }
+
+    Reply eob;
+    eob << _serverPrefix << "EOB";
+    sendReply(link, eob);
+}
+
+// A line from a linked server (or, before the handshake is done, from the
+// server we connected to)
+void Server::onLinkLine(int fd, const char* line, size_t len) {
+    MessageView view;
+    if (!parseLineView(line, len, view) || view.command.empty())
+        return; // servers never send more than 15 params
+    assignMessage(view, _msg, MessageView::MAX_PARAMS);
+    const ParsedMessage& msg = _msg;
+
+    if (_clients.at(fd).server.empty()) {
+        // we sent SERVER: the answer has to be the peer's
+        if (msg.command == "SERVER") {
+            if (acceptLink(fd, msg))
+                establishLink(fd, msg.params[0], msg.params[2]);
+        } else if (msg.command == "ERROR")
+            linkERROR(fd, msg, Payload());
+        return;
+    }
+
+    std::map<std::string, LinkHandler>::iterator it = _linkCommands.find(msg.command);
+    if (it == _linkCommands.end())
+        return; // PONG (receiving it is what counts), or newer than us
+    (this->*(it->second))(fd, msg, Payload(line, len));
+}
+
+// p to every linked server but the one it came from
+void Server::propagate(const Payload& p, int exceptLink) {
+    for (size_t i = 0; i < _links.size(); i++) {
+        if (_links[i] != exceptLink)
+            sendPayload(_links[i], p);
+    }
+}
+
+// p to the links that have members of ch behind them, once each
+void Server::relayToChannelLinks(const Channel& ch, const Payload& p, int exceptLink) {
+    for (size_t i = 0; i < ch.links.size(); i++) {
+        if (ch.links[i].fd != exceptLink)
+            sendPayload(ch.links[i].fd, p);
+    }
+}
+
+// ":<server> NICK <nick> <ts> <user> :<realname>", u introduced to a link
+Reply& Server::userIntro(Reply& r, const Client& u) {
+    r << ':' << (u.link >= 0 ? u.server : _serverName) << " NICK " << u.nick << ' ' << u.nickTs << ' ';
+    if (u.user.empty())
+        r << "user";
+    else
+        r << u.user;
+    r << " :" << u.realname;
+    return r;
+}
+
+// The remote user a line from link is about ("nick" or "nick!user@host"),
+// -1 if unknown or not on that link's side: a stale line that crossed a
+// QUIT or a KILL on the way
+int Server::linkUser(int link, const std::string& prefix) const {
+    std::map<std::string, int>::const_iterator it = _nickToFd.find(nickPart(prefix));
+    if (it == _nickToFd.end())
+        return -1;
+    const Client* u = _clients.find(it->second);
+    return u && u->link == link ? it->second : -1;
+}
+
+// The source of a line from link is on that link's side: one of the
+// servers behind it, or one of their users
+bool Server::fromLinkSide(int link, const std::string& prefix) const {
+    std::map<std::string, RemoteServer>::const_iterator it = _servers.find(prefix);
+    if (it != _servers.end())
+        return it->second.link == link;
+    return linkUser(link, prefix) != -1;
+}
+
+// Takes a user off the network: ours is disconnected (its QUIT goes to every
+// link), a remote one is killed toward its server and quits everywhere else
+void Server::killUser(int id, const std::string& reason) {
+    Client& u = _clients.at(id);
+    if (u.link < 0) {
+        killLocalUser(id, reason);
+        return;
+    }
+    Reply kill;
+    kill << _serverPrefix << "KILL " << u.nick << " :" << reason;
+    sendReply(u.link, kill);
+
+    Reply quit;
+    quit << ':' << u.prefix << " QUIT :Killed (" << reason << ")";
+    Payload quitLine = quit.payload();
+    propagate(quitLine, u.link);
+    removeRemoteUser(id, quitLine, true);
+}
+
+// A remote user leaves: our members of its channels see quit. reop: the
+// channels it leaves without an operator get one (on one server only, the
+// one that decided the user is gone, so the network agrees on the pick).
+void Server::removeRemoteUser(int id, const Payload& quit, bool reop) {
+    Client& u = _clients.at(id);
+    fanOut(u.channels, quit, -1);
+
+    for (std::set<std::string>::iterator nit = u.channels.begin(); nit != u.channels.end(); ++nit) {
+        std::map<std::string, Channel>::iterator itc = _channels.find(*nit);
+        if (itc == _channels.end())
+            continue;
+        Channel& ch = itc->second;
+        ch.removeLinkMember(u.link);
+        ch.removeClient(id);
+        if (ch.empty())
+            destroyChannel(itc);
+        else if (reop)
+            ensureChannelHasOperator(ch);
+    }
+    u.channels.clear();
+    _nickToFd.erase(u.nick);
+    _clients.release(id);
+}
+
+// name and every server it introduced leave the network, with their users
+void Server::removeServer(const std::string& name, const std::string& reason, bool reop) {
+    std::set<std::string> gone;
+    gone.insert(name);
+    for (bool grew = true; grew; ) {
+        grew = false;
+        for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); ++it) {
+            if (!gone.count(it->first) && gone.count(it->second.uplink)) {
+                gone.insert(it->first);
+                grew = true;
+            }
+        }
+    }
+
+    for (int id = ClientTable::REMOTE_BASE; id < _clients.remoteLimit(); id++) {
+        Client* u = _clients.find(id);
+        if (!u || !gone.count(u->server))
+            continue;
+        Reply quit;
+        quit << ':' << u->prefix << " QUIT :" << reason;
+        removeRemoteUser(id, quit.payload(), reop);
+    }
+    for (std::set<std::string>::iterator it = gone.begin(); it != gone.end(); ++it)
+        _servers.erase(*it);
+}
+
+// From disconnectClient(): the link fd is closing. The servers behind it
+// leave; the rest of the network hears it as one SQUIT. Channels that lost
+// their operators get new ones here, the side that saw the split happen.
+void Server::splitLink(int fd) {
+    std::vector<int>::iterator it = std::find(_links.begin(), _links.end(), fd);
+    if (it == _links.end())
+        return; // the handshake never completed
+    _links.erase(it);
+
+    std::string peer = _clients.at(fd).server;
+    Reply squit;
+    squit << _serverPrefix << "SQUIT " << peer << " :Connection closed";
+    propagate(squit.payload(), -1);
+    // the netsplit quit message: the two servers that lost each other
+    removeServer(peer, _serverName + " " + peer, true);
+    Logger::log(Logger::INFO, "link closed", fd, 0, "server", peer.data(), peer.size());
+}
+
+// "+itkl <key> <limit>", the modes ch has, as SJOIN carries them
+Reply& Server::channelModes(Reply& r, const Channel& ch) {
+    r << '+';
+    if (ch.inviteOnly)
+        r << 'i';
+    if (ch.topicOpsOnly)
+        r << 't';
+    if (ch.hasKey)
+        r << 'k';
+    if (ch.hasLimit)
+        r << 'l';
+    if (ch.hasKey)
+        r << ' ' << ch.key;
+    if (ch.hasLimit)
+        r << ' ' << static_cast<unsigned long>(ch.userLimit);
+    return r;
+}
+
+// Our copy of ch is younger than a linked server's: its modes and operators go
+void Server::loseChannelTs(Channel& ch) {
+    Reply modes;
+    modes << _serverPrefix << "MODE " << ch.name << " -";
+    size_t head = modes.size();
+    if (ch.inviteOnly)
+        modes << 'i';
+    if (ch.topicOpsOnly)
+        modes << 't';
+    if (ch.hasKey)
+        modes << 'k';
+    if (ch.hasLimit)
+        modes << 'l';
+    if (modes.size() > head)
+        broadcastToChannel(ch, modes.payload(), -1);
+    ch.inviteOnly = false;
+    ch.topicOpsOnly = false;
+    ch.hasKey = false;
+    ch.key.clear();
+    ch.hasLimit = false;
+    ch.userLimit = 0;
+
+    std::vector<int> ops;
+    for (std::vector<ChannelMember>::const_iterator it = ch.roster.begin(); it != ch.roster.end(); ++it) {
+        if (it->joined() && (it->flags & ChannelMember::OP))
+            ops.push_back(it->fd);
+    }
+    for (size_t i = 0; i < ops.size(); i++) {
+        ch.setOperator(ops[i], false);
+        Reply deop;
+        deop << _serverPrefix << "MODE " << ch.name << " -o " << nickOf(ops[i]);
+        broadcastToChannel(ch, deop.payload(), -1);
+    }
+}
+
+// LINK COMMANDS
+
+// :<uplink> SERVER <name> <hops> :<info>, a server further down the link
+void Server::linkSERVER(int link, const ParsedMessage& msg, const Payload&) {
+    if (msg.params.size() < 3)
+        return;
+    const std::string& name = msg.params[0];
+    if (name == _serverName || _servers.count(name)) {
+        // a second path to a server we know: the tree would become a loop
+        Logger::log(Logger::WARN, "link loop, closing", link, 0, "server", name.data(), name.size());
+        Reply r;
+        r << "ERROR :Server " << name << " already exists";
+        sendReply(link, r);
+        requestClose(link);
+        return;
+    }
+    if (!fromLinkSide(link, msg.prefix))
+        return;
+
+    RemoteServer s;
+    s.name = name;
+    s.uplink = msg.prefix;
+    s.info = msg.params[2];
+    s.link = link;
+    s.hops = toUnsigned(msg.params[1]);
+    _servers[name] = s;
+
+    Reply r;
+    r << ':' << s.uplink << " SERVER " << name << ' ' << (s.hops + 1) << " :" << s.info;
+    propagate(r.payload(), link);
+}
+
+// :<server> NICK <nick> <ts> <user> :<realname>, a new user of the network;
+// :<nick> NICK <new>, a nick change
+void Server::linkNICK(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() >= 4) {
+        if (!fromLinkSide(link, msg.prefix))
+            return;
+        const std::string& nick = msg.params[0];
+        unsigned long ts = toUnsigned(msg.params[1]);
+
+        std::map<std::string, int>::iterator it = _nickToFd.find(nick);
+        if (it != _nickToFd.end()) {
+            // collision: the older nick stays, on a tie neither does
+            unsigned long ours = _clients.at(it->second).nickTs;
+            if (ours <= ts) {
+                Reply kill;
+                kill << _serverPrefix << "KILL " << nick << " :Nick collision";
+                sendReply(link, kill);
+            }
+            if (ours < ts)
+                return;
+            killUser(it->second, "Nick collision");
+            if (ours == ts)
+                return;
+        }
+
+        Client& u = _clients.openRemote();
+        u.link = link;
+        u.server = msg.prefix;
+        u.nick = nick;
+        u.hasNick = true;
+        u.nickTs = ts;
+        u.user = msg.params[2];
+        u.hasUser = true;
+        u.realname = msg.params[3];
+        u.passOk = true;
+        u.registered = true;
+        refreshPrefix(u);
+        _nickToFd[nick] = u.fd;
+        propagate(line, link);
+        return;
+    }
+
+    if (msg.params.empty())
+        return;
+    int id = linkUser(link, msg.prefix);
+    if (id == -1)
+        return;
+    Client& u = _clients.at(id);
+    const std::string& newNick = msg.params[0];
+
+    std::map<std::string, int>::iterator it = _nickToFd.find(newNick);
+    if (it != _nickToFd.end() && it->second != id) {
+        // taken here meanwhile: both go. Our side only knows the old nick.
+        Reply kill;
+        kill << _serverPrefix << "KILL " << newNick << " :Nick collision";
+        sendReply(link, kill);
+        killUser(it->second, "Nick collision");
+
+        Reply quit;
+        quit << ':' << u.prefix << " QUIT :Killed (Nick collision)";
+        Payload quitLine = quit.payload();
+        propagate(quitLine, link);
+        removeRemoteUser(id, quitLine, true);
+        return;
+    }
+
+    fanOut(u.channels, line, -1);
+    _nickToFd.erase(u.nick);
+    u.nick = newNick;
+    _nickToFd[newNick] = id;
+    refreshPrefix(u);
+    propagate(line, link);
+}
+
+// :<nick> QUIT :<reason>
+void Server::linkQUIT(int link, const ParsedMessage& msg, const Payload& line) {
+    int id = linkUser(link, msg.prefix);
+    if (id == -1)
+        return;
+    propagate(line, link);
+    removeRemoteUser(id, line, false);
+}
+
+// :<source> KILL <nick> :<reason>; a remote target's server is told, its QUIT follows
+void Server::linkKILL(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.empty())
+        return;
+    int id = findFdByNick(msg.params[0]);
+    if (id == -1)
+        return;
+    Client& u = _clients.at(id);
+    if (u.link == link)
+        return; // on the sender's side: crossed with its own QUIT
+    if (u.link >= 0) {
+        sendPayload(u.link, line);
+        return;
+    }
+    killLocalUser(id, msg.params.size() > 1 ? msg.params[1] : "Killed");
+}
+
+// A kill arrives on the link's shard, our user may belong to another one:
+// it leaves the network now (its nick can be taken right after), and its
+// shard closes the socket once the ERROR is written
+void Server::killLocalUser(int fd, const std::string& reason) {
+    Client& u = _clients.at(fd);
+    Reply error;
+    error << "ERROR :Closing link: " << u.nick << " (Killed (" << reason << "))";
+    Payload errorLine = error.payload();
+    leaveNetwork(u, "Killed (" + reason + ")");
+    _current->outbound[u.shard].send(ClientTable::tokenOf(u), errorLine, true);
+}
+
+// :<server> SJOIN <ts> <#chan> <+modes> [args] :<[@]nick ...>
+// The channel timestamps decide whose modes and operators stand: the older
+// channel's. Ours is younger: ours go and theirs are taken. Same age: both
+// are kept. Theirs is younger: their members join, without them.
+void Server::linkSJOIN(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 4 || !fromLinkSide(link, msg.prefix))
+        return;
+    unsigned long ts = toUnsigned(msg.params[0]);
+    const std::string& name = msg.params[1];
+    if (name.size() < 2 || name[0] != '#')
+        return;
+
+    bool isNew = (_channels.find(name) == _channels.end());
+    Channel& ch = _channels[name];
+    ch.name = name;
+    if (isNew)
+        ch.ts = ts;
+    else if (ts < ch.ts) {
+        loseChannelTs(ch);
+        ch.ts = ts;
+    }
+    bool theirs = (ts == ch.ts);
+
+    if (theirs && msg.params[2].size() > 1) {
+        ParsedMessage change;
+        change.params.push_back(name);
+        for (size_t i = 2; i + 1 < msg.params.size(); i++)
+            change.params.push_back(msg.params[i]);
+        ModeResult r = applyChannelModeChanges(-1, ch, change);
+        if (r.anyChange) {
+            Reply mode;
+            mode << ':' << msg.prefix << " MODE " << name << ' ' << r.appliedModes;
+            for (size_t i = 0; i < r.modeParams.size(); i++)
+                mode << ' ' << r.modeParams[i];
+            broadcastToChannel(ch, mode.payload(), -1);
+        }
+    }
+
+    const std::string& members = msg.params.back();
+    size_t pos = 0;
+    while (pos < members.size()) {
+        size_t end = members.find(' ', pos);
+        if (end == std::string::npos)
+            end = members.size();
+        bool op = members[pos] == '@';
+        int id = linkUser(link, members.substr(op ? pos + 1 : pos, end - pos - (op ? 1 : 0)));
+        pos = end + 1;
+        if (id == -1)
+            continue;
+
+        Client& u = _clients.at(id);
+        if (ch.addRemoteMember(id, link)) {
+            u.channels.insert(name);
+            Reply join;
+            join << ':' << u.prefix << " JOIN " << name;
+            broadcastToChannel(ch, join.payload(), -1);
+        }
+        if (op && theirs && ch.setOperator(id, true)) {
+            Reply mode;
+            mode << ':' << msg.prefix << " MODE " << name << " +o " << u.nick;
+            broadcastToChannel(ch, mode.payload(), -1);
+        }
+    }
+
+    if (ch.empty()) {
+        destroyChannel(_channels.find(name));
+        return;
+    }
+    propagate(line, link);
+}
+
+// :<source> MODE <#chan> <modes> [args], with the key: our members see it
+// the way local changes are shown
+void Server::linkMODE(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 2 || !fromLinkSide(link, msg.prefix))
+        return;
+    std::map<std::string, Channel>::iterator it = _channels.find(msg.params[0]);
+    if (it == _channels.end())
+        return;
+    Channel& ch = it->second;
+
+    ModeResult r = applyChannelModeChanges(-1, ch, msg);
+    if (r.anyChange) {
+        Reply mode;
+        mode << ':' << msg.prefix << " MODE " << ch.name << ' ' << r.appliedModes;
+        for (size_t i = 0; i < r.modeParams.size(); i++)
+            mode << ' ' << r.modeParams[i];
+        broadcastToChannel(ch, mode.payload(), -1);
+    }
+    propagate(line, link);
+}
+
+// :<nick> TOPIC <#chan> :<topic>
+void Server::linkTOPIC(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 2 || !fromLinkSide(link, msg.prefix))
+        return;
+    std::map<std::string, Channel>::iterator it = _channels.find(msg.params[0]);
+    if (it == _channels.end())
+        return;
+    Channel& ch = it->second;
+    ch.topic = msg.params[1];
+    ch.topicTs = static_cast<unsigned long>(std::time(0));
+    broadcastToChannel(ch, line, -1);
+    propagate(line, link);
+}
+
+// :<server> TB <#chan> <ts> :<topic>, a topic in a burst. The older topic
+// wins; on a tie the smaller text does, so both sides pick the same one.
+void Server::linkTB(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 3 || !fromLinkSide(link, msg.prefix))
+        return;
+    std::map<std::string, Channel>::iterator it = _channels.find(msg.params[0]);
+    if (it == _channels.end())
+        return;
+    Channel& ch = it->second;
+    unsigned long ts = toUnsigned(msg.params[1]);
+    const std::string& topic = msg.params[2];
+    if (!ch.topic.empty() && (ts > ch.topicTs || (ts == ch.topicTs && topic >= ch.topic)))
+        return;
+
+    ch.topic = topic;
+    ch.topicTs = ts;
+    Reply r;
+    r << ':' << msg.prefix << " TOPIC " << ch.name << " :" << topic;
+    broadcastToChannel(ch, r.payload(), -1);
+    propagate(line, link);
+}
+
+// :<nick> KICK <#chan> <nick> :<reason>; the kicker's server replaces a lost operator
+void Server::linkKICK(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 2 || !fromLinkSide(link, msg.prefix))
+        return;
+    std::map<std::string, Channel>::iterator chit = _channels.find(msg.params[0]);
+    if (chit == _channels.end())
+        return;
+    Channel& ch = chit->second;
+    int id = findFdByNick(msg.params[1]);
+    if (id == -1 || !ch.isMember(id))
+        return;
+
+    broadcastToChannel(ch, line, -1); // our target too
+    propagate(line, link);
+
+    Client& target = _clients.at(id);
+    if (target.link >= 0)
+        ch.removeLinkMember(target.link);
+    ch.removeClient(id);
+    target.channels.erase(ch.name);
+    target.invitedTo.erase(ch.name);
+    if (ch.empty())
+        destroyChannel(chit);
+}
+
+// :<nick> INVITE <nick> <#chan>: stored where the target is, like a local invite
+void Server::linkINVITE(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 2 || linkUser(link, msg.prefix) == -1)
+        return;
+    int id = findFdByNick(msg.params[0]);
+    if (id == -1)
+        return;
+    Client& target = _clients.at(id);
+    if (target.link == link)
+        return;
+    if (target.link < 0) {
+        std::map<std::string, Channel>::iterator it = _channels.find(msg.params[1]);
+        if (it != _channels.end()) {
+            it->second.setInvited(id, true);
+            target.invitedTo.insert(msg.params[1]);
+        }
+    }
+    sendPayload(id, line); // ours, or on toward its server
+}
+
+// :<nick> PRIVMSG <target> :<text>
+void Server::linkPRIVMSG(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.size() < 2 || linkUser(link, msg.prefix) == -1)
+        return;
+    const std::string& target = msg.params[0];
+
+    if (!target.empty() && target[0] == '#') {
+        std::map<std::string, Channel>::iterator it = _channels.find(target);
+        if (it == _channels.end())
+            return;
+        TaggedLine tagged(line, MessageHistory::nowMs());
+        broadcastToChannel(it->second, tagged, -1);
+        relayToChannelLinks(it->second, line, link);
+        _history.record(it->first, line, tagged.time());
+        return;
+    }
+
+    int id = findFdByNick(target);
+    if (id == -1 || _clients.at(id).link == link)
+        return;
+    TaggedLine tagged(line, MessageHistory::nowMs());
+    sendPayload(id, tagged.forCaps(_clients.at(id).caps));
+}
+
+// :<server> SQUIT <name> :<reason>; the split happened elsewhere, that side
+// replaces the operators
+void Server::linkSQUIT(int link, const ParsedMessage& msg, const Payload& line) {
+    if (msg.params.empty())
+        return;
+    std::map<std::string, RemoteServer>::iterator it = _servers.find(msg.params[0]);
+    if (it == _servers.end() || it->second.link != link)
+        return;
+    std::string name = it->first;
+    std::string reason = it->second.uplink + " " + name;
+    propagate(line, link);
+    removeServer(name, reason, false);
+}
+
+void Server::linkPING(int link, const ParsedMessage& msg, const Payload&) {
+    Reply r;
+    r << _serverPrefix << "PONG " << _serverName;
+    if (!msg.params.empty())
+        r << " :" << msg.params[0];
+    sendReply(link, r);
+}
+
+void Server::linkEOB(int link, const ParsedMessage&, const Payload&) {
+    const std::string& peer = _clients.at(link).server;
+    Logger::log(Logger::INFO, "link burst received", link, 0, "server", peer.data(), peer.size());
+}
+
+void Server::linkERROR(int link, const ParsedMessage& msg, const Payload&) {
+    const std::string text = msg.params.empty() ? std::string() : msg.params[0];
+    Logger::log(Logger::WARN, "link error", link, 0, "text", text.data(), text.size());
+}
@@ -0,0 +1,295 @@
+#include "Server.hpp"
+#include <sstream>
+#include <iomanip>
+
+// STATS m / metrics endpoint: every shard's Metrics added up on read
+
+namespace {
+    const size_t kMaxScrapes = 16;    // metrics connections open at once
+    const size_t kMaxRequest = 8192;  // bytes of one HTTP request
+
+    struct Totals {
+        unsigned long connections;
+        unsigned long registrations;
+        unsigned long bytesIn;
+        unsigned long bytesOut;
+        unsigned long linesIn;
+        unsigned long linesOut;
+        unsigned long syscalls;
+        unsigned long backlog;
+        unsigned long queued;
+        unsigned long paused;
+        unsigned long throttled;
+        unsigned long throttles;
+        unsigned long floodKills;
+        unsigned long sendqKills;
+        Histogram::Summary handlerNs;
+        Histogram::Summary loopNs;
+        Histogram::Summary fanout;
+
+        Totals() : connections(0), registrations(0), bytesIn(0), bytesOut(0), linesIn(0), linesOut(0),
+                   syscalls(0), backlog(0), queued(0), paused(0), throttled(0), throttles(0),
+                   floodKills(0), sendqKills(0) {}
+    };
+
+    void gather(const std::vector<Shard*>& shards, Totals& t) {
+        for (size_t i = 0; i < shards.size(); i++) {
+            Shard& sh = *shards[i];
+            const Metrics& m = sh.metrics;
+            t.connections += Metrics::read(m.connections);
+            t.registrations += Metrics::read(m.registrations);
+            t.bytesIn += Metrics::read(m.bytesIn);
+            t.bytesOut += Metrics::read(m.bytesOut);
+            t.backlog += Metrics::read(m.backlogClients);
+            m.handlerNs.addTo(t.handlerNs);
+            m.loopNs.addTo(t.loopNs);
+            m.fanout.addTo(t.fanout);
+
+            t.linesIn += Shard::load(sh.linesIn);
+            t.linesOut += Shard::load(sh.linesOut);
+            t.syscalls += Shard::load(sh.syscalls) + sh.poller->syscalls();
+            t.queued += Shard::load(sh.queuedBytes);
+            t.paused += Shard::load(sh.pausedClients);
+            t.throttled += Shard::load(sh.throttledClients);
+            t.throttles += Shard::load(sh.floodThrottles);
+            t.floodKills += Shard::load(sh.excessFloodKills);
+            t.sendqKills += Shard::load(sh.sendqHardKills);
+        }
+    }
+
+    // "p50 1.2 us, p99 ..." of a nanosecond histogram
+    std::string latencies(const Histogram::Summary& s) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1)
+            << "p50 " << s.percentile(0.50) / 1000.0 << " us, p99 " << s.percentile(0.99) / 1000.0
+            << " us, p999 " << s.percentile(0.999) / 1000.0 << " us";
+        return out.str();
+    }
+
+    void header(std::ostream& out, const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    }
+
+    void metric(std::ostream& out, const char* name, const char* type, const char* help, unsigned long value) {
+        header(out, name, type, help);
+        out << name << ' ' << value << '\n';
+    }
+
+    // Coarse buckets out of the fine ones: le = 2^bits - 1 (exact bucket
+    // edges) for bits from..to, values divided by scale (1e9: ns -> seconds)
+    void histogram(std::ostream& out, const char* name, const char* help, const Histogram::Summary& s,
+                   unsigned from, unsigned to, unsigned step, double scale) {
+        header(out, name, "histogram", help);
+        for (unsigned bits = from; bits <= to; bits += step) {
+            double le = static_cast<double>((static_cast<uint64_t>(1) << bits) - 1) / scale;
+            out << name << "_bucket{le=\"" << le << "\"} " << s.countBelowPow2(bits) << '\n';
+        }
+        out << name << "_bucket{le=\"+Inf\"} " << s.count << '\n';
+        out << name << "_sum " << s.sum / scale << '\n';
+        out << name << "_count " << s.count << '\n';
+    }
+}
+
+// Under the state lock: the Prometheus text exposition
+void Server::renderMetrics(std::string& out) {
+    Totals t;
+    gather(_shards, t);
+
+    std::ostringstream m;
+    m.precision(9);
+    metric(m, "ircserv_connections_accepted_total", "counter", "Client connections accepted.", t.connections);
+    metric(m, "ircserv_clients", "gauge", "Open client connections.", _clients.count());
+    metric(m, "ircserv_registrations_total", "counter", "Clients that completed PASS / NICK / USER.",
+           t.registrations);
+    metric(m, "ircserv_channels", "gauge", "Channels.", _channels.size());
+    metric(m, "ircserv_remote_users", "gauge", "Users of linked servers.", _clients.remoteCount());
+    metric(m, "ircserv_links", "gauge", "Servers linked to this one.", _links.size());
+    metric(m, "ircserv_history_lines", "gauge", "Channel lines kept for CHATHISTORY.", _history.lines());
+    metric(m, "ircserv_history_bytes", "gauge", "Memory taken by the channel history.", _history.bytes());
+    metric(m, "ircserv_history_evictions_total", "counter",
+           "History lines dropped to stay within IRCSERV_HISTORY_BUDGET.", _history.evictions());
+
+    header(m, "ircserv_commands_total", "counter", "Commands dispatched, by command.");
+    for (size_t i = 0; i < _commands.size(); i++)
+        m << "ircserv_commands_total{command=\"" << _commands[i].name << "\"} " << _commands[i].hits << '\n';
+    m << "ircserv_commands_total{command=\"unknown\"} " << _unknownCommands << '\n';
+
+    metric(m, "ircserv_received_bytes_total", "counter", "Bytes read from clients.", t.bytesIn);
+    metric(m, "ircserv_sent_bytes_total", "counter", "Bytes written to clients.", t.bytesOut);
+    metric(m, "ircserv_received_lines_total", "counter", "Lines handled.", t.linesIn);
+    metric(m, "ircserv_sent_lines_total", "counter", "Lines written.", t.linesOut);
+    metric(m, "ircserv_syscalls_total", "counter", "Syscalls made by the event loops.", t.syscalls);
+
+    metric(m, "ircserv_sendq_bytes", "gauge", "Output queued for clients, not written yet.", t.queued);
+    metric(m, "ircserv_sendq_paused_clients", "gauge", "Clients not read until their SendQ drains.", t.paused);
+    metric(m, "ircserv_sendq_disconnects_total", "counter", "Max SendQ exceeded disconnects.", t.sendqKills);
+    metric(m, "ircserv_backlog_clients", "gauge", "Clients with lines waiting for their next turn.", t.backlog);
+    metric(m, "ircserv_throttled_clients", "gauge", "Clients out of flood credit.", t.throttled);
+    metric(m, "ircserv_flood_throttles_total", "counter", "Times a client ran out of flood credit.", t.throttles);
+    metric(m, "ircserv_excess_flood_disconnects_total", "counter", "Excess Flood disconnects.", t.floodKills);
+    metric(m, "ircserv_log_dropped_total", "counter", "Log records dropped, the log ring being full.",
+           Logger::dropped());
+
+    histogram(m, "ircserv_handler_seconds", "Time to run one command handler.", t.handlerNs, 10, 30, 2, 1e9);
+    histogram(m, "ircserv_loop_iteration_seconds", "Event loop work per iteration, after the wait.",
+              t.loopNs, 10, 30, 2, 1e9);
+    histogram(m, "ircserv_fanout_recipients", "Recipients of one channel line.", t.fanout, 0, 17, 1, 1);
+    out = m.str();
+}
+
+// Under the state lock: STATS m, 212 per command then 249 summaries
+void Server::reportMetrics(int fd, const std::string& me) {
+    for (size_t i = 0; i < _commands.size(); i++) {
+        if (_commands[i].hits == 0)
+            continue;
+        Reply r;
+        numeric(r, "212", me) << _commands[i].name << ' ' << _commands[i].hits;
+        sendReply(fd, r);
+    }
+
+    Totals t;
+    gather(_shards, t);
+    std::ostringstream clients, traffic, handlers, loop, fanout, queues;
+    clients << "clients " << _clients.count() << " open, " << t.connections << " accepted, "
+            << t.registrations << " registered, " << _channels.size() << " channels, "
+            << _clients.remoteCount() << " remote users on " << _links.size() << " links";
+    traffic << "traffic " << t.bytesIn << " bytes in, " << t.bytesOut << " bytes out, "
+            << t.linesIn << " lines in, " << t.linesOut << " lines out";
+    handlers << "handlers " << t.handlerNs.count << " commands, " << latencies(t.handlerNs);
+    loop << "loop " << t.loopNs.count << " iterations, " << latencies(t.loopNs);
+    fanout << "fanout " << t.fanout.count << " channel lines, recipients p50 " << t.fanout.percentile(0.50)
+           << ", p99 " << t.fanout.percentile(0.99) << ", p999 " << t.fanout.percentile(0.999);
+    queues << "queues " << t.queued << " sendq bytes, " << t.paused << " paused, "
+           << t.backlog << " clients waiting a turn, " << Logger::dropped() << " log records dropped";
+    sendNumeric(fd, "249", me, "m", clients.str().c_str());
+    sendNumeric(fd, "249", me, "m", traffic.str().c_str());
+    sendNumeric(fd, "249", me, "m", handlers.str().c_str());
+    sendNumeric(fd, "249", me, "m", loop.str().c_str());
+    sendNumeric(fd, "249", me, "m", fanout.str().c_str());
+    sendNumeric(fd, "249", me, "m", queues.str().c_str());
+}
+
+bool Server::setupMetricsSocket() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "socket() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    _metricsFd = fd; // closed by ~Server
+    if (!setNonBlocking(fd))
+        return false;
+
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+        std::cerr << "setsockopt(SO_REUSEADDR) failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local scrapers only
+    addr.sin_port = htons(static_cast<unsigned short>(_config.metricsPort));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "bind() failed for the metrics port: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    if (listen(fd, kMaxScrapes) < 0) {
+        std::cerr << "listen() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    std::cout << "Metrics on 127.0.0.1:" << _config.metricsPort << "\n";
+    return true;
+}
+
+void Server::acceptMetrics(Shard& sh) {
+    while (true) {
+        Shard::add(sh.syscalls, 1);
+        int fd = accept(_metricsFd, 0, 0);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                Logger::error("accept() failed for the metrics port", -1, errno);
+            break;
+        }
+        if (_metricsConns.size() >= kMaxScrapes || !setNonBlocking(fd)
+            || !sh.poller->add(fd, static_cast<uint64_t>(fd), false)) {
+            close(fd);
+            continue;
+        }
+        _metricsConns[fd] = MetricsConn();
+    }
+}
+
+// One HTTP/1.0 exchange: read the request, write the whole response, then
+// wait for the scraper to close
+void Server::serveMetrics(Shard& sh, int fd) {
+    std::map<int, MetricsConn>::iterator it = _metricsConns.find(fd);
+    if (it == _metricsConns.end())
+        return; // closed earlier in this batch
+    MetricsConn& conn = it->second;
+
+    char buf[2048];
+    Shard::add(sh.syscalls, 1);
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        closeMetrics(sh, fd);
+        return;
+    }
+    if (conn.answered)
+        return; // nothing more to say
+    conn.request.append(buf, static_cast<size_t>(n));
+    if (conn.request.find("\r\n\r\n") == std::string::npos && conn.request.find("\n\n") == std::string::npos) {
+        if (conn.request.size() > kMaxRequest)
+            closeMetrics(sh, fd);
+        return;
+    }
+
+    // "GET /metrics HTTP/1.1"
+    std::string status = "200 OK";
+    std::string body;
+    if (conn.request.compare(0, 4, "GET ") != 0)
+        status = "405 Method Not Allowed";
+    else {
+        size_t end = conn.request.find_first_of(" \r\n", 4);
+        std::string path = conn.request.substr(4, end == std::string::npos ? std::string::npos : end - 4);
+        if (path == "/metrics" || path == "/") {
+            lockState(sh);
+            renderMetrics(body);
+            unlockState();
+        } else
+            status = "404 Not Found";
+    }
+
+    std::ostringstream head;
+    head << "HTTP/1.0 " << status << "\r\n"
+         << "Content-Type: text/plain; version=0.0.4\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Connection: close\r\n\r\n";
+    std::string response = head.str() + body;
+
+    // a few kB: the socket buffer takes it at once, a scraper it doesn't fit is dropped
+    size_t sent = 0;
+    while (sent < response.size()) {
+        Shard::add(sh.syscalls, 1);
+        ssize_t w = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (w <= 0)
+            break;
+        sent += static_cast<size_t>(w);
+    }
+    if (sent < response.size()) {
+        closeMetrics(sh, fd);
+        return;
+    }
+    shutdown(fd, SHUT_WR); // closing now could reset the connection before the scraper reads
+    conn.answered = true;
+    conn.request.clear();
+}
+
+void Server::closeMetrics(Shard& sh, int fd) {
+    sh.poller->remove(fd);
+    Shard::add(sh.syscalls, 1);
+    close(fd);
+    _metricsConns.erase(fd);
+}
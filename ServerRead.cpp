@@ -1,107 +1,416 @@
-
 ///
 // IS part of Server.cpp file
 ///
 
 #include "Server.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <sys/ioctl.h>
+
 namespace {
-    // IRC limit applies to ONE command line (excluding line ending).
-    // Enforce it on the *unfinished tail* after the last '\n'
-    // (we accept both "\r\n" and "\n" as line terminators).
-    size_t unfinishedLineLen(const std::string& buf) {
-        size_t pos = buf.rfind('\n');
-        if (pos == std::string::npos)
-            return buf.size();          // no complete line yet -> whole buffer is unfinished
-        return buf.size() - (pos + 1);  // bytes after last '\n'
+    // IRC limit applies to ONE command line (excluding line ending), counted
+    // after its tag section, which has limits of its own (IRCv3 message-tags,
+    // '@' and the space included): 8191 bytes, 4096 from a client.
+    // Enforced on every complete line and on the unfinished tail left once
+    // they were taken out (we accept both "\r\n" and "\n" as line terminators).
+    const size_t kMaxLineLen = 510;
+    const size_t kMaxTagsLen = 8191;
+    const size_t kMaxClientTagsLen = kMaxClientTags + 2;
+
+    // Completion backend: input held past this stops the kernel receiving
+    // for the client, like a full socket buffer does with readiness polling
+    const size_t kHeldCap = 16 * 1024;
+
+    // Input a throttled client may have waiting (buffered, held, or still in
+    // its socket) before it is a flood rather than a paste
+    const size_t kFloodCap = 64 * 1024;
+
+    // Bytes of the "@tags " section a line starts with, all of it while
+    // the space has not arrived yet
+    size_t tagSection(const char* line, size_t len) {
+        if (len == 0 || line[0] != '@')
+            return 0;
+        const char* space = static_cast<const char*>(std::memchr(line, ' ', len));
+        return space ? static_cast<size_t>(space - line) + 1 : len;
     }
-}
 
-void Server::handleClientRead(int indOfPoll) {
-    const int fd = _pollFDs[indOfPoll].fd;
+    bool overlong(const char* line, size_t len) {
+        size_t tags = tagSection(line, len);
+        return tags > kMaxTagsLen || len - tags > kMaxLineLen;
+    }
 
-    // Get/ensure buffer entry (better than keeping a reference forever)
-    std::map<int, std::string>::iterator bit = _inbuf.find(fd);
-    if (bit == _inbuf.end())
-        bit = _inbuf.insert(std::make_pair(fd, std::string())).first;
+    // Out of flood credit and still sending: its reads stopped, yet its
+    // waiting input reached kFloodCap. Only a throttled client costs the ioctl.
+    bool excessFlood(Shard& sh, const Client& c) {
+        if (!c.throttled)
+            return false;
+        size_t waiting = c.in.pending() + c.held.size() - c.heldFrom;
+        int unread = 0;
+        Shard::add(sh.syscalls, 1);
+        if (ioctl(c.fd, FIONREAD, &unread) == 0 && unread > 0)
+            waiting += static_cast<size_t>(unread);
+        return waiting >= kFloodCap;
+    }
+}
 
-    bool peerClosed = false;
+// recv runs without the state lock; each chunk's lines are then handled under it.
+// At most linesPerTurn lines a call: whatever is left waits for the next turn.
+void Server::handleClientRead(Shard& sh, int fd) {
+    Client& c = _clients.at(fd);
+    uint64_t token = ClientTable::tokenOf(c);
+    if (c.backlogged)
+        return; // its turn comes from the backlog
+
+    // lines left by an earlier turn go first
+    size_t budget = _config.linesPerTurn;
+    if (c.deferred && !runDeferred(sh, fd, budget))
+        return;
+    if (!c.throttled)
+        holdForFlood(sh, c, false);
 
-    char tmp[512];
     while (true) {
-        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        // Its replies are piling up unread: leave the rest in the socket until they drain
+        // (not a link's: the peer server reads, and waiting on it could deadlock the two)
+        if (c.out.bytes() >= _config.sendqSoft && !c.isLink) {
+            if (!c.readPaused)
+                setReading(sh, c, false);
+            return;
+        }
+
+        LineBuffer& in = c.in;
+        if (c.deferred) {
+            if (!c.throttled) {
+                scheduleTurn(sh, c); // line budget spent, the socket keeps the rest
+                return;
+            }
+            if (excessFlood(sh, c)) {
+                Shard::add(sh.excessFloodKills, 1);
+                lockState(sh);
+                disconnectClient(fd, "Excess Flood");
+                unlockState();
+                return;
+            }
+            // over the flood limit: its lines wait in the buffer, the rest in the socket
+            holdForFlood(sh, c, true);
+            return;
+        }
+
+        // recv straight into the client's buffer, no intermediate copy
+        Shard::add(sh.syscalls, 1);
+        ssize_t n = recv(fd, in.writePtr(), in.writable(), 0);
 
         if (n > 0) {
-            // Re-find each time in case fd was disconnected elsewhere (paranoia-safe)
-            bit = _inbuf.find(fd);
-            if (bit == _inbuf.end())
-                return; // disconnected
+            in.commit(static_cast<size_t>(n));
+            c.lastInput = sh.now;
+            Metrics::bump(sh.metrics.bytesIn, static_cast<unsigned long>(n));
 
-            bit->second.append(tmp, n);
+            lockState(sh);
+            processInput(fd, budget);
+            unlockState();
 
-            if (unfinishedLineLen(bit->second) > 510) {
-                std::cout << "Protocol violation: overlong line fd=" << fd << "\n";
-                int idx = findPollIndexByFd(fd);
-                if (idx != -1)
-                    disconnectClient(idx);
-                return;
-            }
+            // A handler below may have disconnected this fd
+            if (!sh.serves(fd, token))
+                return; // disconnected
             continue;
         }
 
-        if (n == 0) {
-            peerClosed = true;
-            break;
-        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
 
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            break;
+        if (n == 0)
+            Logger::info("Client disconnected", fd);
+        else
+            Logger::error("recv() failed", fd, errno);
+        lockState(sh);
+        disconnectClient(fd);
+        unlockState();
+        return;
+    }
+}
+
+// Completion backend: the poller already received result bytes at data
+// (0: peer closed, < 0: -errno). They are copied into the line buffer, since
+// a line can span two completions and data goes back to the kernel.
+// The kernel keeps receiving until a pause takes effect: whatever arrives
+// meanwhile (or while earlier lines wait for their turn) is held.
+void Server::handleClientData(Shard& sh, int fd, const char* data, int result) {
+    Client& c = _clients.at(fd);
+    uint64_t token = ClientTable::tokenOf(c);
 
-        std::cerr << "recv() failed fd=" << fd << ": " << std::strerror(errno) << "\n";
-        int idx = findPollIndexByFd(fd);
-        if (idx != -1)
-            disconnectClient(idx);
+    if (result <= 0) {
+        if (result == 0)
+            Logger::info("Client disconnected", fd);
+        else
+            Logger::error("recv() failed", fd, -result);
+        lockState(sh);
+        disconnectClient(fd);
+        unlockState();
         return;
     }
 
-    // Parse full lines
-    while (true) {
-        bit = _inbuf.find(fd);
-        if (bit == _inbuf.end())
-            return; // disconnected during command handling
+    size_t len = static_cast<size_t>(result);
+    c.lastInput = sh.now;
+    Metrics::bump(sh.metrics.bytesIn, len);
+    if (c.readPaused || c.deferred || !c.held.empty()) {
+        c.held.append(data, len); // after what is already waiting
+    } else {
+        size_t budget = _config.linesPerTurn;
+        size_t used = feedInput(sh, fd, data, len, budget);
+        if (!sh.serves(fd, token))
+            return; // disconnected
+        if (used < len)
+            c.held.append(data + used, len - used);
+    }
 
-        std::string& buf = bit->second;
+    if (!c.heldFull && c.held.size() - c.heldFrom >= kHeldCap) {
+        c.heldFull = true;
+        sh.poller->setReadInterest(fd, false);
+    }
 
-        size_t nl = buf.find('\n');
-        if (nl == std::string::npos)
+    if (excessFlood(sh, c)) {
+        Shard::add(sh.excessFloodKills, 1);
+        lockState(sh);
+        disconnectClient(fd, "Excess Flood");
+        unlockState();
+        return;
+    }
+    if (c.deferred && c.throttled)
+        holdForFlood(sh, c, true); // what the kernel already has waits there
+}
+
+// Hands bytes to the line splitter a buffer at a time, like handleClientRead,
+// until they run out, the SendQ crosses the soft limit (reads get paused) or
+// lines have to wait for a later turn. Returns how many were taken; fd may
+// have been disconnected meanwhile.
+size_t Server::feedInput(Shard& sh, int fd, const char* data, size_t len, size_t& budget) {
+    Client& c = _clients.at(fd);
+    uint64_t token = ClientTable::tokenOf(c);
+    size_t used = 0;
+
+    while (used < len && !c.deferred) {
+        // Its replies are piling up unread: stop receiving until they drain
+        if (c.out.bytes() >= _config.sendqSoft && !c.isLink) {
+            if (!c.readPaused)
+                setReading(sh, c, false);
             break;
+        }
 
-        std::string line = buf.substr(0, nl);
-        buf.erase(0, nl + 1);
+        LineBuffer& in = c.in;
+        size_t n = std::min(len - used, in.writable());
+        std::memcpy(in.writePtr(), data + used, n);
+        in.commit(n);
+        used += n;
 
-        if (!line.empty() && line[line.size() - 1] == '\r')
-            line.erase(line.size() - 1);
+        lockState(sh);
+        processInput(fd, budget);
+        unlockState();
 
-        if (line.empty())
+        if (!sh.serves(fd, token))
+            return used; // disconnected
+    }
+
+    if (c.deferred && !c.throttled)
+        scheduleTurn(sh, c); // line budget spent
+    return used;
+}
+
+// Completion backend, after a pause or a deferral: handles the lines and the
+// input held back meanwhile. False if that disconnected the client.
+bool Server::resumeHeldInput(Shard& sh, int fd) {
+    Client& c = _clients.at(fd);
+    uint64_t token = ClientTable::tokenOf(c);
+
+    size_t budget = _config.linesPerTurn;
+    if (c.deferred && !runDeferred(sh, fd, budget))
+        return false;
+    if (!c.throttled)
+        holdForFlood(sh, c, false);
+    if (c.deferred) {
+        if (!c.throttled) {
+            scheduleTurn(sh, c);
+        } else if (excessFlood(sh, c)) {
+            Shard::add(sh.excessFloodKills, 1);
+            lockState(sh);
+            disconnectClient(fd, "Excess Flood");
+            unlockState();
+            return false;
+        }
+        return true;
+    }
+
+    // handlers never touch c.held, it can be fed in place
+    size_t used = feedInput(sh, fd, c.held.data() + c.heldFrom, c.held.size() - c.heldFrom, budget);
+    if (!sh.serves(fd, token))
+        return false;
+    // a turn takes a few lines of a possibly long backlog: drop the handled
+    // bytes only once they are half of it
+    c.heldFrom += used;
+    if (c.heldFrom == c.held.size()) {
+        c.held.clear();
+        c.heldFrom = 0;
+    } else if (c.heldFrom > c.held.size() / 2) {
+        c.held.erase(0, c.heldFrom);
+        c.heldFrom = 0;
+    }
+
+    if (c.heldFull && c.held.size() - c.heldFrom < kHeldCap / 2) {
+        c.heldFull = false;
+        if (!c.readPaused && !c.floodHeld)
+            sh.poller->setReadInterest(fd, true);
+    }
+    return true;
+}
+
+// Runs the lines an earlier turn left in fd's buffer. False once fd got disconnected.
+bool Server::runDeferred(Shard& sh, int fd, size_t& budget) {
+    size_t before = budget;
+    lockState(sh);
+    bool alive = processInput(fd, budget);
+    unlockState();
+    Shard::add(sh.deferredLines, static_cast<long>(before - budget));
+    return alive;
+}
+
+// Gives c another turn at the next loop iteration
+void Server::scheduleTurn(Shard& sh, Client& c) {
+    if (c.backlogged)
+        return;
+    c.backlogged = true;
+    sh.backlog.push_back(ClientTable::tokenOf(c));
+}
+
+// One turn for every client that had lines left, in the order they were left
+void Server::serveBacklog(Shard& sh) {
+    sh.serving.clear();
+    sh.serving.swap(sh.backlog); // clients deferred again wait for the next iteration
+    for (size_t i = 0; i < sh.serving.size(); i++) {
+        uint64_t token = sh.serving[i];
+        int fd = static_cast<int>(token & 0xffffffffu);
+        if (!sh.serves(fd, token))
+            continue; // disconnected since
+        Client& c = _clients.at(fd);
+        c.backlogged = false;
+        if (c.readPaused)
+            continue; // flushClientWrite gives it a turn once its SendQ drains
+        if (sh.poller->completesIo())
+            resumeHeldInput(sh, fd);
+        else
+            handleClientRead(sh, fd);
+    }
+}
+
+// Token bucket: floodRate tokens a second up to floodBurst, kept in
+// thousandths (that is floodRate of them a millisecond). True while c may
+// run a command; dispatch() charges its cost afterwards.
+bool Server::hasFloodCredit(Client& c) {
+    if (_config.floodRate == 0 || c.isLink)
+        return true; // a link carries the whole network's traffic
+
+    uint64_t now = _current->now;
+    if (now > c.floodRefilledAt) {
+        long room = static_cast<long>(_config.floodBurst) * 1000 - c.floodTokens;
+        uint64_t gained = (now - c.floodRefilledAt) * _config.floodRate;
+        if (room <= 0 || gained >= static_cast<uint64_t>(room))
+            c.floodTokens = static_cast<long>(_config.floodBurst) * 1000;
+        else
+            c.floodTokens += static_cast<long>(gained);
+        c.floodRefilledAt = now;
+    }
+    return c.floodTokens > 0;
+}
+
+// Handles the complete lines in fd's buffer, as long as the turn's line
+// budget and fd's flood credit last. False once fd got disconnected.
+bool Server::processInput(int fd, size_t& budget) {
+    Client& c = _clients.at(fd);
+    LineBuffer& in = c.in;
+    unsigned long lines = 0;
+    bool alive = true;
+    bool deferred = false;
+    bool throttled = false;
+
+    // Parse full lines
+    const char* line;
+    size_t len;
+    while (!c.closing && in.nextLine(line, len)) { // nothing more from a client on its way out
+        // flood limit or the end of this turn: the line waits in the buffer
+        throttled = !hasFloodCredit(c);
+        if (throttled || budget == 0) {
+            in.putBack(line);
+            deferred = true;
+            break;
+        }
+        --budget;
+        ++lines;
+
+        if (overlong(line, len)) {
+            Logger::warn("Protocol violation: overlong line", fd);
+            disconnectClient(fd);
+            alive = false;
+            break;
+        }
+        if (len == 0)
             continue;
+        if (!c.isLink && tagSection(line, len) > kMaxClientTagsLen) {
+            sendNumeric(fd, "417", nickOf(fd), "Input line was too long");
+            continue;
+        }
 
-        //std::cout << "RAW <- [" << line << "]\n";
+        if (Logger::enabled(Logger::RAW))
+            Logger::log(Logger::RAW, "received", fd, 0, "line", line, len);
 
-        ParsedMessage msg = parseLine(line);
-        if (msg.command.empty())
+        if (c.isLink) {
+            onLinkLine(fd, line, len);
+            if (!_clients.find(fd)) {
+                alive = false;
+                break;
+            }
             continue;
+        }
 
-        onMessage(indOfPoll, fd, msg);
+        // Parse in place, without copying the line
+        MessageView view;
+        if (parseLineView(line, len, view)) {
+            if (view.command.empty())
+                continue;
+            onMessage(fd, view);
+        } else {
+            ParsedMessage msg = parseLine(std::string(line, len)); // > 15 params, rare
+            onMessage(fd, msg);
+        }
 
         // If QUIT (or any handler) disconnected the client, stop immediately
-        if (_clients.find(fd) == _clients.end())
-            return;
+        if (!_clients.find(fd)) {
+            alive = false;
+            break;
+        }
+    }
+    Shard& sh = *_current;
+    Shard::add(sh.linesIn, static_cast<long>(lines));
+    if (!alive)
+        return false;
+
+    // only the unfinished tail is left unless lines were deferred
+    if (!deferred && !c.closing && overlong(in.pendingData(), in.pending())) {
+        Logger::warn("Protocol violation: overlong line", fd);
+        disconnectClient(fd);
+        return false;
     }
 
-    if (peerClosed) {
-        std::cout << "Client disconnected fd=" << fd << "\n";
-        int idx = findPollIndexByFd(fd);
-        if (idx != -1)
-            disconnectClient(idx);
+    c.deferred = deferred;
+    if (throttled != c.throttled) {
+        c.throttled = throttled;
+        Shard::add(sh.throttledClients, throttled ? 1 : -1);
+        if (throttled)
+            Shard::add(sh.floodThrottles, 1);
     }
-}
\ No newline at end of file
+    if (throttled) {
+        // back when the bucket is in credit again; onClientTimer() puts the
+        // liveness deadline back
+        long wait = (1 - c.floodTokens + static_cast<long>(_config.floodRate) - 1)
+                    / static_cast<long>(_config.floodRate);
+        sh.timers.schedule(c.timer, sh.now + static_cast<uint64_t>(wait));
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+///
+// IS part of Server.cpp file
+///
+
+#include "Server.hpp"
+
+// Channel snapshots (IRCSERV_STATE_FILE). Every IRCSERV_SNAPSHOT_INTERVAL
+// seconds shard 0 encodes the channels' metadata under the state lock and a
+// thread writes it out, so the loops never wait on the disk; a last one is
+// written when the loops stop. At startup the file is mapped, not read: its
+// channels are shells, found by the first JOIN of their name, which brings
+// the channel back with its topic and modes (the joiner needs its key).
+
+// Maps the last snapshot, if any
+void Server::loadSnapshot() {
+    if (_config.stateFile.empty())
+        return;
+    _nextSnapshotAt = TimerWheel::monotonicMs() + _config.snapshotInterval * 1000;
+    if (_snapshot.open(_config.stateFile))
+        std::cout << "Channel snapshot " << _config.stateFile << ": " << _snapshot.size() << " channels\n";
+}
+
+// A channel of the snapshot no JOIN took yet
+bool Server::findShell(const std::string& name, Channel& out) const {
+    if (_shellsTaken.find(name) != _shellsTaken.end())
+        return false; // joined since: the live channel (or its end) is what counts
+    return _snapshot.find(name, out);
+}
+
+// Adds the shells from index s on whose names sort before name (all of them
+// for none) and returns where it stopped; a shell named name is skipped, the
+// live channel replaces it
+size_t Server::addShells(ChannelSnapshot::Builder& b, size_t s, const std::string* name) const {
+    std::string shellName;
+    for (; s < _snapshot.size(); s++) {
+        if (!_snapshot.nameAt(s, shellName))
+            return _snapshot.size(); // corrupt from here on
+        if (name && shellName > *name)
+            break;
+        if ((name && shellName == *name) || _shellsTaken.find(shellName) != _shellsTaken.end())
+            continue;
+        Channel shell;
+        if (_snapshot.at(s, shell))
+            b.add(shell);
+    }
+    return s;
+}
+
+// The live channels and the shells left, in name order
+void Server::encodeSnapshot(std::string& image) const {
+    ChannelSnapshot::Builder b;
+    size_t s = 0;
+    for (std::map<std::string, Channel>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        s = addShells(b, s, &it->first);
+        b.add(it->second);
+    }
+    addShells(b, s, 0);
+    b.finish(image);
+}
+
+void* Server::snapshotMain(void* arg) {
+    Server* self = static_cast<Server*>(arg);
+    if (!ChannelSnapshot::save(self->_config.stateFile, self->_snapshotImage))
+        Logger::error("channel snapshot write failed", -1, errno);
+    __sync_lock_test_and_set(&self->_snapshotDone, 1);
+    return 0;
+}
+
+// Shard 0, every loop iteration: the periodic snapshot. Only the encoding
+// holds the lock; an unchanged image isn't written, and while the last one
+// is still being written this round is skipped.
+void Server::snapshotChannels(Shard& sh) {
+    if (sh.now < _nextSnapshotAt)
+        return;
+    _nextSnapshotAt = sh.now + _config.snapshotInterval * 1000;
+    if (_snapshotWriting) {
+        if (!__sync_fetch_and_add(&_snapshotDone, 0))
+            return;
+        pthread_join(_snapshotThread, 0);
+        _snapshotWriting = false;
+    }
+
+    std::string image;
+    lockState(sh);
+    encodeSnapshot(image);
+    unlockState();
+    if (image == _snapshotImage)
+        return;
+
+    _snapshotImage.swap(image);
+    _snapshotDone = 0;
+    if (pthread_create(&_snapshotThread, 0, &Server::snapshotMain, this) != 0) {
+        Logger::error("pthread_create() failed for the snapshot writer");
+        _snapshotImage.clear(); // written next time
+        return;
+    }
+    _snapshotWriting = true;
+    Logger::log(Logger::DEBUG, "channel snapshot", -1, 0, "file", _config.stateFile.data(), _config.stateFile.size());
+}
+
+// The loops are stopped (shutdown, hot restart): the last changes go to
+// disk now, the writer thread is done
+void Server::finishSnapshot() {
+    if (_config.stateFile.empty())
+        return;
+    if (_snapshotWriting) {
+        pthread_join(_snapshotThread, 0);
+        _snapshotWriting = false;
+    }
+    std::string image;
+    encodeSnapshot(image);
+    if (image == _snapshotImage)
+        return;
+    _snapshotImage.swap(image);
+    if (!ChannelSnapshot::save(_config.stateFile, _snapshotImage))
+        Logger::error("channel snapshot write failed", -1, errno);
+}
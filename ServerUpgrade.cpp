@@ -0,0 +1,654 @@
+///
+// IS part of Server.cpp file
+///
+
+#include "Server.hpp"
+#include "StateBuffer.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <dirent.h>
+#include <sstream>
+#include <sys/wait.h>
+
+// Hot restart (SIGUSR2): the running server hands its listening sockets and
+// every connection to a new process exec'd from the binary on disk, without
+// closing anything. The loops stop; the old process serializes its state
+// (clients with both buffers, channels, nicks, links), forks, and the child
+// execs the binary with IRCSERV_UPGRADE_FD naming its end of a socket pair.
+// Over it go the state, then the sockets (SCM_RIGHTS). The new process puts
+// each socket back under its old fd number, rebuilds the state and answers
+// with one byte; the old one answers that with one byte of its own and exits.
+// Until then it can still give up (a timeout, a child that died or refused the
+// state) and go on serving as if nothing happened: the new process only reads
+// a socket after the second byte. Clients see a pause, not a disconnect.
+
+namespace {
+    const char* const kUpgradeEnv = "IRCSERV_UPGRADE_FD";
+    const uint32_t kStateVersion = 3;
+    const int kHandOffTimeoutSec = 5; // for each step of the other side
+    const size_t kFdsPerMessage = 200; // SCM_RIGHTS takes up to 253 a message
+    const char kAck = 'A';             // new process: state restored
+    const char kGo = 'G';              // old process: it is yours, exiting
+
+    // Client flags, one bit each in the state
+    enum {
+        PASS_OK      = 1,
+        HAS_NICK     = 2,
+        HAS_USER     = 4,
+        REGISTERED   = 8,
+        OPER         = 16,
+        IS_LINK      = 32,
+        CLOSING      = 64,
+        PING_PENDING = 128
+    };
+
+    // Channel modes
+    enum {
+        INVITE_ONLY    = 1,
+        TOPIC_OPS_ONLY = 2,
+        HAS_KEY        = 4,
+        HAS_LIMIT      = 8
+    };
+
+    uint32_t packFd(int fd) {
+        return static_cast<uint32_t>(fd);
+    }
+
+    int unpackFd(uint32_t v) {
+        return static_cast<int>(v);
+    }
+
+    bool writeAll(int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = write(fd, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool readAll(int fd, char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = read(fd, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // the state, after its length (4 bytes, little endian)
+    bool sendState(int sock, const std::string& state) {
+        StateWriter head;
+        head.u32(static_cast<uint32_t>(state.size()));
+        return writeAll(sock, head.data().data(), head.data().size())
+            && writeAll(sock, state.data(), state.size());
+    }
+
+    bool receiveState(int sock, std::string& state) {
+        char head[4];
+        if (!readAll(sock, head, sizeof(head)))
+            return false;
+        StateReader r(head, sizeof(head));
+        state.resize(r.u32());
+        return state.empty() || readAll(sock, &state[0], state.size());
+    }
+
+    // fds in batches, one byte of data carrying each
+    bool sendFds(int sock, const std::vector<int>& fds) {
+        for (size_t i = 0; i < fds.size(); i += kFdsPerMessage) {
+            size_t n = std::min(kFdsPerMessage, fds.size() - i);
+            char byte = 'F';
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+            std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = control.size();
+            cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+            std::memcpy(CMSG_DATA(cm), &fds[i], n * sizeof(int));
+
+            ssize_t sent;
+            do {
+                sent = sendmsg(sock, &msg, 0);
+            } while (sent < 0 && errno == EINTR);
+            if (sent != 1)
+                return false;
+        }
+        return true;
+    }
+
+    // Receives count fds and puts them at or above base (close on exec, the
+    // caller moves them where they belong)
+    bool receiveFds(int sock, size_t count, int base, std::vector<int>& out) {
+        while (out.size() < count) {
+            size_t n = std::min(kFdsPerMessage, count - out.size());
+            char byte;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+            std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = control.size();
+            ssize_t got;
+            do {
+                got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            } while (got < 0 && errno == EINTR);
+            if (got != 1)
+                return false;
+
+            cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+            if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                return false;
+            size_t received = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::vector<int> batch(received);
+            std::memcpy(&batch[0], CMSG_DATA(cm), received * sizeof(int));
+
+            bool ok = received == n && !(msg.msg_flags & MSG_CTRUNC);
+            for (size_t i = 0; i < batch.size(); i++) {
+                int high = ok ? fcntl(batch[i], F_DUPFD_CLOEXEC, base) : -1;
+                close(batch[i]);
+                if (high < 0)
+                    ok = false;
+                else
+                    out.push_back(high);
+            }
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    // highest fd open in this process, for the child to close them all
+    int highestFd() {
+        int highest = -1;
+        DIR* dir = opendir("/proc/self/fd");
+        if (!dir)
+            return static_cast<int>(sysconf(_SC_OPEN_MAX)) - 1;
+        while (dirent* e = readdir(dir)) {
+            int fd = std::atoi(e->d_name);
+            if (fd > highest)
+                highest = fd;
+        }
+        closedir(dir);
+        return highest;
+    }
+}
+
+// main(): the binary to exec on SIGUSR2, and its command line
+void Server::setCommandLine(char** argv) {
+    _argv = argv;
+    char path[PATH_MAX];
+    if (realpath(argv[0], path))
+        _exe = path;
+    else
+        _exe = argv[0];
+}
+
+// The loops are stopped: lines other shards queued are moved into their
+// clients' queues, and clients over the hard SendQ limit leave now, as the
+// next flush would have made them
+void Server::settleForHandOff() {
+    while (true) {
+        for (size_t i = 0; i < _shards.size(); i++)
+            drainInbox(*_shards[i]);
+
+        std::vector<int> exceeded;
+        for (int fd = 0; fd < _clients.limit(); fd++) {
+            Client* c = _clients.find(fd);
+            if (c && c->sendqExceeded)
+                exceeded.push_back(fd);
+        }
+        if (exceeded.empty())
+            return;
+        lockState(*_shards[0]);
+        for (size_t i = 0; i < exceeded.size(); i++)
+            disconnectClient(exceeded[i], "Max SendQ exceeded");
+        unlockState();
+    }
+}
+
+// Everything the new process needs, and the sockets to pass (listeners,
+// the metrics listener, then our clients and links, in the state's order)
+void Server::writeState(StateWriter& w, std::vector<int>& fds) {
+    std::vector<int> listeners;
+    for (size_t i = 0; i < _shards.size(); i++)
+        listeners.push_back(_shards[i]->listenFd);
+    fds = listeners;
+    if (_metricsFd != -1)
+        fds.push_back(_metricsFd);
+    for (int fd = 0; fd < _clients.limit(); fd++) {
+        if (_clients.find(fd))
+            fds.push_back(fd);
+    }
+
+    w.u32(kStateVersion);
+    w.u32(static_cast<uint32_t>(fds.size()));
+    for (size_t i = 0; i < fds.size(); i++)
+        w.u32(packFd(fds[i]));
+    w.u32(static_cast<uint32_t>(listeners.size()));
+    for (size_t i = 0; i < listeners.size(); i++)
+        w.u32(packFd(listeners[i]));
+    w.u32(packFd(_metricsFd));
+
+    // our clients, then the remote users, ids increasing
+    std::vector<const Client*> clients;
+    for (int fd = 0; fd < _clients.limit(); fd++) {
+        if (const Client* c = _clients.find(fd))
+            clients.push_back(c);
+    }
+    for (int id = ClientTable::REMOTE_BASE; id < _clients.remoteLimit(); id++) {
+        if (const Client* c = _clients.find(id))
+            clients.push_back(c);
+    }
+    std::string in, out;
+    w.u32(static_cast<uint32_t>(clients.size()));
+    for (size_t i = 0; i < clients.size(); i++) {
+        const Client& c = *clients[i];
+        unsigned char flags = (c.passOk ? PASS_OK : 0) | (c.hasNick ? HAS_NICK : 0)
+                            | (c.hasUser ? HAS_USER : 0) | (c.registered ? REGISTERED : 0)
+                            | (c.oper ? OPER : 0) | (c.isLink ? IS_LINK : 0)
+                            | (c.closing ? CLOSING : 0) | (c.pingPending ? PING_PENDING : 0);
+        w.u32(packFd(c.fd));
+        w.u32(static_cast<uint32_t>(c.shard));
+        w.u8(flags);
+        w.u8(c.caps);
+        w.u8(c.capNegotiating ? 1 : 0);
+        w.u32(packFd(c.link));
+        w.str(c.server);
+        w.u64(c.nickTs);
+        w.str(c.nick);
+        w.str(c.user);
+        w.str(c.realname);
+        w.u64(c.connectedAt);
+        w.u64(c.lastInput);
+        w.u64(c.lastCommand);
+        w.u64(c.pingSentAt);
+        w.u64(static_cast<uint64_t>(c.floodTokens));
+        w.u64(c.floodRefilledAt);
+        // partly read input, unsent output
+        w.bytes(c.in.pendingData(), c.in.pending());
+        out.clear();
+        c.out.copyTo(out);
+        w.str(out);
+    }
+
+    w.u32(static_cast<uint32_t>(_channels.size()));
+    for (std::map<std::string, Channel>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        const Channel& ch = it->second;
+        unsigned char modes = (ch.inviteOnly ? INVITE_ONLY : 0) | (ch.topicOpsOnly ? TOPIC_OPS_ONLY : 0)
+                            | (ch.hasKey ? HAS_KEY : 0) | (ch.hasLimit ? HAS_LIMIT : 0);
+        w.str(ch.name);
+        w.str(ch.topic);
+        w.u64(ch.ts);
+        w.u64(ch.topicTs);
+        w.u8(modes);
+        w.str(ch.key);
+        w.u64(ch.userLimit);
+        w.u32(static_cast<uint32_t>(ch.roster.size()));
+        for (size_t i = 0; i < ch.roster.size(); i++) {
+            w.u32(packFd(ch.roster[i].fd));
+            w.u8(ch.roster[i].flags);
+        }
+    }
+
+    w.u32(static_cast<uint32_t>(_servers.size()));
+    for (std::map<std::string, RemoteServer>::const_iterator it = _servers.begin(); it != _servers.end(); ++it) {
+        const RemoteServer& s = it->second;
+        w.str(s.name);
+        w.str(s.uplink);
+        w.str(s.info);
+        w.u32(packFd(s.link));
+        w.u64(s.hops);
+    }
+    w.u32(static_cast<uint32_t>(_links.size()));
+    for (size_t i = 0; i < _links.size(); i++)
+        w.u32(packFd(_links[i]));
+    // the IRCSERV_LINKS connections, by position
+    w.u32(static_cast<uint32_t>(_linkTargets.size()));
+    for (size_t i = 0; i < _linkTargets.size(); i++) {
+        const LinkTarget& t = _linkTargets[i];
+        const Client* c = _clients.findByToken(t.token);
+        w.u32(packFd(t.token && c ? c->fd : -1));
+        w.u64(t.retryAt);
+    }
+    // channel history, oldest first per channel
+    std::vector<std::pair<std::string, HistoryEntry> > history;
+    _history.dump(history);
+    w.u32(static_cast<uint32_t>(history.size()));
+    for (size_t i = 0; i < history.size(); i++) {
+        const Payload& line = history[i].second.line;
+        w.str(history[i].first);
+        w.u64(history[i].second.time);
+        w.bytes(line.data(), line.size());
+    }
+}
+
+// Old process, loops stopped: true once the new one has taken over (we exit),
+// false if it could not (we go on serving, nothing was lost)
+bool Server::handOff() {
+    uint64_t started = TimerWheel::monotonicMs();
+    settleForHandOff();
+    StateWriter w;
+    std::vector<int> fds;
+    writeState(w, fds);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        Logger::error("socketpair() failed", -1, errno);
+        return false;
+    }
+    int sock = pair[0];
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    timeval limit;
+    limit.tv_sec = kHandOffTimeoutSec;
+    limit.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+
+    // the child only closes fds and execs (other threads may hold locks)
+    int highest = highestFd();
+    std::ostringstream childFd;
+    childFd << pair[1];
+    setenv(kUpgradeEnv, childFd.str().c_str(), 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int fd = 3; fd <= highest; fd++) {
+            if (fd != pair[1])
+                close(fd);
+        }
+        execv(_exe.c_str(), _argv);
+        _exit(127);
+    }
+    unsetenv(kUpgradeEnv);
+    close(pair[1]);
+    if (pid < 0) {
+        Logger::error("fork() failed", -1, errno);
+        close(sock);
+        return false;
+    }
+
+    char reply = 0;
+    bool ok = sendState(sock, w.data()) && sendFds(sock, fds)
+           && readAll(sock, &reply, 1) && reply == kAck && writeAll(sock, &kGo, 1);
+    close(sock);
+    if (!ok) {
+        // it never got to read a socket: stop it, keep ours
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+        return false;
+    }
+
+    std::ostringstream text;
+    text << "pid " << pid << ", " << fds.size() << " sockets, " << w.data().size() << " bytes of state, "
+         << (TimerWheel::monotonicMs() - started) << " ms";
+    std::string s = text.str();
+    Logger::log(Logger::INFO, "upgrade handed over", -1, 0, "to", s.data(), s.size());
+    return true;
+}
+
+// New process, instead of init(): takes over from the one that exec'd us
+bool Server::resume(int stateFd) {
+    signal(SIGPIPE, SIG_IGN);
+    unsetenv(kUpgradeEnv);
+
+    std::string state;
+    if (!receiveState(stateFd, state)) {
+        std::cerr << "upgrade: could not read the state: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    StateReader r(state.data(), state.size());
+    if (r.u32() != kStateVersion) {
+        std::cerr << "upgrade: unknown state version\n";
+        return false;
+    }
+
+    // the sockets go back under their old numbers: received above all of
+    // them (and above our end of the pair), then moved down
+    std::vector<int> fds(r.u32());
+    int highest = stateFd;
+    for (size_t i = 0; i < fds.size(); i++) {
+        fds[i] = unpackFd(r.u32());
+        highest = std::max(highest, fds[i]);
+    }
+    std::vector<int> received;
+    if (!r.ok() || !receiveFds(stateFd, fds.size(), highest + 1, received)) {
+        std::cerr << "upgrade: could not receive the sockets\n";
+        return false;
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (dup2(received[i], fds[i]) < 0) {
+            std::cerr << "dup2() failed: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        close(received[i]);
+    }
+
+    // listeners: one per shard, whatever their number was before
+    std::vector<int> listeners(r.u32());
+    for (size_t i = 0; i < listeners.size(); i++)
+        listeners[i] = unpackFd(r.u32());
+    int metricsFd = unpackFd(r.u32());
+    size_t n = _config.threads;
+    for (size_t i = 0; i < n; i++) {
+        Shard* sh = new Shard(static_cast<int>(i), Poller::create(_config.backend));
+        _shards.push_back(sh);
+        if (!sh->init(n))
+            return false;
+        sh->now = TimerWheel::monotonicMs();
+        if (i < listeners.size())
+            sh->listenFd = listeners[i];
+        else if (!setupListeningSocket(*sh, n > 1))
+            return false;
+    }
+    for (size_t i = n; i < listeners.size(); i++)
+        close(listeners[i]);
+    if (metricsFd != -1 && _config.metricsPort != 0)
+        _metricsFd = metricsFd;
+    else {
+        if (metricsFd != -1)
+            close(metricsFd);
+        if (_config.metricsPort != 0 && !setupMetricsSocket())
+            return false;
+    }
+    if (!setupLinks())
+        return false;
+    loadSnapshot();
+
+    if (!restoreState(r)) {
+        std::cerr << "upgrade: corrupt state\n";
+        return false;
+    }
+
+    // taken over: once the old process has stopped for good, we start
+    char go = 0;
+    if (!writeAll(stateFd, &kAck, 1) || !readAll(stateFd, &go, 1) || go != kGo) {
+        std::cerr << "upgrade: the old process kept its clients\n";
+        return false;
+    }
+    close(stateFd);
+    std::cout << "Event loop backend: " << _shards[0]->poller->name()
+              << ", " << n << " reactor thread" << (n > 1 ? "s" : "") << "\n";
+    std::cout << "Upgraded: " << _clients.count() << " connections, " << _channels.size() << " channels\n";
+    return true;
+}
+
+// The rest of resume(): the records, rosters and indexes; our sockets join
+// the pollers as if just accepted, with their buffers and deadlines back
+bool Server::restoreState(StateReader& r) {
+    size_t n = _shards.size();
+    uint32_t clients = r.u32();
+    for (uint32_t i = 0; i < clients && r.ok(); i++) {
+        int fd = unpackFd(r.u32());
+        size_t shard = r.u32() % n;
+        bool local = fd >= 0 && fd < ClientTable::REMOTE_BASE;
+        if (fd < 0 || fd >= ClientTable::MAX_FDS || _clients.find(fd))
+            return false;
+        Client& c = local ? _clients.open(fd) : _clients.openRemote(fd);
+        unsigned char flags = r.u8();
+        c.passOk = flags & PASS_OK;
+        c.hasNick = flags & HAS_NICK;
+        c.hasUser = flags & HAS_USER;
+        c.registered = flags & REGISTERED;
+        c.oper = flags & OPER;
+        c.isLink = flags & IS_LINK;
+        c.closing = flags & CLOSING;
+        c.pingPending = flags & PING_PENDING;
+        c.caps = r.u8();
+        c.capNegotiating = r.u8() != 0;
+        c.link = unpackFd(r.u32());
+        c.server = r.str();
+        c.nickTs = static_cast<unsigned long>(r.u64());
+        c.nick = r.str();
+        c.user = r.str();
+        c.realname = r.str();
+        c.connectedAt = r.u64();
+        c.lastInput = r.u64();
+        c.lastCommand = r.u64();
+        c.pingSentAt = r.u64();
+        c.floodTokens = static_cast<long>(r.u64());
+        c.floodRefilledAt = r.u64();
+        size_t inLen, outLen;
+        const char* in = r.bytes(inLen);
+        const char* out = r.bytes(outLen);
+        refreshPrefix(c);
+        if (c.hasNick)
+            _nickToFd[c.nick] = fd;
+        if (!local)
+            continue;
+
+        Shard& sh = *_shards[shard];
+        c.shard = sh.id;
+        uint64_t token = ClientTable::tokenOf(c);
+        // like an accepted socket: blocking for a completion backend
+        if (sh.poller->completesIo())
+            fcntl(fd, F_SETFL, 0);
+        if (!sh.poller->add(fd, token, true))
+            return false;
+        sh.own(fd, token);
+        c.timer.token = token;
+        if (c.registered)
+            sh.timers.schedule(c.timer, sh.now); // onClientTimer() works out the next deadline
+        else
+            sh.timers.schedule(c.timer, c.connectedAt + _config.registerTimeout * 1000);
+
+        if (inLen > LineBuffer::CAPACITY)
+            return false;
+        std::memcpy(c.in.writePtr(), in, inLen);
+        c.in.commit(inLen);
+        if (std::memchr(in, '\n', inLen)) {
+            c.deferred = true; // complete lines: handled at its first turn
+            scheduleTurn(sh, c);
+        }
+        if (outLen > 0) {
+            c.out.push(Payload(out, outLen));
+            Shard::add(sh.queuedBytes, static_cast<long>(outLen));
+            markDirty(sh, c);
+            if (outLen >= _config.sendqSoft && !c.isLink)
+                setReading(sh, c, false);
+        }
+    }
+
+    uint32_t channels = r.u32();
+    for (uint32_t i = 0; i < channels && r.ok(); i++) {
+        std::string name = r.str();
+        Channel& ch = _channels[name];
+        ch.name = name;
+        ch.topic = r.str();
+        ch.ts = static_cast<unsigned long>(r.u64());
+        ch.topicTs = static_cast<unsigned long>(r.u64());
+        unsigned char modes = r.u8();
+        ch.inviteOnly = modes & INVITE_ONLY;
+        ch.topicOpsOnly = modes & TOPIC_OPS_ONLY;
+        ch.hasKey = modes & HAS_KEY;
+        ch.key = r.str();
+        ch.hasLimit = modes & HAS_LIMIT;
+        ch.userLimit = static_cast<size_t>(r.u64());
+
+        uint32_t roster = r.u32();
+        for (uint32_t m = 0; m < roster && r.ok(); m++) {
+            int fd = unpackFd(r.u32());
+            unsigned char flags = r.u8();
+            Client* c = _clients.find(fd);
+            if (!c)
+                return false;
+            if (flags & ChannelMember::JOINED) {
+                if (flags & ChannelMember::REMOTE)
+                    ch.addRemoteMember(fd, c->link);
+                else
+                    ch.addMember(fd);
+                c->channels.insert(name);
+            }
+            if (flags & ChannelMember::OP)
+                ch.setOperator(fd, true);
+            if (flags & ChannelMember::INVITED) {
+                ch.setInvited(fd, true);
+                c->invitedTo.insert(name);
+            }
+        }
+    }
+
+    uint32_t servers = r.u32();
+    for (uint32_t i = 0; i < servers && r.ok(); i++) {
+        RemoteServer s;
+        s.name = r.str();
+        s.uplink = r.str();
+        s.info = r.str();
+        s.link = unpackFd(r.u32());
+        s.hops = static_cast<unsigned long>(r.u64());
+        _servers[s.name] = s;
+    }
+    uint32_t links = r.u32();
+    for (uint32_t i = 0; i < links && r.ok(); i++)
+        _links.push_back(unpackFd(r.u32()));
+    uint32_t targets = r.u32();
+    for (uint32_t i = 0; i < targets && r.ok(); i++) {
+        int fd = unpackFd(r.u32());
+        uint64_t retryAt = r.u64();
+        if (i >= _linkTargets.size())
+            continue; // IRCSERV_LINKS changed: the extra ones are plain connections now
+        const Client* c = _clients.find(fd);
+        _linkTargets[i].token = c ? ClientTable::tokenOf(*c) : 0;
+        _linkTargets[i].retryAt = retryAt;
+    }
+    // under this configuration's bounds, which may be smaller
+    uint32_t history = r.u32();
+    for (uint32_t i = 0; i < history && r.ok(); i++) {
+        std::string channel = r.str();
+        uint64_t time = r.u64();
+        size_t len;
+        const char* line = r.bytes(len);
+        if (r.ok())
+            _history.record(channel, Payload(line, len), time);
+    }
+    return r.ok() && r.atEnd();
+}
+
+// IRCSERV_UPGRADE_FD, set for the process a hot restart execs: its end of the
+// socket pair, -1 for a normal start
+int Server::upgradeFd() {
+    const char* value = std::getenv(kUpgradeEnv);
+    return value ? std::atoi(value) : -1;
+}
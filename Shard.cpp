@@ -0,0 +1,148 @@
+#include "Shard.hpp"
+#include "Logger.hpp"
+#include "MessageTags.hpp"
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// DELIVERY QUEUE
+
+DeliveryQueue::~DeliveryQueue() {
+    Node* n = _head;
+    while (n) {
+        Node* next = n->next;
+        delete n;
+        n = next;
+    }
+}
+
+void DeliveryQueue::push(DeliveryBatch& batch) {
+    Node* n = new Node;
+    n->batch.swap(batch);
+    // the CAS hands back the current head whenever it fails
+    Node* head = 0;
+    while (true) {
+        n->next = head;
+        Node* seen = __sync_val_compare_and_swap(&_head, head, n);
+        if (seen == head)
+            break;
+        head = seen;
+    }
+}
+
+void DeliveryQueue::takeAll(std::vector<DeliveryBatch>& out) {
+    Node* n = __sync_lock_test_and_set(&_head, static_cast<Node*>(0));
+
+    // the list is newest first: reverse it to replay in push order
+    Node* oldest = 0;
+    while (n) {
+        Node* next = n->next;
+        n->next = oldest;
+        oldest = n;
+        n = next;
+    }
+    while (oldest) {
+        Node* next = oldest->next;
+        out.push_back(DeliveryBatch());
+        out.back().swap(oldest->batch);
+        delete oldest;
+        oldest = next;
+    }
+}
+
+// SHARD
+
+Shard::Shard(int shardId, Poller* p)
+    : id(shardId),
+    poller(p),
+    listenFd(-1),
+    wakeFd(-1),
+    thread(),
+    wakePending(0),
+    timers(kTimerTickMs),
+    now(TimerWheel::monotonicMs()),
+    queuedBytes(0),
+    pausedClients(0),
+    sendqSoftHits(0),
+    sendqHardKills(0),
+    throttledClients(0),
+    floodThrottles(0),
+    deferredLines(0),
+    excessFloodKills(0),
+    syscalls(0),
+    linesIn(0),
+    linesOut(0) { }
+
+Shard::~Shard() {
+    if (listenFd != -1)
+        close(listenFd);
+    if (wakeFd != -1)
+        close(wakeFd);
+    delete poller;
+}
+
+bool Shard::init(size_t shardCount) {
+    if (!poller || !poller->init())
+        return false;
+    outbound.resize(shardCount);
+    byVariant.resize(shardCount * TaggedLine::kVariants);
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        std::cerr << "eventfd() failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool Shard::serves(int fd, uint64_t token) const {
+    return token != 0 && tokenFor(fd) == token;
+}
+
+uint64_t Shard::tokenFor(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd) >= owned.size())
+        return 0;
+    return owned[fd];
+}
+
+void Shard::own(int fd, uint64_t token) {
+    if (static_cast<size_t>(fd) >= owned.size())
+        owned.resize(fd + 1, 0);
+    owned[fd] = token;
+}
+
+void Shard::disown(int fd) {
+    if (fd >= 0 && static_cast<size_t>(fd) < owned.size())
+        owned[fd] = 0;
+}
+
+void Shard::post(DeliveryBatch& batch) {
+    inbox.push(batch);
+    if (__sync_lock_test_and_set(&wakePending, 1) == 0) {
+        uint64_t one = 1;
+        add(syscalls, 1);
+        if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            Logger::error("eventfd write failed", wakeFd, errno);
+    }
+}
+
+void Shard::clearWake() {
+    uint64_t n;
+    do {
+        add(syscalls, 1);
+    } while (read(wakeFd, &n, sizeof(n)) > 0);
+    // full barrier: a batch pushed after this point either is seen by the
+    // drain that follows or finds wakePending == 0 and writes the eventfd
+    __sync_fetch_and_and(&wakePending, 0);
+}
+
+void Shard::add(volatile unsigned long& counter, long delta) {
+    __sync_fetch_and_add(&counter, static_cast<unsigned long>(delta));
+}
+
+unsigned long Shard::load(volatile unsigned long& counter) {
+    return __sync_fetch_and_add(&counter, 0);
+}
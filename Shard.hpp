@@ -0,0 +1,172 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "Metrics.hpp"
+#include "Payload.hpp"
+#include "Poller.hpp"
+#include "TimerWheel.hpp"
+
+// One line for one client, possibly its last: the owner then closes the
+// connection once the line is written. A channel broadcast is a single
+// Delivery for all of a shard's members (token 0): their tokens are
+// recipients[from, from + count) of the batch carrying it.
+struct Delivery {
+    uint64_t token; // ClientTable token of the recipient, 0 for a multicast
+    Payload payload;
+    bool close;
+    size_t from;
+    size_t count;
+
+    Delivery(uint64_t t, const Payload& p, bool last = false)
+        : token(t), payload(p), close(last), from(0), count(0) {}
+    Delivery(const Payload& p, size_t first, size_t n)
+        : token(0), payload(p), close(false), from(first), count(n) {}
+};
+
+// The lines one state lock holder sent to the clients of one shard, in send
+// order. Broadcasts add their recipients first, then close them with
+// multicast(); the owning shard delivers the batch after the lock is gone.
+struct DeliveryBatch {
+    std::vector<Delivery> lines;
+    std::vector<uint64_t> recipients;
+    size_t pending; // recipients[pending..] are waiting for their multicast()
+
+    DeliveryBatch() : pending(0) {}
+
+    bool empty() const { return lines.empty(); }
+    void send(uint64_t token, const Payload& p, bool last = false) {
+        lines.push_back(Delivery(token, p, last));
+    }
+    // p for every recipient added since the last multicast, if any
+    void multicast(const Payload& p) {
+        if (pending == recipients.size())
+            return;
+        lines.push_back(Delivery(p, pending, recipients.size() - pending));
+        pending = recipients.size();
+    }
+    void clear() {
+        lines.clear();
+        recipients.clear();
+        pending = 0;
+    }
+    void swap(DeliveryBatch& other) {
+        lines.swap(other.lines);
+        recipients.swap(other.recipients);
+        std::swap(pending, other.pending);
+    }
+};
+
+// Lock-free multi-producer / single-consumer queue of delivery batches.
+// Producers push a whole batch with one CAS; the owning shard takes every
+// pending batch with one exchange and replays them oldest first. Batches
+// change hands by swapping, their lines are never copied.
+class DeliveryQueue {
+    public:
+        DeliveryQueue() : _head(0) {}
+        ~DeliveryQueue();
+
+        // takes the contents of batch (left empty)
+        void push(DeliveryBatch& batch);
+        // appends every pending batch to out, in push order
+        void takeAll(std::vector<DeliveryBatch>& out);
+
+    private:
+        DeliveryQueue(const DeliveryQueue&);
+        DeliveryQueue& operator=(const DeliveryQueue&);
+
+        struct Node {
+            Node* next;
+            DeliveryBatch batch;
+        };
+
+        Node* volatile _head; // newest first
+};
+
+// One reactor: a thread with its own listening socket (SO_REUSEPORT),
+// its own poller and the connections it accepted. Lines for clients of
+// other shards go through their inbox; an eventfd wakes the owner up.
+struct Shard {
+    int id;
+    Poller* poller;
+    int listenFd;
+    int wakeFd;
+    pthread_t thread;
+
+    std::vector<uint64_t> owned;   // fd -> token of the connection served here, 0 if none
+    std::vector<uint64_t> dirty;   // tokens with output queued this iteration
+    // clients with lines left after their turn (line budget, flood limit or a
+    // SendQ pause), served round-robin at the next iteration
+    std::vector<uint64_t> backlog;
+    std::vector<uint64_t> serving; // scratch: the backlog being served
+    DeliveryQueue inbox;
+    std::vector<DeliveryBatch> incoming; // taken from the inbox, not delivered yet
+    // per target shard (this one included), filled while this shard holds
+    // the state lock
+    std::vector<DeliveryBatch> outbound;
+    DeliveryBatch local;           // our own batch, delivered after the unlock
+    // scratch for tagged broadcasts: tokens by target shard and line variant
+    std::vector<std::vector<uint64_t> > byVariant;
+    volatile int wakePending;
+
+    // connection deadlines; the loop sleeps until the next one at most
+    TimerWheel timers;
+    uint64_t now;                  // ms, refreshed around every wait
+    std::vector<uint64_t> expired; // scratch: tokens whose timer fired
+    // queues of closed connections whose last send is still in the kernel
+    // (completion backend), freed by its SENT event
+    std::map<uint64_t, OutQueue> retired;
+
+    // SendQ accounting, read by STATS from other threads (atomic updates)
+    volatile unsigned long queuedBytes;
+    volatile unsigned long pausedClients;
+    volatile unsigned long sendqSoftHits;
+    volatile unsigned long sendqHardKills;
+
+    // flood control, read by STATS f
+    volatile unsigned long throttledClients; // out of flood credit right now
+    volatile unsigned long floodThrottles;   // times a client ran out of it
+    volatile unsigned long deferredLines;    // lines run in a later turn than the one that received them
+    volatile unsigned long excessFloodKills;
+
+    // event loop cost, read by STATS e: socket and eventfd syscalls made by
+    // the server (the poller counts its own), lines handled and written
+    volatile unsigned long syscalls;
+    volatile unsigned long linesIn;
+    volatile unsigned long linesOut;
+
+    // everything else STATS m and the metrics endpoint report, written by this
+    // shard's thread only (handlers record into the lock holder's)
+    Metrics metrics;
+
+    enum { kTimerTickMs = 100 };
+
+    Shard(int id, Poller* poller);
+    ~Shard();
+
+    bool init(size_t shardCount);
+
+    bool serves(int fd, uint64_t token) const;
+    uint64_t tokenFor(int fd) const;
+    void own(int fd, uint64_t token);
+    void disown(int fd);
+
+    // producer side: queue batch for this shard and wake it if it isn't already
+    void post(DeliveryBatch& batch);
+    // consumer side, on the wake event: rearm, then drain with inbox.takeAll()
+    void clearWake();
+
+    static void add(volatile unsigned long& counter, long delta);
+    static unsigned long load(volatile unsigned long& counter);
+
+    private:
+        Shard(const Shard&);
+        Shard& operator=(const Shard&);
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "StateBuffer.hpp"
+
+void StateWriter::u32(uint32_t v) {
+    char b[4];
+    for (int i = 0; i < 4; i++)
+        b[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+    _out.append(b, 4);
+}
+
+void StateWriter::u64(uint64_t v) {
+    u32(static_cast<uint32_t>(v));
+    u32(static_cast<uint32_t>(v >> 32));
+}
+
+void StateWriter::bytes(const char* data, size_t len) {
+    u32(static_cast<uint32_t>(len));
+    _out.append(data, len);
+}
+
+bool StateReader::take(size_t n) {
+    if (!_ok || static_cast<size_t>(_end - _p) < n) {
+        _ok = false;
+        return false;
+    }
+    return true;
+}
+
+unsigned char StateReader::u8() {
+    if (!take(1))
+        return 0;
+    return static_cast<unsigned char>(*_p++);
+}
+
+uint32_t StateReader::u32() {
+    if (!take(4))
+        return 0;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(_p[i])) << (8 * i);
+    _p += 4;
+    return v;
+}
+
+uint64_t StateReader::u64() {
+    uint64_t lo = u32();
+    uint64_t hi = u32();
+    return lo | (hi << 32);
+}
+
+std::string StateReader::str() {
+    size_t len;
+    const char* p = bytes(len);
+    return std::string(p, len);
+}
+
+const char* StateReader::bytes(size_t& len) {
+    len = u32();
+    if (!take(len)) {
+        len = 0;
+        return _p;
+    }
+    const char* p = _p;
+    _p += len;
+    return p;
+}
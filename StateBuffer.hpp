@@ -0,0 +1,49 @@
+#ifndef STATEBUFFER_HPP
+#define STATEBUFFER_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// Flat binary encoding of server state, for handing it to another process
+// (hot restart). Integers are little endian, strings length prefixed.
+class StateWriter {
+    public:
+        void u8(unsigned char v) { _out += static_cast<char>(v); }
+        void u32(uint32_t v);
+        void u64(uint64_t v);
+        void str(const std::string& s) { bytes(s.data(), s.size()); }
+        void bytes(const char* data, size_t len);
+
+        const std::string& data() const { return _out; }
+
+    private:
+        std::string _out;
+};
+
+// Reads what a StateWriter wrote. Reading past the end fails for good:
+// every later read returns zeros / empty strings and ok() is false, so a
+// truncated or corrupt state is checked once, at the end.
+class StateReader {
+    public:
+        StateReader(const char* data, size_t len) : _p(data), _end(data + len), _ok(true) {}
+
+        unsigned char u8();
+        uint32_t u32();
+        uint64_t u64();
+        std::string str();
+        // a length-prefixed byte string in place, valid as long as the data
+        const char* bytes(size_t& len);
+
+        bool ok() const { return _ok; }
+        bool atEnd() const { return _p == _end; }
+
+    private:
+        const char* _p;
+        const char* _end;
+        bool _ok;
+
+        bool take(size_t n);
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "TimerWheel.hpp"
+
+#include <time.h>
+
+TimerWheel::TimerWheel(unsigned tickMs)
+    : _tickMs(tickMs ? tickMs : 1),
+    _current(monotonicMs() / _tickMs),
+    _count(0) {
+    for (int l = 0; l < LEVELS; l++) {
+        _occupied[l] = 0;
+        for (int s = 0; s < SLOTS; s++)
+            _slots[l][s].prev = _slots[l][s].next = &_slots[l][s];
+    }
+}
+
+uint64_t TimerWheel::monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec) / 1000000;
+}
+
+void TimerWheel::schedule(TimerNode& t, uint64_t whenMs) {
+    if (t.scheduled())
+        unlink(t);
+    else
+        ++_count;
+    t.expires = (whenMs + _tickMs - 1) / _tickMs;
+    insert(t);
+}
+
+void TimerWheel::cancel(TimerNode& t) {
+    if (!t.scheduled())
+        return;
+    unlink(t);
+    --_count;
+}
+
+// Level by distance, slot by the absolute expiry bits of that level: a slot
+// is run (level 0) or cascaded (above) exactly when _current reaches it
+void TimerWheel::insert(TimerNode& t) {
+    uint64_t e = t.expires < _current ? _current : t.expires;
+    uint64_t delta = e - _current;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (static_cast<uint64_t>(1) << (SLOT_BITS * (level + 1))))
+        ++level;
+    if (delta >= (static_cast<uint64_t>(1) << (SLOT_BITS * LEVELS)))
+        e = _current + (static_cast<uint64_t>(1) << (SLOT_BITS * LEVELS)) - 1; // parked, re-placed on cascade
+
+    unsigned slot = static_cast<unsigned>(e >> (SLOT_BITS * level)) & (SLOTS - 1);
+    TimerNode& head = _slots[level][slot];
+    t.next = &head;
+    t.prev = head.prev;
+    head.prev->next = &t;
+    head.prev = &t;
+    _occupied[level] |= static_cast<uint64_t>(1) << slot;
+}
+
+void TimerWheel::unlink(TimerNode& t) {
+    TimerNode* next = t.next;
+    t.prev->next = next;
+    next->prev = t.prev;
+    t.prev = t.next = 0;
+
+    // the last entry of its slot: next is then the head, the only node that links to itself
+    if (next->next == next) {
+        size_t i = static_cast<size_t>(next - &_slots[0][0]);
+        _occupied[i / SLOTS] &= ~(static_cast<uint64_t>(1) << (i % SLOTS));
+    }
+}
+
+// Re-places the timers of a higher level slot whose span just started
+void TimerWheel::cascade(int level, unsigned slot) {
+    TimerNode& head = _slots[level][slot];
+    TimerNode* t = head.next;
+    head.prev = head.next = &head;
+    _occupied[level] &= ~(static_cast<uint64_t>(1) << slot);
+
+    while (t != &head) {
+        TimerNode* next = t->next;
+        insert(*t);
+        t = next;
+    }
+}
+
+void TimerWheel::advance(uint64_t nowMs, std::vector<uint64_t>& fired) {
+    uint64_t target = nowMs / _tickMs;
+
+    while (true) {
+        // ticks with nothing to run or cascade are skipped, not walked
+        uint64_t tick = nextWork();
+        if (tick > target) {
+            if (_current <= target)
+                _current = target + 1;
+            return;
+        }
+        _current = tick;
+
+        // entering a new span of level 1 (and maybe above): move its timers down
+        for (int l = 1; l < LEVELS; l++) {
+            if ((_current & ((static_cast<uint64_t>(1) << (SLOT_BITS * l)) - 1)) != 0)
+                break;
+            cascade(l, static_cast<unsigned>(_current >> (SLOT_BITS * l)) & (SLOTS - 1));
+        }
+
+        unsigned slot = static_cast<unsigned>(_current) & (SLOTS - 1);
+        TimerNode& head = _slots[0][slot];
+        while (head.next != &head) {
+            TimerNode& t = *head.next;
+            unlink(t);
+            --_count;
+            fired.push_back(t.token);
+        }
+        ++_current;
+    }
+}
+
+// First tick at or after _current at which level has a slot to run or cascade
+uint64_t TimerWheel::nextTick(int level) const {
+    uint64_t occ = _occupied[level];
+    if (occ == 0)
+        return ~static_cast<uint64_t>(0);
+
+    unsigned shift = SLOT_BITS * level;
+    uint64_t span = _current >> shift;
+    // level 0 runs the current slot at _current; a higher level cascades a
+    // slot at the start of its span, so the current span only if it starts now
+    if (level > 0 && (_current & ((static_cast<uint64_t>(1) << shift) - 1)) != 0)
+        ++span;
+
+    unsigned from = static_cast<unsigned>(span) & (SLOTS - 1);
+    uint64_t rotated = from ? (occ >> from) | (occ << (SLOTS - from)) : occ;
+    uint64_t when = span + static_cast<uint64_t>(__builtin_ctzll(rotated));
+    return when << shift;
+}
+
+uint64_t TimerWheel::nextWork() const {
+    uint64_t tick = ~static_cast<uint64_t>(0);
+    for (int l = 0; l < LEVELS; l++) {
+        uint64_t t = nextTick(l);
+        if (t < tick)
+            tick = t;
+    }
+    return tick;
+}
+
+int TimerWheel::timeoutMs(uint64_t nowMs) const {
+    if (_count == 0)
+        return -1;
+
+    uint64_t at = nextWork() * _tickMs;
+    if (at <= nowMs)
+        return 0;
+    uint64_t wait = at - nowMs;
+    return wait > 0x7fffffff ? 0x7fffffff : static_cast<int>(wait);
+}
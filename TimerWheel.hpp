@@ -0,0 +1,66 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Intrusive timer: lives inside the object it times (a connection record),
+// so scheduling never allocates and cancelling is an unlink.
+struct TimerNode {
+    TimerNode* prev;   // 0 while not scheduled
+    TimerNode* next;
+    uint64_t expires;  // in wheel ticks
+    uint64_t token;    // handed back when it fires
+
+    TimerNode() : prev(0), next(0), expires(0), token(0) {}
+    bool scheduled() const { return prev != 0; }
+};
+
+// Hierarchical timing wheel: LEVELS rings of SLOTS lists, level L slots
+// SLOTS^L ticks wide. schedule() and cancel() are O(1); a timer moves
+// down a level at most LEVELS - 1 times before it fires, so advancing
+// costs nothing per idle connection. An occupancy bitmap per level finds
+// the next tick with work without walking empty slots.
+class TimerWheel {
+    public:
+        enum {
+            SLOT_BITS = 6,
+            SLOTS = 1 << SLOT_BITS,
+            LEVELS = 4 // 64^4 ticks: about 19 days at 100 ms
+        };
+
+        explicit TimerWheel(unsigned tickMs);
+
+        // (re)schedules t to fire at the first tick at or after whenMs
+        void schedule(TimerNode& t, uint64_t whenMs);
+        void cancel(TimerNode& t);
+
+        // Runs the wheel up to nowMs; tokens of the timers that fired are appended
+        void advance(uint64_t nowMs, std::vector<uint64_t>& fired);
+        // ms until the wheel has something to do, -1 if it is empty
+        int timeoutMs(uint64_t nowMs) const;
+
+        size_t size() const { return _count; }
+
+        // CLOCK_MONOTONIC in ms, the time base of every wheel
+        static uint64_t monotonicMs();
+
+    private:
+        TimerWheel(const TimerWheel&);
+        TimerWheel& operator=(const TimerWheel&);
+
+        unsigned _tickMs;
+        uint64_t _current;              // next tick to run
+        size_t _count;
+        TimerNode _slots[LEVELS][SLOTS]; // list heads (circular, sentinel)
+        uint64_t _occupied[LEVELS];     // bit i: _slots[level][i] is not empty
+
+        void insert(TimerNode& t);
+        void unlink(TimerNode& t);
+        void cascade(int level, unsigned slot);
+        uint64_t nextTick(int level) const;
+        uint64_t nextWork() const;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef BENCHACCESS_HPP
+#define BENCHACCESS_HPP
+
+#include <fcntl.h>
+#include <string>
+
+#include "../Server.hpp"
+
+// Drives Server internals directly, without sockets or an event loop.
+// Clients are backed by /dev/null fds on the poll backend (which accepts any fd),
+// all on one shard that acts as the lock holder for the whole (single threaded) run.
+// What it sends stays in its batch until deliverQueued(), the part unlockState()
+// runs after releasing the lock.
+struct BenchAccess {
+    static bool attachPoller(Server& s) {
+        Shard* sh = new Shard(0, Poller::create("poll"));
+        s._shards.push_back(sh);
+        if (!sh->init(1))
+            return false;
+        s._current = sh;
+        return true;
+    }
+
+    static int addClient(Server& s, const std::string& nick) {
+        int fd = open("/dev/null", O_RDWR);
+        if (fd < 0)
+            return -1;
+        return addVirtualClient(s, nick, fd);
+    }
+
+    // No real fd behind it: fine as long as it is never disconnected (close())
+    // or flushed. Lets fan-out benches go past RLIMIT_NOFILE.
+    static int addVirtualClient(Server& s, const std::string& nick, int fd) {
+        Client& c = s._clients.open(fd);
+        c.passOk = c.hasNick = c.hasUser = c.registered = true;
+        c.nick = nick;
+        c.user = "bench";
+        Server::refreshPrefix(c);
+        s._nickToFd[nick] = fd;
+        s._current->poller->add(fd, ClientTable::tokenOf(c), true);
+        s._current->own(fd, ClientTable::tokenOf(c));
+        return fd;
+    }
+
+    static void join(Server& s, int fd, const std::string& chan) {
+        ParsedMessage m;
+        m.command = "JOIN";
+        m.params.push_back(chan);
+        s.handleJOIN(fd, m);
+    }
+
+    // membership without the JOIN replies/broadcast (those make setup O(n^2))
+    static void addMember(Server& s, int fd, const std::string& chan) {
+        Channel& ch = s._channels[chan];
+        ch.name = chan;
+        ch.addMember(fd);
+        s._clients.at(fd).channels.insert(chan);
+    }
+
+    static void broadcast(Server& s, const std::string& chan, const std::string& line) {
+        std::map<std::string, Channel>::iterator it = s._channels.find(chan);
+        if (it == s._channels.end())
+            return;
+        Reply r;
+        r << line;
+        s.broadcastToChannel(it->second, r.payload(), -1);
+    }
+
+    static void sendLine(Server& s, int fd, const std::string& line) {
+        s.sendLine(fd, line);
+    }
+
+    static void sendNumeric(Server& s, int fd, const char* code, const std::string& target,
+                            const std::string& arg, const char* text) {
+        s.sendNumeric(fd, code, target, arg, text);
+    }
+
+    static void deliverQueued(Server& s) {
+        Shard& sh = *s._current;
+        s.deliverBatch(sh, sh.outbound[sh.id]);
+        sh.outbound[sh.id].clear();
+    }
+
+    static void dropOutput(Server& s, int fd) {
+        Client* c = s._clients.find(fd);
+        if (c) {
+            Shard::add(s._current->queuedBytes, -static_cast<long>(c->out.bytes()));
+            c->out.clear();
+        }
+    }
+
+    static void disconnect(Server& s, int fd) {
+        s.disconnectClient(fd);
+    }
+
+    static size_t channelCount(const Server& s) {
+        return s._channels.size();
+    }
+};
+
+#endif
@@ -0,0 +1,75 @@
+// Mass disconnect: N clients spread over M channels all leave at once
+// (think network blip). Usage: disconnect_bench [clients] [channels] [channels-per-client]
+
+#include "BenchAccess.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+static double nowMs() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static std::string numbered(const char* prefix, size_t i) {
+    std::ostringstream ss;
+    ss << prefix << i;
+    return ss.str();
+}
+
+int main(int argc, char** argv) {
+    size_t clients = argc > 1 ? std::strtoul(argv[1], 0, 10) : 10000;
+    size_t channels = argc > 2 ? std::strtoul(argv[2], 0, 10) : 50000;
+    size_t perClient = argc > 3 ? std::strtoul(argv[3], 0, 10) : 5;
+    if (clients == 0 || channels == 0 || perClient == 0)
+        return 1;
+
+    // one fd per client
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Server server(0, "bench", ServerConfig());
+    if (!BenchAccess::attachPoller(server))
+        return 1;
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < clients; i++) {
+        int fd = BenchAccess::addClient(server, numbered("n", i));
+        if (fd < 0) {
+            std::fprintf(stderr, "out of fds after %lu clients\n", static_cast<unsigned long>(i));
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    // client i takes channels i*perClient .. i*perClient+perClient-1 (mod channels),
+    // so every channel exists once clients*perClient >= channels
+    for (size_t i = 0; i < clients; i++) {
+        for (size_t k = 0; k < perClient; k++)
+            BenchAccess::join(server, fds[i], numbered("#c", (i * perClient + k) % channels));
+    }
+    BenchAccess::deliverQueued(server);
+    for (size_t i = 0; i < clients; i++)
+        BenchAccess::dropOutput(server, fds[i]);
+
+    size_t chanBefore = BenchAccess::channelCount(server);
+    double t0 = nowMs();
+    for (size_t i = 0; i < clients; i++) {
+        BenchAccess::disconnect(server, fds[i]);
+        BenchAccess::deliverQueued(server);
+    }
+    double ms = nowMs() - t0;
+
+    std::printf("disconnect: %lu clients, %lu channels (%lu per client): %.1f ms, %.2f us/client\n",
+                static_cast<unsigned long>(clients), static_cast<unsigned long>(chanBefore),
+                static_cast<unsigned long>(perClient), ms, ms * 1000.0 / clients);
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Channel fan-out: one channel with N members, R broadcasts of a PRIVMSG.
+// The roster walk (under the state lock in the server) and the delivery to
+// the members' queues (on their shards, after it) are timed apart: the first
+// is the part of a broadcast that does not scale with the shards.
+// Usage: fanout_bench [members] [rounds]
+
+#include "BenchAccess.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <sys/time.h>
+
+static double nowMs() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    size_t members = argc > 1 ? std::strtoul(argv[1], 0, 10) : 10000;
+    size_t rounds = argc > 2 ? std::strtoul(argv[2], 0, 10) : 20;
+    if (members == 0 || rounds == 0)
+        return 1;
+
+    Server server(0, "bench", ServerConfig());
+    if (!BenchAccess::attachPoller(server))
+        return 1;
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < members; i++) {
+        std::ostringstream nick;
+        nick << "n" << i;
+        // members are never flushed or closed, so no real fds are needed
+        int fd = BenchAccess::addVirtualClient(server, nick.str(), static_cast<int>(i) + 64);
+        fds.push_back(fd);
+        BenchAccess::addMember(server, fd, "#big");
+    }
+
+    std::string line = ":n0!bench@localhost PRIVMSG #big :" + std::string(100, 'x');
+    double locked = 0, total = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        double t0 = nowMs();
+        BenchAccess::broadcast(server, "#big", line);
+        double t1 = nowMs();
+        BenchAccess::deliverQueued(server);
+        locked += t1 - t0;
+        total += nowMs() - t0;
+        for (size_t i = 0; i < fds.size(); i++)
+            BenchAccess::dropOutput(server, fds[i]);
+    }
+
+    double perMember = static_cast<double>(rounds) * members;
+    std::printf("fanout: %lu members, %lu rounds: %.2f ms/broadcast, %.1f ns/member"
+                " (%.1f locked, %.0f%%)\n",
+                static_cast<unsigned long>(members), static_cast<unsigned long>(rounds),
+                total / rounds, total * 1e6 / perMember, locked * 1e6 / perMember,
+                total > 0 ? locked * 100 / total : 0);
+    return 0;
+}
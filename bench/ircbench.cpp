@@ -0,0 +1,672 @@
+// Load generator: real clients over TCP against a running ircserv on localhost.
+// Connects and registers the clients, joins them to channels, then sends
+// PRIVMSGs at a fixed total rate. Every message carries its send time, so the
+// receiving clients measure end-to-end latency.
+//
+// Usage: ircbench [-p port[,port...]] [-w password] [-c clients] [-C channels]
+//                 [-k channels-per-client] [-d one|many|zipf] [-r msgs/sec]
+//                 [-t seconds] [-s line-bytes] [-P server-pid]
+//
+// Several ports: linked servers on localhost, the clients spread round robin
+// over them, so a channel's messages cross the links; the delivery rate is
+// the whole network's.
+//
+// Start the server with IRCSERV_FLOOD_RATE=0: with flood control on, any
+// client sending above its rate is throttled and latency measures the throttle.
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+namespace {
+
+const char* kMarker = " :ircbench "; // what tells our PRIVMSGs from anything else
+const size_t kConnectsInFlight = 256; // connections opened but not yet registered
+
+unsigned long long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Latency histogram in microseconds: exact below 64 us, then 32 buckets per
+// power of two (about 3% wide), so percentiles need no per-sample storage.
+class Histogram {
+    public:
+        enum { LINEAR = 64, PER_OCTAVE = 32, OCTAVES = 40 };
+
+        Histogram() : _counts(LINEAR + OCTAVES * PER_OCTAVE, 0), _total(0), _max(0) {}
+
+        void add(unsigned long long us) {
+            ++_counts[indexOf(us)];
+            ++_total;
+            if (us > _max)
+                _max = us;
+        }
+
+        unsigned long long total() const { return _total; }
+        unsigned long long max() const { return _max; }
+
+        // upper bound of the bucket holding the q-th fraction of the samples
+        unsigned long long percentile(double q) const {
+            unsigned long long want = static_cast<unsigned long long>(std::ceil(q * _total));
+            if (want == 0)
+                want = 1;
+            unsigned long long seen = 0;
+            for (size_t i = 0; i < _counts.size(); i++) {
+                seen += _counts[i];
+                if (seen >= want)
+                    return upperOf(i);
+            }
+            return _max;
+        }
+
+    private:
+        std::vector<unsigned long long> _counts;
+        unsigned long long _total;
+        unsigned long long _max;
+
+        static size_t indexOf(unsigned long long us) {
+            if (us < LINEAR)
+                return static_cast<size_t>(us);
+            int bit = 63;
+            while (!(us >> bit))
+                --bit;
+            size_t octave = static_cast<size_t>(bit - 6); // bit >= 6 here
+            if (octave >= OCTAVES)
+                return LINEAR + OCTAVES * PER_OCTAVE - 1;
+            size_t sub = static_cast<size_t>((us >> (bit - 5)) - PER_OCTAVE);
+            return LINEAR + octave * PER_OCTAVE + sub;
+        }
+
+        static unsigned long long upperOf(size_t i) {
+            if (i < LINEAR)
+                return i;
+            size_t octave = (i - LINEAR) / PER_OCTAVE;
+            size_t sub = (i - LINEAR) % PER_OCTAVE;
+            return ((PER_OCTAVE + sub + 1ULL) << (octave + 1)) - 1;
+        }
+};
+
+struct Options {
+    std::vector<int> ports;
+    std::string password;
+    size_t clients;
+    size_t channels;
+    size_t perClient;
+    std::string dist; // "one", "many" or "zipf"
+    double rate;      // messages a second, all clients together
+    double seconds;
+    size_t lineBytes; // PRIVMSG lines are padded to this length
+    long serverPid;   // 0: look for a process named ircserv
+
+    Options() : password("pass"), clients(1000), channels(100), perClient(1),
+                dist("many"), rate(1000), seconds(10), lineBytes(100), serverPid(0) {}
+};
+
+struct Conn {
+    int fd;
+    std::string in;
+    std::string out;
+    unsigned int events;    // epoll interest currently registered
+    bool connected;
+    bool registered;
+    bool closed;
+    size_t joinsLeft;       // JOIN answers (366 or an error) still expected
+    std::vector<size_t> chans;
+    size_t nextChan;        // round robin over chans for the messages it sends
+    std::vector<std::string> stats; // 249 texts of the STATS being waited for
+    bool statsDone;
+
+    Conn() : fd(-1), events(0), connected(false), registered(false), closed(false),
+             joinsLeft(0), nextChan(0), statsDone(false) {}
+};
+
+// Channels of each client. "one": everyone in #bench0. "many": channel i % C
+// for client i (and the next k-1). "zipf": k channels drawn with weight 1/rank,
+// so a few big channels and a long tail of small ones.
+void layout(const Options& o, std::vector<Conn>& conns, std::vector<size_t>& members) {
+    size_t channels = o.dist == "one" ? 1 : o.channels;
+    size_t k = o.perClient < channels ? o.perClient : channels;
+    members.assign(channels, 0);
+
+    std::vector<double> cumulative;
+    if (o.dist == "zipf") {
+        double sum = 0;
+        for (size_t r = 0; r < channels; r++) {
+            sum += 1.0 / static_cast<double>(r + 1);
+            cumulative.push_back(sum);
+        }
+    }
+
+    std::srand(1); // same layout every run
+    for (size_t i = 0; i < conns.size(); i++) {
+        std::vector<size_t>& chans = conns[i].chans;
+        while (chans.size() < k) {
+            size_t ch;
+            if (o.dist == "one")
+                ch = 0;
+            else if (o.dist == "zipf") {
+                double x = cumulative.back() * (std::rand() / (RAND_MAX + 1.0));
+                ch = static_cast<size_t>(std::upper_bound(cumulative.begin(), cumulative.end(), x) - cumulative.begin());
+                if (ch >= channels)
+                    ch = channels - 1;
+            } else
+                ch = (i + chans.size()) % channels;
+            bool dup = false;
+            for (size_t j = 0; j < chans.size(); j++)
+                dup = dup || chans[j] == ch;
+            if (dup)
+                continue;
+            chans.push_back(ch);
+            ++members[ch];
+        }
+    }
+}
+
+class Load {
+    public:
+        Load(const Options& o) : _o(o), _ep(-1), _opened(0), _settled(0), _ready(0), _failed(0),
+                                 _sent(0), _expected(0), _delivered(0), _lastDelivery(0) {}
+
+        bool run();
+
+    private:
+        const Options& _o;
+        int _ep;
+        std::vector<Conn> _conns;
+        std::vector<size_t> _members;
+        std::vector<int> _byFd; // fd -> index in _conns, -1 if none
+        size_t _opened;
+        size_t _settled;        // connections registered or given up on
+        size_t _ready;          // done with setup: every JOIN answered, or closed
+        size_t _failed;         // connections that could not be made or were closed
+        unsigned long long _sent;
+        unsigned long long _expected; // deliveries the sent messages should cause
+        unsigned long long _delivered;
+        unsigned long long _lastDelivery;
+        Histogram _latency;
+
+        bool openOne();
+        void queue(Conn& c, const std::string& line);
+        void flush(Conn& c);
+        void watch(Conn& c);
+        void drop(Conn& c);
+        void onReadable(Conn& c);
+        void onLine(Conn& c, const char* line, size_t len);
+        void pump(int timeoutMs);
+        void sendOne(size_t from);
+        bool stats(const char* query, std::vector<std::string>& out);
+        long serverRss(long& peakKb);
+};
+
+bool Load::openOne() {
+    Conn& c = _conns[_opened++];
+    c.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c.fd < 0) {
+        std::perror("socket");
+        return false;
+    }
+    fcntl(c.fd, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<unsigned short>(_o.ports[(_opened - 1) % _o.ports.size()]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(c.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        std::perror("connect");
+        close(c.fd);
+        c.fd = -1;
+        c.closed = true;
+        ++_failed;
+        ++_settled;
+        ++_ready;
+        return true;
+    }
+    if (static_cast<size_t>(c.fd) >= _byFd.size())
+        _byFd.resize(c.fd + 1, -1);
+    _byFd[c.fd] = static_cast<int>(&c - &_conns[0]);
+
+    // the handshake goes out once connect() completes
+    char nick[32];
+    std::snprintf(nick, sizeof(nick), "b%ld_%lu", static_cast<long>(getpid() % 10000),
+                  static_cast<unsigned long>(&c - &_conns[0]));
+    queue(c, "PASS " + _o.password);
+    queue(c, std::string("NICK ") + nick);
+    queue(c, std::string("USER ") + nick + " 0 * :ircbench");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = c.fd;
+    epoll_ctl(_ep, EPOLL_CTL_ADD, c.fd, &ev);
+    c.events = ev.events;
+    return true;
+}
+
+void Load::queue(Conn& c, const std::string& line) {
+    c.out += line;
+    c.out += "\r\n";
+}
+
+void Load::flush(Conn& c) {
+    while (c.connected && !c.out.empty()) {
+        ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                drop(c);
+            break;
+        }
+        c.out.erase(0, static_cast<size_t>(n));
+    }
+    if (!c.closed)
+        watch(c);
+}
+
+// EPOLLOUT only while something waits to be written (or connect() is pending)
+void Load::watch(Conn& c) {
+    unsigned int want = EPOLLIN;
+    if (!c.connected || !c.out.empty())
+        want |= EPOLLOUT;
+    if (want == c.events)
+        return;
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.fd = c.fd;
+    epoll_ctl(_ep, EPOLL_CTL_MOD, c.fd, &ev);
+    c.events = want;
+}
+
+void Load::drop(Conn& c) {
+    if (c.closed)
+        return;
+    epoll_ctl(_ep, EPOLL_CTL_DEL, c.fd, 0);
+    close(c.fd);
+    _byFd[c.fd] = -1;
+    c.closed = true;
+    ++_failed;
+    if (!c.registered)
+        ++_settled; // frees its handshake slot
+    if (!c.registered || c.joinsLeft > 0) {
+        c.joinsLeft = 0;
+        ++_ready;
+    }
+}
+
+void Load::onReadable(Conn& c) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c.in.append(buf, static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            drop(c);
+            return;
+        }
+        break;
+    }
+
+    size_t start = 0;
+    size_t nl;
+    while ((nl = c.in.find('\n', start)) != std::string::npos) {
+        size_t len = nl - start;
+        if (len > 0 && c.in[start + len - 1] == '\r')
+            --len;
+        onLine(c, c.in.data() + start, len);
+        start = nl + 1;
+    }
+    c.in.erase(0, start);
+    flush(c);
+}
+
+void Load::onLine(Conn& c, const char* line, size_t len) {
+    // ":<prefix> PRIVMSG #benchN :ircbench <send time> <padding>", by far the
+    // most frequent line: read in place, the bench must outrun the server
+    const char* end = line + len;
+    const char* mark = std::search(line, end, kMarker, kMarker + std::strlen(kMarker));
+    if (mark != end) {
+        unsigned long long sentAt = 0;
+        for (const char* p = mark + std::strlen(kMarker); p < end && *p >= '0' && *p <= '9'; p++)
+            sentAt = sentAt * 10 + static_cast<unsigned long long>(*p - '0');
+        unsigned long long now = nowUs();
+        _latency.add(now > sentAt ? now - sentAt : 0);
+        ++_delivered;
+        _lastDelivery = now;
+        return;
+    }
+
+    std::string l(line, len);
+
+    if (l.compare(0, 5, "PING ") == 0) {
+        queue(c, "PONG " + l.substr(5));
+        return;
+    }
+
+    // numerics: ":<server> <code> <me> ..."
+    size_t sp = l.find(' ');
+    if (sp == std::string::npos || l.size() < sp + 4)
+        return;
+    std::string code = l.substr(sp + 1, 3);
+    if (code == "001" && !c.registered) {
+        c.registered = true;
+        ++_settled;
+        c.joinsLeft = c.chans.size();
+        for (size_t i = 0; i < c.chans.size(); i++) {
+            char chan[32];
+            std::snprintf(chan, sizeof(chan), "JOIN #bench%lu", static_cast<unsigned long>(c.chans[i]));
+            queue(c, chan);
+        }
+        if (c.joinsLeft == 0)
+            ++_ready;
+    } else if (c.joinsLeft > 0 && (code == "366" || code == "471" || code == "473" || code == "475")) {
+        if (--c.joinsLeft == 0)
+            ++_ready;
+    } else if (code == "249") {
+        size_t text = l.find(" :", sp);
+        if (text != std::string::npos)
+            c.stats.push_back(l.substr(text + 2));
+    } else if (code == "219") {
+        c.statsDone = true;
+    }
+}
+
+void Load::pump(int timeoutMs) {
+    struct epoll_event events[1024];
+    int n = epoll_wait(_ep, events, 1024, timeoutMs);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd < 0 || static_cast<size_t>(fd) >= _byFd.size() || _byFd[fd] < 0)
+            continue;
+        Conn& c = _conns[_byFd[fd]];
+        if (!c.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int err = 0;
+            socklen_t errLen = sizeof(err);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+            if (err != 0) {
+                drop(c);
+                continue;
+            }
+            c.connected = true;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            onReadable(c);
+        if (!c.closed && (events[i].events & EPOLLOUT))
+            flush(c);
+    }
+}
+
+// one PRIVMSG from conns[from] to the next of its channels
+void Load::sendOne(size_t from) {
+    Conn& c = _conns[from];
+    size_t ch = c.chans[c.nextChan++ % c.chans.size()];
+    char head[96];
+    std::snprintf(head, sizeof(head), "PRIVMSG #bench%lu%s%llu ", static_cast<unsigned long>(ch), kMarker, nowUs());
+    std::string line(head);
+    line.append(_o.lineBytes > line.size() ? _o.lineBytes - line.size() : 0, 'x');
+    queue(c, line);
+    flush(c);
+    ++_sent;
+    _expected += _members[ch] - 1;
+}
+
+// "STATS <query>" from the first live client, the 249 texts it answers with
+bool Load::stats(const char* query, std::vector<std::string>& out) {
+    for (size_t i = 0; i < _conns.size(); i++) {
+        Conn& c = _conns[i];
+        if (c.closed || !c.registered)
+            continue;
+        c.stats.clear();
+        c.statsDone = false;
+        queue(c, std::string("STATS ") + query);
+        flush(c);
+        unsigned long long deadline = nowUs() + 5000000ULL;
+        while (!c.closed && !c.statsDone && nowUs() < deadline)
+            pump(100);
+        out = c.stats;
+        return c.statsDone;
+    }
+    return false;
+}
+
+// the server's resident set (and its peak), in kB, from /proc; -1 if unknown
+long Load::serverRss(long& peakKb) {
+    long pid = _o.serverPid;
+    if (pid == 0) {
+        // the only process named ircserv, if there is exactly one
+        DIR* proc = opendir("/proc");
+        if (!proc)
+            return -1;
+        struct dirent* e;
+        int found = 0;
+        while ((e = readdir(proc)) != 0) {
+            long p = std::strtol(e->d_name, 0, 10);
+            if (p <= 0)
+                continue;
+            char path[64], comm[64] = "";
+            std::snprintf(path, sizeof(path), "/proc/%ld/comm", p);
+            FILE* f = std::fopen(path, "r");
+            if (!f)
+                continue;
+            if (std::fgets(comm, sizeof(comm), f) && std::strcmp(comm, "ircserv\n") == 0) {
+                pid = p;
+                ++found;
+            }
+            std::fclose(f);
+        }
+        closedir(proc);
+        if (found != 1)
+            return -1;
+    }
+
+    char path[64], line[256];
+    std::snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE* f = std::fopen(path, "r");
+    if (!f)
+        return -1;
+    long rss = -1;
+    peakKb = -1;
+    while (std::fgets(line, sizeof(line), f)) {
+        if (std::strncmp(line, "VmRSS:", 6) == 0)
+            rss = std::strtol(line + 6, 0, 10);
+        else if (std::strncmp(line, "VmHWM:", 6) == 0)
+            peakKb = std::strtol(line + 6, 0, 10);
+    }
+    std::fclose(f);
+    return rss;
+}
+
+// "total <calls> syscalls for <messages> messages ..." from STATS e
+bool parseTotals(const std::vector<std::string>& lines, unsigned long long& calls, unsigned long long& msgs) {
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (std::sscanf(lines[i].c_str(), "total %llu syscalls for %llu messages", &calls, &msgs) == 2)
+            return true;
+    }
+    return false;
+}
+
+bool Load::run() {
+    _ep = epoll_create(1024);
+    if (_ep < 0) {
+        std::perror("epoll_create");
+        return false;
+    }
+    _conns.resize(_o.clients);
+    layout(_o, _conns, _members);
+
+    // connect, register and join, a bounded number of handshakes at a time
+    unsigned long long t0 = nowUs();
+    unsigned long long lastProgress = t0;
+    size_t lastReady = 0;
+    while (_ready < _conns.size()) {
+        while (_opened < _conns.size() && _opened - _settled < kConnectsInFlight) {
+            if (!openOne())
+                return false;
+        }
+        pump(10);
+        unsigned long long now = nowUs();
+        if (_ready != lastReady) {
+            lastReady = _ready;
+            lastProgress = now;
+        } else if (now - lastProgress > 10000000ULL) {
+            std::fprintf(stderr, "ircbench: setup stalled, %lu of %lu clients ready\n",
+                         static_cast<unsigned long>(_ready), static_cast<unsigned long>(_conns.size()));
+            return false;
+        }
+    }
+    size_t biggest = 0;
+    for (size_t i = 0; i < _members.size(); i++)
+        biggest = _members[i] > biggest ? _members[i] : biggest;
+    std::printf("setup: %lu clients (%lu failed), %lu channels (%s, largest %lu members) in %.2f s\n",
+                static_cast<unsigned long>(_conns.size()), static_cast<unsigned long>(_failed),
+                static_cast<unsigned long>(_members.size()), _o.dist.c_str(),
+                static_cast<unsigned long>(biggest), (nowUs() - t0) / 1e6);
+
+    std::vector<std::string> flood, before, after;
+    if (stats("f", flood) && !flood.empty() && flood[0].find("limits off") == std::string::npos)
+        std::printf("warning: server flood control is on (%s), start it with IRCSERV_FLOOD_RATE=0\n",
+                    flood[0].c_str());
+    stats("e", before);
+
+    // senders take turns, skipping closed connections
+    std::vector<size_t> senders;
+    for (size_t i = 0; i < _conns.size(); i++) {
+        if (!_conns[i].closed && !_conns[i].chans.empty())
+            senders.push_back(i);
+    }
+    if (senders.empty()) {
+        std::fprintf(stderr, "ircbench: no client left to send\n");
+        return false;
+    }
+
+    _delivered = 0;
+    _latency = Histogram();
+    unsigned long long start = nowUs();
+    unsigned long long end = start + static_cast<unsigned long long>(_o.seconds * 1e6);
+    size_t turn = 0;
+    for (unsigned long long now = start; now < end; now = nowUs()) {
+        // catch up to the schedule, at most a second's worth at once
+        unsigned long long due = static_cast<unsigned long long>((now - start) / 1e6 * _o.rate);
+        for (size_t burst = 0; _sent < due && burst < static_cast<size_t>(_o.rate) + 1; burst++) {
+            size_t from = senders[turn++ % senders.size()];
+            if (!_conns[from].closed)
+                sendOne(from);
+        }
+        pump(1);
+    }
+    unsigned long long sendEnd = nowUs();
+
+    // let what is in flight arrive
+    unsigned long long drainUntil = sendEnd + 5000000ULL;
+    while (_delivered < _expected && nowUs() < drainUntil)
+        pump(10);
+    stats("e", after);
+
+    double window = (_lastDelivery > start ? _lastDelivery - start : 1) / 1e6;
+    std::printf("sent: %llu messages in %.2f s (%.0f/s, target %.0f/s)\n",
+                _sent, (sendEnd - start) / 1e6, _sent / ((sendEnd - start) / 1e6), _o.rate);
+    std::printf("delivered: %llu of %llu expected (%.1f%%), %.0f msgs/s\n",
+                _delivered, _expected, _expected ? 100.0 * _delivered / _expected : 100.0,
+                _delivered / window);
+    if (_latency.total() > 0)
+        std::printf("latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+                    _latency.percentile(0.50) / 1e3, _latency.percentile(0.99) / 1e3,
+                    _latency.percentile(0.999) / 1e3, _latency.max() / 1e3);
+
+    unsigned long long c0, m0, c1, m1;
+    if (parseTotals(before, c0, m0) && parseTotals(after, c1, m1) && m1 > m0)
+        std::printf("server: %llu syscalls for %llu messages (%.4f per message)\n",
+                    c1 - c0, m1 - m0, static_cast<double>(c1 - c0) / (m1 - m0));
+    long peak = -1;
+    long rss = serverRss(peak);
+    if (rss >= 0)
+        std::printf("server rss: %ld kB (peak %ld kB)\n", rss, peak);
+    else
+        std::printf("server rss: unknown (pass -P <pid>)\n");
+    if (_failed > 0)
+        std::printf("closed: %lu connections\n", static_cast<unsigned long>(_failed));
+
+    for (size_t i = 0; i < _conns.size(); i++) {
+        if (!_conns[i].closed)
+            close(_conns[i].fd);
+    }
+    close(_ep);
+    return true;
+}
+
+void usage() {
+    std::fprintf(stderr, "usage: ircbench [-p port[,port...]] [-w password] [-c clients] [-C channels]\n"
+                         "                [-k channels-per-client] [-d one|many|zipf] [-r msgs/sec]\n"
+                         "                [-t seconds] [-s line-bytes] [-P server-pid]\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:c:C:k:d:r:t:s:P:")) != -1) {
+        switch (opt) {
+            case 'p': {
+                o.ports.clear();
+                char* s = optarg;
+                while (true) {
+                    char* end;
+                    o.ports.push_back(static_cast<int>(std::strtol(s, &end, 10)));
+                    if (*end != ',')
+                        break;
+                    s = end + 1;
+                }
+                break;
+            }
+            case 'w': o.password = optarg; break;
+            case 'c': o.clients = std::strtoul(optarg, 0, 10); break;
+            case 'C': o.channels = std::strtoul(optarg, 0, 10); break;
+            case 'k': o.perClient = std::strtoul(optarg, 0, 10); break;
+            case 'd': o.dist = optarg; break;
+            case 'r': o.rate = std::strtod(optarg, 0); break;
+            case 't': o.seconds = std::strtod(optarg, 0); break;
+            case 's': o.lineBytes = std::strtoul(optarg, 0, 10); break;
+            case 'P': o.serverPid = std::strtol(optarg, 0, 10); break;
+            default: usage(); return 1;
+        }
+    }
+    if (o.ports.empty())
+        o.ports.push_back(6667);
+    bool portsOk = true;
+    for (size_t i = 0; i < o.ports.size(); i++)
+        portsOk = portsOk && o.ports[i] > 0 && o.ports[i] <= 65535;
+    if (!portsOk || o.clients < 2 || o.channels == 0 || o.perClient == 0
+        || o.rate <= 0 || o.seconds <= 0 || (o.dist != "one" && o.dist != "many" && o.dist != "zipf")) {
+        usage();
+        return 1;
+    }
+
+    // one fd per client
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Load load(o);
+    return load.run() ? 0 : 1;
+}
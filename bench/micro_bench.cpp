@@ -0,0 +1,275 @@
+// Microbenchmarks of the hot paths, each on its own: parsing, splitting the
+// input into lines, formatting replies into a client's output queue, and
+// channel fan-out from 10 to 100k members. Reports ns/op and heap
+// allocations/op (malloc is interposed below and counted), and writes the
+// results as JSON so two commits can be diffed.
+// Usage: micro_bench [out.json] [ms-per-bench]
+
+#include "BenchAccess.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <time.h>
+
+// Counting malloc: the executable's definitions win over libc's, the
+// glibc-internal entry points do the actual work. operator new ends up here too.
+namespace {
+    unsigned long g_allocs = 0;
+}
+
+extern "C" {
+    void* __libc_malloc(size_t n);
+    void* __libc_calloc(size_t n, size_t size);
+    void* __libc_realloc(void* p, size_t n);
+
+    void* malloc(size_t n) throw() {
+        ++g_allocs;
+        return __libc_malloc(n);
+    }
+
+    void* calloc(size_t n, size_t size) throw() {
+        ++g_allocs;
+        return __libc_calloc(n, size);
+    }
+
+    void* realloc(void* p, size_t n) throw() {
+        ++g_allocs;
+        return __libc_realloc(p, n);
+    }
+}
+
+namespace {
+
+double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+std::string numbered(const char* prefix, size_t i) {
+    std::ostringstream ss;
+    ss << prefix << i;
+    return ss.str();
+}
+
+// One benchmark: run() does some operations and says how many,
+// reset() undoes their side effects outside the measurement.
+struct Bench {
+    virtual ~Bench() {}
+    virtual size_t run() = 0;
+    virtual void reset() {}
+};
+
+struct Result {
+    std::string name;
+    unsigned long long ops;
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+Result measure(const std::string& name, Bench& b, double minNs) {
+    b.reset();
+    b.run(); // warm up caches and lazily grown buffers
+    Result r;
+    r.name = name;
+    r.ops = 0;
+    double ns = 0;
+    unsigned long allocs = 0;
+    while (ns < minNs) {
+        b.reset();
+        unsigned long a0 = g_allocs;
+        double t0 = nowNs();
+        r.ops += b.run();
+        ns += nowNs() - t0;
+        allocs += g_allocs - a0;
+    }
+    r.nsPerOp = ns / r.ops;
+    r.allocsPerOp = static_cast<double>(allocs) / r.ops;
+    std::printf("%-24s %12.1f ns/op %10.2f allocs/op\n", name.c_str(), r.nsPerOp, r.allocsPerOp);
+    return r;
+}
+
+// The lines a busy server reads most, in three shapes
+std::vector<std::string> corpus(const std::string& kind) {
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < 64; i++) {
+        if (kind == "ping")
+            lines.push_back("PING :" + numbered("tok", i));
+        else if (kind == "privmsg") {
+            // a full line: 510 bytes before the "\r\n"
+            std::string line = ":" + numbered("nick", i) + "!user@localhost PRIVMSG #channel :";
+            line.append(510 - line.size(), 'x');
+            lines.push_back(line);
+        } else
+            lines.push_back("MODE #channel +itkol-o+o " + numbered("key", i) + " 25 alice bob carol dave");
+    }
+    return lines;
+}
+
+struct ParseLine : Bench {
+    std::vector<std::string> lines;
+    size_t sink;
+    ParseLine(const std::vector<std::string>& l) : lines(l), sink(0) {}
+    size_t run() {
+        for (size_t i = 0; i < lines.size(); i++)
+            sink += parseLine(lines[i]).params.size();
+        return lines.size();
+    }
+};
+
+// what the server runs: the view parse, then the copy into its scratch message
+struct ParseView : Bench {
+    std::vector<std::string> lines;
+    ParsedMessage msg;
+    ParseView(const std::vector<std::string>& l) : lines(l) {}
+    size_t run() {
+        for (size_t i = 0; i < lines.size(); i++) {
+            MessageView view;
+            if (parseLineView(lines[i].data(), lines[i].size(), view))
+                assignMessage(view, msg, MessageView::MAX_PARAMS);
+        }
+        return lines.size();
+    }
+};
+
+// A client's input arriving in recv()-sized chunks, cut into lines; op = one line
+struct SplitLines : Bench {
+    std::string stream;
+    size_t lineCount;
+    size_t sink;
+    SplitLines() : lineCount(0), sink(0) {
+        const char* kinds[] = { "ping", "privmsg", "mode" };
+        for (size_t k = 0; k < 3; k++) {
+            std::vector<std::string> lines = corpus(kinds[k]);
+            for (size_t i = 0; i < lines.size(); i++) {
+                stream += lines[i] + "\r\n";
+                ++lineCount;
+            }
+        }
+    }
+    size_t run() {
+        LineBuffer in;
+        size_t off = 0;
+        while (off < stream.size()) {
+            size_t n = std::min(in.writable(), stream.size() - off);
+            std::memcpy(in.writePtr(), stream.data() + off, n);
+            in.commit(n);
+            off += n;
+            const char* line;
+            size_t len;
+            while (in.nextLine(line, len))
+                sink += len;
+        }
+        return lineCount;
+    }
+};
+
+// Replies queued on one client; op = one line
+struct SendLines : Bench {
+    Server& s;
+    int fd;
+    bool numeric;
+    std::string nick, chan, line;
+    SendLines(Server& srv, int f, bool num) : s(srv), fd(f), numeric(num), nick("bench0"), chan("#channel"),
+        line(":bench0!bench@localhost PRIVMSG #channel :" + std::string(60, 'x')) {}
+    size_t run() {
+        for (size_t i = 0; i < 1000; i++) {
+            if (numeric)
+                BenchAccess::sendNumeric(s, fd, "403", nick, chan, "No such channel");
+            else
+                BenchAccess::sendLine(s, fd, line);
+        }
+        BenchAccess::deliverQueued(s);
+        return 1000;
+    }
+    void reset() { BenchAccess::dropOutput(s, fd); }
+};
+
+// One PRIVMSG to a channel; op = one broadcast (formatting and delivery included)
+struct Fanout : Bench {
+    Server& s;
+    std::string chan, line;
+    size_t members;
+    Fanout(Server& srv, const std::string& c, size_t m) : s(srv), chan(c),
+        line(":n0!bench@localhost PRIVMSG " + c + " :" + std::string(100, 'x')), members(m) {}
+    size_t run() {
+        BenchAccess::broadcast(s, chan, line);
+        BenchAccess::deliverQueued(s);
+        return 1;
+    }
+    void reset() {
+        for (size_t i = 0; i < members; i++)
+            BenchAccess::dropOutput(s, static_cast<int>(i) + 64);
+    }
+};
+
+bool writeJson(const char* path, const std::vector<Result>& results) {
+    FILE* f = std::fopen(path, "w");
+    if (!f)
+        return false;
+    // one result per line, in a fixed order, so commits diff line by line
+    std::fprintf(f, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::fprintf(f, "    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}%s\n",
+                     r.name.c_str(), r.ops, r.nsPerOp, r.allocsPerOp, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(f, "  ]\n}\n");
+    return std::fclose(f) == 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    const char* jsonPath = argc > 1 ? argv[1] : 0;
+    double minNs = (argc > 2 ? std::strtod(argv[2], 0) : 200) * 1e6;
+    if (minNs <= 0)
+        return 1;
+
+    std::vector<Result> results;
+    const char* kinds[] = { "ping", "privmsg", "mode" };
+    for (size_t k = 0; k < 3; k++) {
+        ParseLine p(corpus(kinds[k]));
+        results.push_back(measure(std::string("parseLine/") + kinds[k], p, minNs));
+    }
+    for (size_t k = 0; k < 3; k++) {
+        ParseView p(corpus(kinds[k]));
+        results.push_back(measure(std::string("parseLineView/") + kinds[k], p, minNs));
+    }
+    SplitLines split;
+    results.push_back(measure("splitLines/mixed", split, minNs));
+
+    // fan-out channels #f10 .. #f100000 over the same virtual clients
+    Server server(0, "bench", ServerConfig());
+    if (!BenchAccess::attachPoller(server))
+        return 1;
+    const size_t sizes[] = { 10, 100, 1000, 10000, 100000 };
+    const size_t maxMembers = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    for (size_t i = 0; i < maxMembers; i++) {
+        // members are never flushed or closed, so no real fds are needed
+        int fd = BenchAccess::addVirtualClient(server, numbered("n", i), static_cast<int>(i) + 64);
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            if (i < sizes[j])
+                BenchAccess::addMember(server, fd, numbered("#f", sizes[j]));
+        }
+    }
+
+    SendLines lines(server, 64, false);
+    results.push_back(measure("sendLine", lines, minNs));
+    SendLines numerics(server, 64, true);
+    results.push_back(measure("sendNumeric", numerics, minNs));
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        Fanout f(server, numbered("#f", sizes[j]), sizes[j]);
+        results.push_back(measure(numbered("broadcast/", sizes[j]), f, minNs));
+    }
+
+    if (jsonPath && !writeJson(jsonPath, results)) {
+        std::perror(jsonPath);
+        return 1;
+    }
+    return 0;
+}
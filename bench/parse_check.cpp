@@ -0,0 +1,111 @@
+// parseLineView must give what parseLine gives, for every input: checks it on
+// a corpus of edge cases (one line per line of the file, taken as is) and on
+// random lines made of the bytes the parser cares about.
+// A line with more than 15 params may make parseLineView give up: the server
+// then falls back to parseLine, so that is only checked to be the reason.
+// Usage: parse_check [corpus] [random-lines]
+
+#include "../IRCParser.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+namespace {
+
+// deterministic, so a failure is reproducible
+unsigned long g_seed = 12345;
+
+unsigned long nextRandom() {
+    g_seed = g_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return g_seed >> 33;
+}
+
+std::string printable(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c < 0x7f) {
+            out += static_cast<char>(c);
+        } else {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+std::string describe(const ParsedMessage& m) {
+    std::string out = "tags=[" + printable(m.tags) + "] prefix=[" + printable(m.prefix)
+                    + "] command=[" + printable(m.command) + "]";
+    for (size_t i = 0; i < m.params.size(); i++)
+        out += " [" + printable(m.params[i]) + "]";
+    return out;
+}
+
+bool same(const ParsedMessage& a, const ParsedMessage& b) {
+    return a.tags == b.tags && a.prefix == b.prefix && a.command == b.command && a.params == b.params;
+}
+
+// true if both parsers agree on line
+bool check(const std::string& line, ParsedMessage& scratch) {
+    ParsedMessage expected = parseLine(line);
+    MessageView view;
+    if (!parseLineView(line.data(), line.size(), view)) {
+        if (expected.params.size() > MessageView::MAX_PARAMS)
+            return true;
+        std::printf("parseLineView gave up on [%s], parseLine has %lu params\n",
+                    printable(line).c_str(), static_cast<unsigned long>(expected.params.size()));
+        return false;
+    }
+    assignMessage(view, scratch, MessageView::MAX_PARAMS);
+    if (same(expected, scratch))
+        return true;
+    std::printf("mismatch on [%s]\n  parseLine:     %s\n  parseLineView: %s\n", printable(line).c_str(),
+                describe(expected).c_str(), describe(scratch).c_str());
+    return false;
+}
+
+}
+
+int main(int argc, char** argv) {
+    const char* corpusPath = argc > 1 ? argv[1] : "bench/parse_corpus.txt";
+    unsigned long randomLines = argc > 2 ? std::strtoul(argv[2], 0, 10) : 2000000;
+
+    std::ifstream corpus(corpusPath);
+    if (!corpus) {
+        std::fprintf(stderr, "parse_check: cannot read %s\n", corpusPath);
+        return 1;
+    }
+    ParsedMessage scratch;
+    unsigned long corpusLines = 0;
+    unsigned long failures = 0;
+    std::string line;
+    while (std::getline(corpus, line)) {
+        ++corpusLines;
+        if (!check(line, scratch))
+            ++failures;
+    }
+
+    // mostly separators, so the random lines hit the corner cases
+    static const char kAlphabet[] = "  ::@;ab=+\t";
+    std::string random;
+    for (unsigned long i = 0; i < randomLines && failures < 10; i++) {
+        random.clear();
+        size_t len = nextRandom() % 48;
+        for (size_t j = 0; j < len; j++)
+            random += kAlphabet[nextRandom() % (sizeof(kAlphabet) - 1)];
+        if (!check(random, scratch))
+            ++failures;
+    }
+
+    if (failures != 0) {
+        std::printf("parse_check: %lu failures\n", failures);
+        return 1;
+    }
+    std::printf("parse_check: %lu corpus lines, %lu random lines, parseLineView == parseLine\n",
+                corpusLines, randomLines);
+    return 0;
+}
@@ -36,9 +36,18 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    Server server(port, password);
-    if (!server.init())
+    ServerConfig config = ServerConfig::fromEnv();
+    Logger::setLevel(config.logLevel);
+    Server server(port, password, config);
+    server.setCommandLine(argv);
+    // started by a hot restart: the old process hands over its sockets
+    int upgradeFd = Server::upgradeFd();
+    if (upgradeFd != -1 ? !server.resume(upgradeFd) : !server.init())
+        return 1;
+    // from here on the event loops log through the ring, not the streams
+    if (!Logger::start())
         return 1;
     server.run();
+    Logger::stop();
     return 0;
 }